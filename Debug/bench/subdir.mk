@@ -0,0 +1,42 @@
+################################################################################
+# Benchmark tools, built next to the server but not linked into it
+################################################################################
+
+# Add inputs and outputs from these tool invocations to the build variables 
+C_SRCS += \
+../bench/fanout_bench.c \
+../bench/loadgen.c 
+
+LOADGEN_OBJS += \
+./bench/loadgen.o 
+
+FANOUT_BENCH_OBJS += \
+./bench/chat_server_nomain.o \
+./bench/fanout_bench.o 
+
+C_DEPS += \
+./bench/chat_server_nomain.d \
+./bench/fanout_bench.d \
+./bench/loadgen.d 
+
+# system calls fanout_bench counts in the server code it links
+FANOUT_BENCH_WRAP := -Wl,--wrap=read,--wrap=write,--wrap=writev,--wrap=pwrite,--wrap=close,--wrap=shutdown,--wrap=epoll_ctl
+
+
+# the server as fanout_bench measures it: built like src/, without main()
+bench/chat_server_nomain.o: ../src/chat_server.c
+	@echo 'Building file: $<'
+	@echo 'Invoking: GCC C Compiler'
+	gcc -DCHAT_SERVER_NO_MAIN -O0 -g3 -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
+	@echo 'Finished building: $<'
+	@echo ' '
+
+# Benchmark drivers are built optimized so they are never the bottleneck
+bench/%.o: ../bench/%.c
+	@echo 'Building file: $<'
+	@echo 'Invoking: GCC C Compiler'
+	gcc -O2 -g3 -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
+	@echo 'Finished building: $<'
+	@echo ' '
+
+
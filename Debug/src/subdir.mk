@@ -5,15 +5,57 @@
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
 ../src/chat_server.c \
-../src/helper.c 
+../src/epoch.c \
+../src/hash_map.c \
+../src/helper.c \
+../src/history.c \
+../src/history_log.c \
+../src/intern.c \
+../src/ip_trie.c \
+../src/lock_stats.c \
+../src/logger.c \
+../src/mailbox.c \
+../src/msg_buf.c \
+../src/out_queue.c \
+../src/stats.c \
+../src/timestamp.c \
+../src/trace.c 
 
 OBJS += \
 ./src/chat_server.o \
-./src/helper.o 
+./src/epoch.o \
+./src/hash_map.o \
+./src/helper.o \
+./src/history.o \
+./src/history_log.o \
+./src/intern.o \
+./src/ip_trie.o \
+./src/lock_stats.o \
+./src/logger.o \
+./src/mailbox.o \
+./src/msg_buf.o \
+./src/out_queue.o \
+./src/stats.o \
+./src/timestamp.o \
+./src/trace.o 
 
 C_DEPS += \
 ./src/chat_server.d \
-./src/helper.d 
+./src/epoch.d \
+./src/hash_map.d \
+./src/helper.d \
+./src/history.d \
+./src/history_log.d \
+./src/intern.d \
+./src/ip_trie.d \
+./src/lock_stats.d \
+./src/logger.d \
+./src/mailbox.d \
+./src/msg_buf.d \
+./src/out_queue.d \
+./src/stats.d \
+./src/timestamp.d \
+./src/trace.d 
 
 
 # Each subdirectory must supply rules for building sources it contributes
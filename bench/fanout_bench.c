@@ -0,0 +1,477 @@
+/*===========================================================================
+ Filename    : fanout_bench.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : In-process benchmark of the server's own work.  Links the
+               server without its main(), connects synthetic clients over
+               socketpairs and calls the fanout, broadcast, history and
+               command paths directly, reporting ns/op and system calls/op
+               for each room size and mute density as JSON lines.  Given a
+               baseline, it fails when a case got slower.
+===========================================================================*/
+
+#define CHAT_SERVER_NO_TABLES
+#include "../src/chat_server.h"
+
+
+#define DFLT_SIZES          "1,10,100,1000"
+#define DFLT_MUTES          "0,0.1,0.5"
+#define DFLT_MIN_TIME       0.2                 /* seconds measured per case */
+#define DFLT_TOLERANCE      0.25                /* slowdown a baseline comparison accepts */
+#define MAX_CASES           16                  /* sizes or mute densities given */
+#define BATCH               32                  /* ops timed between drains */
+#define SOCK_BUFFER_SIZE    ( 1 << 20 )
+#define NSEC_PER_SEC        1000000000ULL
+#define BENCH_NAME_SIZE     32
+#define BASELINE_FORMAT     "{\"bench\":\"%31[^\"]\",\"members\":%d,\"mute\":%lf,\"ops\":%*u,\"ns_per_op\":%lf,\"syscalls_per_op\":%lf}"
+
+#define BENCH_OPT_STRING    "n:m:T:b:t:"
+
+
+// the server's state, set up here the way main() would
+extern reactor_t *reactors;
+extern int num_reactors;
+extern __thread reactor_t *this_reactor;
+extern hash_map_t room_index;
+extern hash_map_t opening_rooms;
+extern stat_sem_t room_table_mutex;
+extern ip_trie_t block_list;
+extern chat_room_t *lobby;
+extern char *history_dir;
+extern int history_depth;
+#ifdef LOCK_STATS
+extern lock_class_t room_table_class;
+#endif
+
+// one of the synthetic clients
+typedef struct bench_client_t
+{
+    user_t             *user;
+    int                 peer;                   /* our end of the client's socketpair */
+} bench_client_t;
+
+// a case from the baseline
+typedef struct baseline_t
+{
+    char                bench[ BENCH_NAME_SIZE ];
+    int                 members;
+    double              mute;
+    double              ns_per_op;
+    double              syscalls_per_op;
+} baseline_t;
+
+
+static bench_client_t  *clients;
+static int              num_clients;
+static bool             counting;               /* count system calls only while timing */
+static unsigned long    syscalls;
+
+static baseline_t      *baseline;
+static int              baseline_count;
+static double           tolerance = DFLT_TOLERANCE;
+static int              regressions;
+
+
+// System calls made by the server, counted through the linker's --wrap
+ssize_t __real_read( int fd, void *buf, size_t count );
+ssize_t __real_write( int fd, const void *buf, size_t count );
+ssize_t __real_writev( int fd, const struct iovec *iov, int iovcnt );
+ssize_t __real_pwrite( int fd, const void *buf, size_t count, off_t offset );
+int __real_close( int fd );
+int __real_shutdown( int fd, int how );
+int __real_epoll_ctl( int epfd, int op, int fd, struct epoll_event *event );
+
+ssize_t __wrap_read( int fd, void *buf, size_t count )
+{
+    syscalls += counting;
+    return __real_read( fd, buf, count );
+}
+
+ssize_t __wrap_write( int fd, const void *buf, size_t count )
+{
+    syscalls += counting;
+    return __real_write( fd, buf, count );
+}
+
+ssize_t __wrap_writev( int fd, const struct iovec *iov, int iovcnt )
+{
+    syscalls += counting;
+    return __real_writev( fd, iov, iovcnt );
+}
+
+ssize_t __wrap_pwrite( int fd, const void *buf, size_t count, off_t offset )
+{
+    syscalls += counting;
+    return __real_pwrite( fd, buf, count, offset );
+}
+
+int __wrap_close( int fd )
+{
+    syscalls += counting;
+    return __real_close( fd );
+}
+
+int __wrap_shutdown( int fd, int how )
+{
+    syscalls += counting;
+    return __real_shutdown( fd, how );
+}
+
+int __wrap_epoll_ctl( int epfd, int op, int fd, struct epoll_event *event )
+{
+    syscalls += counting;
+    return __real_epoll_ctl( epfd, op, fd, event );
+}
+
+
+static uint64_t now_ns( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+// Read and throw away what the server sent the first count clients, and let
+// the epoch free what the last ops retired
+static void drain( int count )
+{
+    char buf[ 1 << 16 ];
+    int i;
+
+    for( i = 0; i < count; i++ )
+        while( read( clients[ i ].peer, buf, sizeof( buf ) ) > 0 )
+            ;
+
+    if( epoch_pending() )
+        epoch_reclaim();
+}
+
+// run a command line as the client would send it
+static void run_line( user_t *user, const char *line )
+{
+    char msg[ MAX_LINE ];
+
+    strncpy( msg, line, MAX_LINE - 1 );
+    msg[ MAX_LINE - 1 ] = '\0';
+    strcpy( user->user_msg, msg );
+
+    process_client_msg( user, msg );
+}
+
+// Connect and log in clients over socketpairs, the same way the reactor would
+static void add_clients( int count )
+{
+    struct in_addr loopback = { htonl( INADDR_LOOPBACK ) };
+    int size = SOCK_BUFFER_SIZE;
+    int pair[ 2 ];
+    char name[ MAX_USER_NAME_LEN ];
+    int i;
+
+    clients = calloc( count, sizeof( bench_client_t ) );
+    if( clients == NULL )
+        server_error( "Error allocating clients" );
+
+    for( i = 0; i < count; i++ )
+    {
+        if( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) < 0 )
+            server_error( "Error calling socketpair()" );
+
+        setsockopt( pair[ 0 ], SOL_SOCKET, SO_SNDBUF, &size, sizeof( size ) );
+        setsockopt( pair[ 1 ], SOL_SOCKET, SO_RCVBUF, &size, sizeof( size ) );
+        set_sock_nonblock( pair[ 1 ] );
+
+        clients[ i ].peer = pair[ 1 ];
+        clients[ i ].user = claim_user_slot();
+        if( clients[ i ].user == NULL )
+            server_error( "Error claiming user slot" );
+
+        attach_client( this_reactor, clients[ i ].user, pair[ 0 ], loopback );
+        snprintf( name, sizeof( name ), "bench%d", i );
+        get_username( clients[ i ].user, name );
+        num_clients++;
+
+        // everyone in the lobby hears about each login
+        if( i % BATCH == 0 )
+            drain( num_clients );
+    }
+
+    drain( num_clients );
+}
+
+// Every fraction-th member of the room (not the sender) mutes the sender
+static void set_mutes( int members, double fraction, bool muted )
+{
+    int i;
+
+    for( i = 1; i < members; i++ )
+    {
+        if( (int)( ( i + 1 ) * fraction ) > (int)( i * fraction ) )
+            set_muted( clients[ i ].user, clients[ 0 ].user->name_id, muted );
+    }
+}
+
+static baseline_t *find_baseline( const char *bench, int members, double mute )
+{
+    int i;
+
+    for( i = 0; i < baseline_count; i++ )
+    {
+        if( strcmp( baseline[ i ].bench, bench ) == 0 && baseline[ i ].members == members &&
+            baseline[ i ].mute > mute - 0.0005 && baseline[ i ].mute < mute + 0.0005 )
+            return &baseline[ i ];
+    }
+
+    return NULL;
+}
+
+static void report( const char *bench, int members, double mute, unsigned long ops, uint64_t elapsed_ns, unsigned long calls )
+{
+    double ns_per_op = (double)elapsed_ns / ops;
+    double syscalls_per_op = (double)calls / ops;
+    baseline_t *base = find_baseline( bench, members, mute );
+
+    printf( "{\"bench\":\"%s\",\"members\":%d,\"mute\":%.3f,\"ops\":%lu,\"ns_per_op\":%.1f,\"syscalls_per_op\":%.3f}\n",
+            bench, members, mute, ops, ns_per_op, syscalls_per_op );
+    fflush( stdout );
+
+    // system calls per op are exact, time gets some slack
+    if( base != NULL && ( ns_per_op > base->ns_per_op * ( 1 + tolerance ) || syscalls_per_op > base->syscalls_per_op + 0.01 ) )
+    {
+        fprintf( stderr, "REGRESSION %s members=%d mute=%.3f: %.1f ns/op (was %.1f), %.3f syscalls/op (was %.3f) \n",
+                 bench, members, mute, ns_per_op, base->ns_per_op, syscalls_per_op, base->syscalls_per_op );
+        regressions++;
+    }
+}
+
+// Time op in batches until min_time has been spent in it.  What the server
+// sent the members is drained between batches, outside the timing.
+static void measure( const char *bench, int members, double mute, double min_time,
+                     void (*op)( int members ) )
+{
+    uint64_t elapsed = 0;
+    uint64_t start;
+    unsigned long ops = 0;
+    unsigned long calls = 0;
+    int i;
+
+    // warm up caches and any lazily grown buffers
+    for( i = 0; i < BATCH; i++ )
+        op( members );
+    drain( num_clients );
+
+    while( elapsed < min_time * NSEC_PER_SEC )
+    {
+        syscalls = 0;
+        counting = true;
+        start = now_ns();
+
+        for( i = 0; i < BATCH; i++ )
+            op( members );
+
+        elapsed += now_ns() - start;
+        counting = false;
+        calls += syscalls;
+        ops += BATCH;
+
+        drain( num_clients );
+    }
+
+    report( bench, members, mute, ops, elapsed, calls );
+}
+
+static void op_write_chatroom( int members )
+{
+    write_chatroom( clients[ 0 ].user, "%s: %s", clients[ 0 ].user->user_name, "the quick brown fox jumps over the lazy dog" );
+}
+
+static void op_write_all_clients( int members )
+{
+    write_all_clients( "[%s BROADCAST]: %s \n", timestamp_text(), "the quick brown fox jumps over the lazy dog" );
+}
+
+static void op_get_history( int members )
+{
+    char *argv[] = { CMD_HISTORY, NULL };
+
+    get_history( clients[ 0 ].user, 1, argv );
+}
+
+static void op_list( int members )
+{
+    run_line( clients[ 0 ].user, "/list" );
+}
+
+static void op_whereami( int members )
+{
+    run_line( clients[ 0 ].user, "/whereami" );
+}
+
+static void op_get_command( int members )
+{
+    char msg[ MAX_LINE ] = "/whisper bench1 the quick brown fox jumps over the lazy dog";
+    char *argv[ MAX_ARGS ];
+
+    get_command( msg, argv );
+}
+
+// Run the room benchmarks with the first members clients in a room of their
+// own, once for each mute density
+static void run_room( int members, double *mutes, int num_mutes, double min_time )
+{
+    char line[ MAX_LINE ];
+    int i;
+
+    snprintf( line, sizeof( line ), "/createchatroom fan%d", members );
+    run_line( clients[ 0 ].user, line );
+    snprintf( line, sizeof( line ), "/joinchatroom fan%d", members );
+    for( i = 1; i < members; i++ )
+    {
+        run_line( clients[ i ].user, line );
+        if( i % BATCH == 0 )
+            drain( num_clients );
+    }
+
+    // fill the history so /history has a full screen to send
+    for( i = 0; i < history_depth; i++ )
+        op_write_chatroom( members );
+    drain( num_clients );
+
+    for( i = 0; i < num_mutes; i++ )
+    {
+        set_mutes( members, mutes[ i ], true );
+
+        measure( "write_chatroom", members, mutes[ i ], min_time, op_write_chatroom );
+        measure( "get_history", members, mutes[ i ], min_time, op_get_history );
+        measure( "process_command_list", members, mutes[ i ], min_time, op_list );
+
+        set_mutes( members, mutes[ i ], false );
+    }
+
+    for( i = 0; i < members; i++ )
+    {
+        run_line( clients[ i ].user, "/leavechatroom" );
+        if( i % BATCH == 0 )
+            drain( num_clients );
+    }
+    drain( num_clients );
+}
+
+static int parse_list( char *text, double *values )
+{
+    char *save;
+    char *item;
+    int count = 0;
+
+    for( item = strtok_r( text, ",", &save ); item != NULL && count < MAX_CASES; item = strtok_r( NULL, ",", &save ) )
+        values[ count++ ] = atof( item );
+
+    return count;
+}
+
+static void load_baseline( const char *path )
+{
+    FILE *file = fopen( path, "r" );
+    char line[ MAX_LINE ];
+    baseline_t entry;
+
+    if( file == NULL )
+        server_error( "Cannot read baseline" );
+
+    while( fgets( line, sizeof( line ), file ) != NULL )
+    {
+        if( sscanf( line, BASELINE_FORMAT, entry.bench, &entry.members, &entry.mute, &entry.ns_per_op, &entry.syscalls_per_op ) != 5 )
+            continue;
+
+        baseline = realloc( baseline, ( baseline_count + 1 ) * sizeof( baseline_t ) );
+        if( baseline == NULL )
+            server_error( "Error allocating baseline" );
+        baseline[ baseline_count++ ] = entry;
+    }
+
+    fclose( file );
+}
+
+int main( int argc, char *argv[ ] )
+{
+    char sizes_text[ MAX_LINE ] = DFLT_SIZES;
+    char mutes_text[ MAX_LINE ] = DFLT_MUTES;
+    double sizes[ MAX_CASES ];
+    double mutes[ MAX_CASES ];
+    double min_time = DFLT_MIN_TIME;
+    int num_sizes;
+    int num_mutes;
+    int max_size = 0;
+    int opt;
+    int i;
+
+    while( ( opt = getopt( argc, argv, BENCH_OPT_STRING ) ) != -1 )
+    {
+        switch( opt )
+        {
+        case 'n': strncpy( sizes_text, optarg, MAX_LINE - 1 ); break;
+        case 'm': strncpy( mutes_text, optarg, MAX_LINE - 1 ); break;
+        case 'T': min_time = atof( optarg ); break;
+        case 'b': load_baseline( optarg ); break;
+        case 't': tolerance = atof( optarg ); break;
+
+        default:
+            fprintf( stderr, "Usage: %s [-n sizes] [-m mute fractions] [-T seconds per case] [-b baseline] [-t tolerance] \n"
+                             "    defaults: -n %s -m %s -T %.1f -t %.2f \n",
+                     argv[ 0 ], DFLT_SIZES, DFLT_MUTES, DFLT_MIN_TIME, DFLT_TOLERANCE );
+            return EXIT_FAILURE;
+        }
+    }
+
+    num_sizes = parse_list( sizes_text, sizes );
+    num_mutes = parse_list( mutes_text, mutes );
+    for( i = 0; i < num_sizes; i++ )
+        if( (int)sizes[ i ] > max_size )
+            max_size = (int)sizes[ i ];
+    if( max_size < 2 )
+        max_size = 2;
+
+    // what main() sets up, with one reactor running on this thread, no
+    // listening socket and no history logs
+    log_set_level( LOG_LEVEL_WARN );
+    if( hash_map_init( &room_index, false ) != HASH_MAP_OK ||
+        hash_map_init( &opening_rooms, false ) != HASH_MAP_OK )
+        server_error( "Error allocating room index" );
+    stat_sem_init( &room_table_mutex, &room_table_class, "rooms" );
+    init_commands();
+    if( ip_trie_init( &block_list ) != IP_TRIE_OK )
+        server_error( "Error allocating block list" );
+    init_user_thread( max_size );
+    history_dir = NULL;
+
+    num_reactors = 1;
+    reactors = calloc( num_reactors, sizeof( reactor_t ) );
+    if( reactors == NULL )
+        server_error( "Error allocating reactors" );
+    reactors[ 0 ].epoll_fd = epoll_create1( 0 );
+    if( reactors[ 0 ].epoll_fd < 0 || init_mailbox( &reactors[ 0 ].mailbox ) < 0 )
+        server_error( "Error setting up reactor" );
+    this_reactor = &reactors[ 0 ];
+
+    if( open_chat_room( DFLT_CHATROOM_NAME, &lobby ) != SUCCESS )
+        server_error( "Error creating lobby" );
+    add_clients( max_size );
+
+    measure( "get_command", 0, 0, min_time, op_get_command );
+    measure( "process_command_whereami", 0, 0, min_time, op_whereami );
+    measure( "write_all_clients", num_clients, 0, min_time, op_write_all_clients );
+
+    for( i = 0; i < num_sizes; i++ )
+        run_room( (int)sizes[ i ], mutes, num_mutes, min_time );
+
+    if( regressions > 0 )
+    {
+        fprintf( stderr, "%d regressions against the baseline \n", regressions );
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,712 @@
+/*===========================================================================
+ Filename    : loadgen.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Load generator for the chat server.  Opens many clients over
+               loopback, logs each in, spreads them over chat rooms and has
+               every client chat at a fixed rate.  Each message carries its
+               send time, so every copy received gives one send-to-receive
+               latency.  Results are printed as one line of JSON.
+===========================================================================*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "../src/helper.h"  /*  line reading, socket options */
+
+
+#define DFLT_HOST           "127.0.0.1"
+#define DFLT_PORT           "3456"
+#define DFLT_CLIENTS        1000
+#define DFLT_ROOMS          10
+#define DFLT_RATE           1.0                 /* messages per second per client */
+#define DFLT_DURATION       10                  /* measured seconds */
+#define DFLT_WARMUP         2                   /* seconds sent but not measured */
+#define DFLT_SIZE           32                  /* bytes of chat text per message */
+#define DFLT_THREADS        1
+#define DFLT_SETUP_TIMEOUT  60                  /* seconds to get every client into its room */
+#define DFLT_PREFIX         "lg"                /* user and room names start with this */
+
+#define DRAIN_NS            ( 2 * NSEC_PER_SEC )    /* keep reading this long after the last send */
+#define START_DELAY_NS      ( NSEC_PER_SEC / 10 )   /* between setup finishing and the first send */
+#define NSEC_PER_SEC        1000000000ULL
+#define NSEC_PER_USEC       1000ULL
+#define MAX_EVENTS          256
+#define OUT_BUFFER_SIZE     ( 2 * MAX_LINE )
+#define MSG_TAG             ": LG "             /* how our chat lines look once the server adds the sender */
+
+#define HIST_SUB_BITS       5                   /* 32 buckets per power of two, about 3% resolution */
+#define HIST_BUCKETS        ( 64 << HIST_SUB_BITS )
+
+#define OPT_STRING          "h:p:c:r:m:d:w:s:j:T:u:l:"
+
+// where a client is in getting set up
+#define CLIENT_PROMPT       0                   /* waiting for "Enter username:" */
+#define CLIENT_LOGIN        1                   /* name sent, waiting to be logged in */
+#define CLIENT_READY        2                   /* logged in, waiting for its room to exist */
+#define CLIENT_JOINING      3                   /* create or join sent */
+#define CLIENT_JOINED       4                   /* in its room, chatting once the run starts */
+#define CLIENT_FAILED       5
+
+// the run as a whole
+#define PHASE_SETUP         0
+#define PHASE_RUN           1
+#define PHASE_DONE          2
+
+
+typedef struct client_t
+{
+    int                 fd;
+    int                 id;
+    int                 room;                   /* -1 stays in the lobby */
+    int                 state;
+    uint64_t            next_send_ns;
+    line_buffer_t       line_buf;
+    char                out[ OUT_BUFFER_SIZE ]; /* written once the socket takes it */
+    size_t              out_len;
+} client_t;
+
+typedef struct lg_thread_t
+{
+    pthread_t           thread;
+    int                 id;
+    int                 epoll_fd;
+    client_t           *clients;
+    int                 num_clients;
+
+    // results, read by main once the thread has finished
+    uint64_t            sent;                   /* messages sent inside the measured window */
+    uint64_t            expected;               /* copies the server should deliver for them */
+    uint64_t            received;               /* copies of them that arrived */
+    uint64_t            skipped;                /* sends skipped because the server was not reading */
+    uint64_t            late;                   /* sends that fell more than an interval behind */
+    uint64_t            latency_sum_ns;
+    uint64_t            latency_max_ns;
+    uint64_t            hist[ HIST_BUCKETS ];
+} lg_thread_t;
+
+
+// options
+static const char  *host = DFLT_HOST;
+static const char  *port = DFLT_PORT;
+static int          num_clients = DFLT_CLIENTS;
+static int          num_rooms = DFLT_ROOMS;
+static double       rate = DFLT_RATE;
+static int          duration = DFLT_DURATION;
+static int          warmup = DFLT_WARMUP;
+static int          msg_size = DFLT_SIZE;
+static int          num_threads = DFLT_THREADS;
+static int          setup_timeout = DFLT_SETUP_TIMEOUT;
+static const char  *prefix = DFLT_PREFIX;
+static const char  *label = "";
+
+static struct addrinfo *server_addr;
+static int         *room_members;               /* clients in each room */
+static char         filler[ MAX_LINE ];
+
+// shared progress, everything else is per thread
+static int          phase = PHASE_SETUP;
+static int          rooms_ready;
+static int          clients_joined;
+static int          clients_failed;
+static uint64_t     run_start_ns;               /* first send */
+static uint64_t     measure_start_ns;           /* after the warmup */
+static uint64_t     measure_end_ns;             /* last send */
+
+
+static uint64_t now_ns( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+static void usage( const char *name )
+{
+    fprintf( stderr,
+        "Usage: %s [options]\n"
+        "    -h <host>      server address (default %s)\n"
+        "    -p <port>      server port (default %s)\n"
+        "    -c <clients>   connections (default %d)\n"
+        "    -r <rooms>     chat rooms to spread them over, 0 keeps everyone in the lobby (default %d)\n"
+        "    -m <rate>      messages per second from each client (default %.1f)\n"
+        "    -d <seconds>   measured time (default %d)\n"
+        "    -w <seconds>   warmup before measuring (default %d)\n"
+        "    -s <bytes>     chat text per message (default %d)\n"
+        "    -j <threads>   load generator threads (default %d)\n"
+        "    -T <seconds>   time allowed to log in and join rooms (default %d)\n"
+        "    -u <prefix>    user and room name prefix, letters and digits (default %s)\n"
+        "    -l <label>     copied into the results to tell runs apart\n",
+        name, DFLT_HOST, DFLT_PORT, DFLT_CLIENTS, DFLT_ROOMS, DFLT_RATE, DFLT_DURATION, DFLT_WARMUP,
+        DFLT_SIZE, DFLT_THREADS, DFLT_SETUP_TIMEOUT, DFLT_PREFIX );
+    exit( EXIT_FAILURE );
+}
+
+// Latencies go into log-linear buckets: the power of two, then the next
+// HIST_SUB_BITS bits below the leading one.
+static int hist_bucket( uint64_t value )
+{
+    int msb;
+
+    if( value < ( 1 << HIST_SUB_BITS ) )
+        return (int)value;
+
+    msb = 63 - __builtin_clzll( value );
+    return ( ( msb - HIST_SUB_BITS + 1 ) << HIST_SUB_BITS ) +
+           (int)( ( value >> ( msb - HIST_SUB_BITS ) ) & ( ( 1 << HIST_SUB_BITS ) - 1 ) );
+}
+
+// middle of a bucket
+static uint64_t hist_value( int bucket )
+{
+    int exp = bucket >> HIST_SUB_BITS;
+    uint64_t sub = bucket & ( ( 1 << HIST_SUB_BITS ) - 1 );
+
+    if( exp == 0 )
+        return sub;
+
+    return ( ( sub | ( 1 << HIST_SUB_BITS ) ) << ( exp - 1 ) ) + ( ( 1ULL << ( exp - 1 ) ) >> 1 );
+}
+
+static uint64_t hist_percentile( uint64_t *hist, uint64_t count, double percentile )
+{
+    uint64_t rank = (uint64_t)( percentile * count + 0.5 );
+    uint64_t seen = 0;
+    int i;
+
+    if( rank == 0 )
+        rank = 1;
+
+    for( i = 0; i < HIST_BUCKETS; i++ )
+    {
+        seen += hist[ i ];
+        if( seen >= rank )
+            return hist_value( i );
+    }
+
+    return 0;
+}
+
+// Send what the client has waiting.  Returns false if the connection failed.
+static bool flush_client( client_t *client )
+{
+    ssize_t n;
+
+    while( client->out_len > 0 )
+    {
+        n = write( client->fd, client->out, client->out_len );
+        if( n < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        memmove( client->out, client->out + n, client->out_len - n );
+        client->out_len -= n;
+    }
+
+    return true;
+}
+
+// Queue a line for the server.  False if it doesn't fit, meaning the server
+// has stopped reading from this client.
+static bool send_line( client_t *client, const char *format, ... )
+{
+    va_list ap;
+    int len;
+
+    va_start( ap, format );
+    len = vsnprintf( client->out + client->out_len, OUT_BUFFER_SIZE - client->out_len, format, ap );
+    va_end( ap );
+
+    if( len < 0 || (size_t)len >= OUT_BUFFER_SIZE - client->out_len )
+        return false;
+
+    client->out_len += len;
+    return flush_client( client );
+}
+
+static void fail_client( client_t *client )
+{
+    if( client->state == CLIENT_FAILED )
+        return;
+
+    if( client->state == CLIENT_JOINED )
+    {
+        __atomic_sub_fetch( &clients_joined, 1, __ATOMIC_RELAXED );
+        if( client->room >= 0 )
+            __atomic_sub_fetch( &room_members[ client->room ], 1, __ATOMIC_RELAXED );
+    }
+
+    client->state = CLIENT_FAILED;
+    __atomic_add_fetch( &clients_failed, 1, __ATOMIC_RELAXED );
+    close( client->fd );
+    client->fd = -1;
+}
+
+static void join_room( client_t *client )
+{
+    client->state = CLIENT_JOINING;
+    if( !send_line( client, "/joinchatroom %s%d\r\n", prefix, client->room ) )
+        fail_client( client );
+}
+
+// one copy of a chat message arrived
+static void record_message( lg_thread_t *thread, const char *text, uint64_t now )
+{
+    uint64_t sent_ns = strtoull( text, NULL, 10 );
+    uint64_t latency;
+
+    // only messages sent inside the measured window count
+    if( sent_ns < measure_start_ns || sent_ns >= measure_end_ns || sent_ns > now )
+        return;
+
+    latency = now - sent_ns;
+    thread->received++;
+    thread->latency_sum_ns += latency;
+    if( latency > thread->latency_max_ns )
+        thread->latency_max_ns = latency;
+    thread->hist[ hist_bucket( latency ) ]++;
+}
+
+static void handle_line( lg_thread_t *thread, client_t *client, char *line, uint64_t now )
+{
+    char expect[ MAX_LINE ];
+    char *msg;
+
+    // chat traffic is by far the most common
+    msg = strstr( line, MSG_TAG );
+    if( msg != NULL )
+    {
+        if( client->state == CLIENT_JOINED )
+            record_message( thread, msg + strlen( MSG_TAG ), now );
+        return;
+    }
+
+    switch( client->state )
+    {
+    case CLIENT_LOGIN:
+        if( strstr( line, "already in use" ) != NULL )
+        {
+            fprintf( stderr, "loadgen: user name %s%d is in use \n", prefix, client->id );
+            fail_client( client );
+        }
+        else if( strstr( line, "logged in as" ) != NULL )
+        {
+            if( client->room < 0 )
+            {
+                client->state = CLIENT_JOINED;
+                __atomic_add_fetch( &clients_joined, 1, __ATOMIC_RELAXED );
+            }
+            else if( client->id < num_rooms )
+            {
+                // the first client of each room creates it
+                client->state = CLIENT_JOINING;
+                if( !send_line( client, "/createchatroom %s%d\r\n", prefix, client->room ) )
+                    fail_client( client );
+            }
+            else
+                client->state = CLIENT_READY;
+        }
+        break;
+
+    case CLIENT_JOINING:
+        // left over from an earlier run, just join it
+        if( strstr( line, "already exists" ) != NULL )
+            join_room( client );
+        else if( strstr( line, "does not exist" ) != NULL )
+            fail_client( client );
+        else
+        {
+            snprintf( expect, sizeof( expect ), "You have joined chatroom %s%d.", prefix, client->room );
+            if( strstr( line, expect ) != NULL )
+            {
+                client->state = CLIENT_JOINED;
+                __atomic_add_fetch( &clients_joined, 1, __ATOMIC_RELAXED );
+                __atomic_add_fetch( &room_members[ client->room ], 1, __ATOMIC_RELAXED );
+                if( client->id < num_rooms )
+                    __atomic_add_fetch( &rooms_ready, 1, __ATOMIC_RELEASE );
+            }
+        }
+        break;
+    }
+}
+
+static void read_client_lines( lg_thread_t *thread, client_t *client )
+{
+    char line[ MAX_LINE ];
+    ssize_t n;
+    uint64_t now = now_ns();
+
+    while( client->state != CLIENT_FAILED )
+    {
+        n = read_line( client->fd, &client->line_buf, line, MAX_LINE );
+        if( n == CONN_ERR )
+        {
+            fail_client( client );
+            return;
+        }
+
+        if( n == READ_AGAIN )
+            break;
+
+        handle_line( thread, client, line, now );
+    }
+
+    // the username prompt doesn't end in a newline
+    if( client->state == CLIENT_PROMPT &&
+        memmem( client->line_buf.data + client->line_buf.start, client->line_buf.end - client->line_buf.start,
+                "Enter username:", strlen( "Enter username:" ) ) != NULL )
+    {
+        init_line_buffer( &client->line_buf );
+        client->state = CLIENT_LOGIN;
+        if( !send_line( client, "%s%d\r\n", prefix, client->id ) )
+            fail_client( client );
+    }
+}
+
+static bool connect_client( lg_thread_t *thread, client_t *client )
+{
+    struct epoll_event ev;
+    client->fd = socket( server_addr->ai_family, SOCK_STREAM, 0 );
+    if( client->fd < 0 )
+        return false;
+
+    if( connect( client->fd, server_addr->ai_addr, server_addr->ai_addrlen ) < 0 )
+    {
+        close( client->fd );
+        return false;
+    }
+
+    set_sock_nodelay( client->fd );
+    set_sock_nonblock( client->fd );
+    init_line_buffer( &client->line_buf );
+    client->out_len = 0;
+    client->state = CLIENT_PROMPT;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = client;
+    if( epoll_ctl( thread->epoll_fd, EPOLL_CTL_ADD, client->fd, &ev ) < 0 )
+    {
+        close( client->fd );
+        return false;
+    }
+
+    return true;
+}
+
+// Send every message that has come due, each one stamped with its send time
+static void send_due( lg_thread_t *thread, uint64_t interval_ns )
+{
+    client_t *client;
+    uint64_t now = now_ns();
+    int i;
+
+    for( i = 0; i < thread->num_clients; i++ )
+    {
+        client = &thread->clients[ i ];
+        if( client->state != CLIENT_JOINED || now < client->next_send_ns || now >= measure_end_ns )
+            continue;
+
+        if( send_line( client, "LG %llu %.*s\r\n", (unsigned long long)now, msg_size, filler ) )
+        {
+            if( now >= measure_start_ns )
+            {
+                thread->sent++;
+                thread->expected += __atomic_load_n( client->room < 0 ? &clients_joined : &room_members[ client->room ], __ATOMIC_RELAXED );
+            }
+        }
+        else if( client->state != CLIENT_FAILED )
+            thread->skipped++;
+
+        // a thread that falls behind skips ahead rather than sending a burst
+        client->next_send_ns += interval_ns;
+        if( client->next_send_ns + interval_ns < now )
+        {
+            thread->late++;
+            client->next_send_ns = now + interval_ns;
+        }
+    }
+}
+
+static void *run_thread( void *arg )
+{
+    lg_thread_t *thread = arg;
+    struct epoll_event events[ MAX_EVENTS ];
+    client_t *client;
+    uint64_t interval_ns = rate > 0 ? (uint64_t)( NSEC_PER_SEC / rate ) : UINT64_MAX / 2;
+    bool started = false;
+    unsigned int seed = thread->id;
+    int n;
+    int i;
+
+    thread->epoll_fd = epoll_create1( 0 );
+    if( thread->epoll_fd < 0 )
+    {
+        perror( "loadgen: epoll_create1" );
+        exit( EXIT_FAILURE );
+    }
+
+    for( i = 0; i < thread->num_clients; i++ )
+    {
+        if( !connect_client( thread, &thread->clients[ i ] ) )
+        {
+            thread->clients[ i ].state = CLIENT_FAILED;
+            thread->clients[ i ].fd = -1;
+            __atomic_add_fetch( &clients_failed, 1, __ATOMIC_RELAXED );
+        }
+    }
+
+    while( __atomic_load_n( &phase, __ATOMIC_ACQUIRE ) != PHASE_DONE )
+    {
+        n = epoll_wait( thread->epoll_fd, events, MAX_EVENTS, 1 );
+        for( i = 0; i < n; i++ )
+        {
+            client = events[ i ].data.ptr;
+
+            if( ( events[ i ].events & EPOLLOUT ) && !flush_client( client ) )
+                fail_client( client );
+
+            if( events[ i ].events & ~EPOLLOUT )
+                read_client_lines( thread, client );
+        }
+
+        if( __atomic_load_n( &phase, __ATOMIC_ACQUIRE ) == PHASE_SETUP )
+        {
+            // everyone else joins once every room has been created
+            if( __atomic_load_n( &rooms_ready, __ATOMIC_ACQUIRE ) >= num_rooms )
+            {
+                for( i = 0; i < thread->num_clients; i++ )
+                {
+                    if( thread->clients[ i ].state == CLIENT_READY )
+                        join_room( &thread->clients[ i ] );
+                }
+            }
+            continue;
+        }
+
+        // spread each client's sends evenly over its first interval
+        if( !started )
+        {
+            for( i = 0; i < thread->num_clients; i++ )
+                thread->clients[ i ].next_send_ns = run_start_ns + (uint64_t)( ( (double)rand_r( &seed ) / RAND_MAX ) * interval_ns );
+            started = true;
+        }
+
+        send_due( thread, interval_ns );
+    }
+
+    for( i = 0; i < thread->num_clients; i++ )
+    {
+        if( thread->clients[ i ].fd >= 0 )
+            close( thread->clients[ i ].fd );
+    }
+    close( thread->epoll_fd );
+
+    return NULL;
+}
+
+static int parse_int( const char *text, int min, const char *name )
+{
+    char *end;
+    long value = strtol( text, &end, 10 );
+
+    if( *end || value < min )
+    {
+        fprintf( stderr, "loadgen: invalid %s: %s \n", name, text );
+        exit( EXIT_FAILURE );
+    }
+
+    return (int)value;
+}
+
+static void parse_options( int argc, char **argv )
+{
+    int opt;
+    char *end;
+
+    while( ( opt = getopt( argc, argv, OPT_STRING ) ) != -1 )
+    {
+        switch( opt )
+        {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'c': num_clients = parse_int( optarg, 1, "number of clients" ); break;
+        case 'r': num_rooms = parse_int( optarg, 0, "number of rooms" ); break;
+        case 'd': duration = parse_int( optarg, 1, "duration" ); break;
+        case 'w': warmup = parse_int( optarg, 0, "warmup" ); break;
+        case 's': msg_size = parse_int( optarg, 1, "message size" ); break;
+        case 'j': num_threads = parse_int( optarg, 1, "number of threads" ); break;
+        case 'T': setup_timeout = parse_int( optarg, 1, "setup timeout" ); break;
+        case 'u': prefix = optarg; break;
+        case 'l': label = optarg; break;
+
+        case 'm':
+            rate = strtod( optarg, &end );
+            if( *end || rate < 0 )
+                usage( argv[ 0 ] );
+            break;
+
+        default:
+            usage( argv[ 0 ] );
+        }
+    }
+
+    if( optind != argc )
+        usage( argv[ 0 ] );
+
+    if( num_rooms > num_clients )
+        num_rooms = num_clients;
+    if( num_threads > num_clients )
+        num_threads = num_clients;
+
+    // the line has to fit the server's line length with the tag and time
+    if( msg_size > MAX_LINE - 64 )
+        msg_size = MAX_LINE - 64;
+}
+
+static void print_results( lg_thread_t *threads, double seconds )
+{
+    static uint64_t hist[ HIST_BUCKETS ];
+    uint64_t sent = 0, expected = 0, received = 0, skipped = 0, late = 0, sum = 0, max = 0;
+    int i;
+    int j;
+
+    for( i = 0; i < num_threads; i++ )
+    {
+        sent += threads[ i ].sent;
+        expected += threads[ i ].expected;
+        received += threads[ i ].received;
+        skipped += threads[ i ].skipped;
+        late += threads[ i ].late;
+        sum += threads[ i ].latency_sum_ns;
+        if( threads[ i ].latency_max_ns > max )
+            max = threads[ i ].latency_max_ns;
+        for( j = 0; j < HIST_BUCKETS; j++ )
+            hist[ j ] += threads[ i ].hist[ j ];
+    }
+
+    printf( "{\"label\":\"%s\",\"clients\":%d,\"connected\":%d,\"rooms\":%d,\"rate\":%.3f,\"size\":%d,"
+            "\"threads\":%d,\"duration\":%.3f,\"sent\":%llu,\"expected\":%llu,\"received\":%llu,"
+            "\"skipped\":%llu,\"late\":%llu,\"send_per_sec\":%.1f,\"recv_per_sec\":%.1f,\"delivery_ratio\":%.4f,"
+            "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+            label, num_clients, __atomic_load_n( &clients_joined, __ATOMIC_RELAXED ), num_rooms, rate, msg_size,
+            num_threads, seconds, (unsigned long long)sent, (unsigned long long)expected, (unsigned long long)received,
+            (unsigned long long)skipped, (unsigned long long)late, sent / seconds, received / seconds,
+            expected ? (double)received / expected : 0.0,
+            received ? (double)sum / received / NSEC_PER_USEC : 0.0,
+            (double)hist_percentile( hist, received, 0.50 ) / NSEC_PER_USEC,
+            (double)hist_percentile( hist, received, 0.90 ) / NSEC_PER_USEC,
+            (double)hist_percentile( hist, received, 0.99 ) / NSEC_PER_USEC,
+            (double)hist_percentile( hist, received, 0.999 ) / NSEC_PER_USEC,
+            (double)max / NSEC_PER_USEC );
+}
+
+int main( int argc, char *argv[ ] )
+{
+    struct addrinfo hints;
+    struct rlimit limit;
+    struct timespec pause = { 0, 10000000 };
+    lg_thread_t *threads;
+    client_t *clients;
+    uint64_t deadline;
+    int res;
+    int i;
+
+    parse_options( argc, argv );
+
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    res = getaddrinfo( host, port, &hints, &server_addr );
+    if( res != 0 )
+    {
+        fprintf( stderr, "loadgen: %s: %s \n", host, gai_strerror( res ) );
+        return EXIT_FAILURE;
+    }
+
+    // one descriptor per client (best effort, capped by the hard limit)
+    if( getrlimit( RLIMIT_NOFILE, &limit ) == 0 && limit.rlim_cur < (rlim_t)num_clients + 64 )
+    {
+        limit.rlim_cur = num_clients + 64;
+        if( limit.rlim_max != RLIM_INFINITY && limit.rlim_cur > limit.rlim_max )
+            limit.rlim_cur = limit.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &limit );
+    }
+
+    memset( filler, 'x', sizeof( filler ) - 1 );
+    clients = calloc( num_clients, sizeof( client_t ) );
+    threads = calloc( num_threads, sizeof( lg_thread_t ) );
+    room_members = calloc( num_rooms > 0 ? num_rooms : 1, sizeof( int ) );
+    if( clients == NULL || threads == NULL || room_members == NULL )
+    {
+        fprintf( stderr, "loadgen: out of memory \n" );
+        return EXIT_FAILURE;
+    }
+
+    // clients are dealt to rooms, then handed to threads in blocks
+    for( i = 0; i < num_clients; i++ )
+    {
+        clients[ i ].id = i;
+        clients[ i ].room = num_rooms > 0 ? i % num_rooms : -1;
+    }
+
+    for( i = 0; i < num_threads; i++ )
+    {
+        threads[ i ].id = i;
+        threads[ i ].clients = clients + (long)num_clients * i / num_threads;
+        threads[ i ].num_clients = (long)num_clients * ( i + 1 ) / num_threads - (long)num_clients * i / num_threads;
+        if( pthread_create( &threads[ i ].thread, NULL, run_thread, &threads[ i ] ) != 0 )
+        {
+            fprintf( stderr, "loadgen: cannot start thread \n" );
+            return EXIT_FAILURE;
+        }
+    }
+
+    // wait for everyone to be in their room, or for as many as made it in time
+    deadline = now_ns() + setup_timeout * NSEC_PER_SEC;
+    while( __atomic_load_n( &clients_joined, __ATOMIC_RELAXED ) + __atomic_load_n( &clients_failed, __ATOMIC_RELAXED ) < num_clients &&
+           now_ns() < deadline )
+        nanosleep( &pause, NULL );
+
+    if( __atomic_load_n( &clients_joined, __ATOMIC_RELAXED ) < num_clients )
+        fprintf( stderr, "loadgen: only %d of %d clients are in their rooms \n", __atomic_load_n( &clients_joined, __ATOMIC_RELAXED ), num_clients );
+    if( __atomic_load_n( &clients_joined, __ATOMIC_RELAXED ) == 0 )
+        return EXIT_FAILURE;
+
+    run_start_ns = now_ns() + START_DELAY_NS;
+    measure_start_ns = run_start_ns + warmup * NSEC_PER_SEC;
+    measure_end_ns = measure_start_ns + duration * NSEC_PER_SEC;
+    __atomic_store_n( &phase, PHASE_RUN, __ATOMIC_RELEASE );
+
+    // let the last messages arrive before stopping
+    while( now_ns() < measure_end_ns + DRAIN_NS )
+        nanosleep( &pause, NULL );
+    __atomic_store_n( &phase, PHASE_DONE, __ATOMIC_RELEASE );
+
+    for( i = 0; i < num_threads; i++ )
+        pthread_join( threads[ i ].thread, NULL );
+
+    print_results( threads, (double)duration );
+
+    freeaddrinfo( server_addr );
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+#===========================================================================
+# Filename    : scaling.sh
+# Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+#             : Joshua Durkee    <joshua.durkee@oit.edu>
+# Course      : CST 340
+# Assignment  : 6
+# Description : Scaling curve for the chat server: runs it with 1 up to
+#               MAX_THREADS event loop threads and puts the same load on each,
+#               one line of loadgen JSON per run.  Run it from Debug after make.
+#
+#               MAX_THREADS  most event loop threads (default: online cores)
+#               PORT         port to run the server on (default 3999)
+#               Anything else on the command line goes to loadgen, e.g.
+#                   ../bench/scaling.sh -c 5000 -r 50 -m 2 -j 4
+#===========================================================================
+
+SERVER=${SERVER:-./CST340-chat}
+LOADGEN=${LOADGEN:-./loadgen}
+MAX_THREADS=${MAX_THREADS:-$(getconf _NPROCESSORS_ONLN)}
+PORT=${PORT:-3999}
+WORK_DIR=$(mktemp -d)
+
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORK_DIR"' EXIT
+
+threads=1
+while [ "$threads" -le "$MAX_THREADS" ]; do
+    # a fresh server for every run, its history kept out of the way
+    "$SERVER" -t "$threads" -l warn -d "$WORK_DIR/history" -b "$WORK_DIR/blocked.txt" "$PORT" > "$WORK_DIR/server.log" 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+
+    "$LOADGEN" -p "$PORT" -l "threads=$threads" "$@"
+
+    kill $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+    rm -rf "$WORK_DIR/history"
+
+    threads=$(( threads * 2 > MAX_THREADS && threads < MAX_THREADS ? MAX_THREADS : threads * 2 ))
+done
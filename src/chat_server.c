@@ -11,47 +11,264 @@
 #include "chat_server.h"
 
 // global variables
-user_t user_thread[ MAX_CONN ];/* pthread/user struct array*/
-chat_room_t chatrooms[ MAX_ROOMS ]; /* chatroom struct array    */
-chat_room_t lobby;
-blocked_ip_t blocks[ MAX_BLOCKED ];
+user_t *user_thread;                /* connection table, mapped at startup    */
+int user_thread_size;               /* number of slots in user_thread         */
+int user_thread_unused;             /* slots from here on have never been used */
+int user_free_head = -1;            /* most recently released slot            */
+user_t *live_users;                 /* list of claimed slots                  */
+stat_sem_t user_table_mutex;        /* free list and live list                */
+hash_map_t user_index;              /* case-insensitive user name -> user_t * */
+hash_map_t room_index;              /* room name -> chat_room_t *             */
+hash_map_t opening_rooms;           /* names of rooms being set up or closed, under room_table_mutex */
+command_t *command_index[ COMMAND_INDEX_SIZE ];  /* perfect hash of the commands, read-only once built */
+uint32_t command_seed;              /* seed of command_index's hash           */
+chat_room_t *active_rooms;          /* list of rooms currently in use         */
+chat_room_t *free_rooms;            /* reclaimed rooms ready for re-use       */
+int next_room_id;                   /* id given to the next room opened       */
+stat_sem_t room_table_mutex;        /* active and free room lists             */
+chat_room_t *lobby;
+ip_trie_t block_list;               /* blocked_ip_t by blocked range          */
+int next_block_id;                  /* id given to the next block             */
+char *block_file = DFLT_BLOCK_FILE; /* blocks loaded at startup               */
+reactor_t *reactors;                /* event loops, reactors[ 0 ] runs on the main thread */
+int num_reactors;
+__thread reactor_t *this_reactor;   /* event loop running on this thread      */
+long out_queue_limit = DFLT_OUT_QUEUE_LIMIT;    /* outbound bytes queued per client  */
+int out_queue_policy = OVERFLOW_DROP;           /* what happens past out_queue_limit */
+int history_depth = DFLT_HISTORY_SIZE;          /* lines of history kept per room */
+char *history_dir = DFLT_HISTORY_DIR;           /* room history logs, NULL if not logging */
+#ifdef LOCK_STATS
+lock_class_t user_table_class = { "user_table_mutex" };
+lock_class_t room_table_class = { "room_table_mutex" };
+lock_class_t write_mutex_class = { "write_mutex" };
+lock_class_t members_mutex_class = { "members_mutex" };
+#endif
+char *stats_shm;                                /* counters segment, derived from the port unless given */
+int trace_dump_requested;                       /* SIGUSR1 arrived, reactor 0 writes the trace out */
+int trace_dumps;                                /* trace files written so far */
 
 
+// the benchmarks link the server without its entry point
+#ifndef CHAT_SERVER_NO_MAIN
 int main( int argc, char *argv[ ] )
 {
-    int                 i;          /* user_thread index        */
+    int                 i;          /* reactor index            */
     int                 res;        /* temporary result         */
-    int                 list_s;     /* listening socket         */
-    int                 conn_s;     /* connection socket        */
     short int           port;       /* port number              */
-    struct sockaddr_in  servaddr;   /* socket address structure */
     char               *endptr;     /* for strtol()             */
-    struct sockaddr_in  client_addr;
-    socklen_t           c_len = sizeof( client_addr );
+    int                 max_conn = DFLT_MAX_CONN;
+    int                 opt;        /* command line option      */
+    int                 level = DFLT_LOG_LEVEL;
+    char                shm_name[ STATS_NAME_SIZE ];
+    long                stack_size = DFLT_STACK_SIZE;
+    pthread_attr_t      attr;       /* reactor threads          */
+
+    if( hash_map_init( &room_index, false ) != HASH_MAP_OK ||
+        hash_map_init( &opening_rooms, false ) != HASH_MAP_OK )
+        server_error( "Error allocating room index" );
+    stat_sem_init( &room_table_mutex, &room_table_class, "rooms" );
+    init_commands();
+    if( ip_trie_init( &block_list ) != IP_TRIE_OK )
+        server_error( "Error allocating block list" );
+
+    num_reactors = sysconf( _SC_NPROCESSORS_ONLN );
+    if( num_reactors < 1 )
+        num_reactors = 1;
+
+    // get options, then port number and connection table size from command line or use defaults
+    while( ( opt = getopt( argc, argv, OPT_STRING ) ) != -1 )
+    {
+        switch( opt )
+        {
+        case OPT_OUT_QUEUE_LIMIT:
+            out_queue_limit = strtol( optarg, &endptr, 0 );
+            if( *endptr || out_queue_limit <= 0 )
+                server_error( "Invalid outbound queue limit" );
+            break;
+
+        case OPT_DISCONNECT_SLOW:
+            out_queue_policy = OVERFLOW_DISCONNECT;
+            break;
 
-    init_user_thread();
+        case OPT_HISTORY_SIZE:
+            history_depth = strtol( optarg, &endptr, 0 );
+            if( *endptr || history_depth <= 0 )
+                server_error( "Invalid history size" );
+            break;
 
-    memset( &chatrooms, 0, sizeof( chatrooms ) );
-    memset( &blocks, 0, sizeof( blocks ) );
+        case OPT_HISTORY_DIR:
+            history_dir = optarg;
+            break;
 
-    // get port number from command line or set to default port
-    if( argc == 2 )
+        case OPT_BLOCK_FILE:
+            block_file = optarg;
+            break;
+
+        case OPT_REACTORS:
+            num_reactors = strtol( optarg, &endptr, 0 );
+            if( *endptr || num_reactors <= 0 )
+                server_error( "Invalid number of threads" );
+            break;
+
+        case OPT_LOG_LEVEL:
+            level = log_parse_level( optarg );
+            if( level < 0 )
+                server_error( "Invalid log level" );
+            break;
+
+        case OPT_STATS_SHM:
+            stats_shm = optarg;
+            break;
+
+        case OPT_STACK_SIZE:
+            stack_size = strtol( optarg, &endptr, 0 );
+            if( *endptr || stack_size < PTHREAD_STACK_MIN )
+                server_error( "Invalid thread stack size" );
+            break;
+
+        case OPT_TRACE:
+            res = strtol( optarg, &endptr, 0 );
+            if( *endptr || res < 0 )
+                server_error( "Invalid trace sampling" );
+            trace_set_every( res );
+            break;
+
+        default:
+            server_error( "Invalid arguments" );
+        }
+    }
+
+    // from here on, server messages go through the log
+    log_init( level );
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if( argc > 3 )
+        server_error( "Invalid arguments" );
+
+    port = ECHO_PORT;
+    if( argc >= 2 )
     {
         port = strtol( argv[ 1 ], &endptr, 0 );
         if( *endptr )
             server_error( "Invalid port number" );
     }
-    else if( argc < 2 )
-        port = ECHO_PORT;
+
+    if( argc == 3 )
+    {
+        max_conn = strtol( argv[ 2 ], &endptr, 0 );
+        if( *endptr || max_conn <= 0 )
+            server_error( "Invalid maximum connections" );
+    }
+
+    init_user_thread( max_conn );
+
+    // one counter slot per reactor, published for scrapers under the port's name
+    if( stats_shm == NULL )
+    {
+        snprintf( shm_name, sizeof( shm_name ), STATS_SHM_FORMAT, port );
+        stats_shm = shm_name;
+    }
+    if( stats_init( stats_shm, num_reactors ) == 0 )
+    {
+        atexit( stats_shutdown );
+        log_msg( LOG_LEVEL_INFO, "Counters are published in shared memory %s", stats_shm );
+    }
+    else if( stats_segment != NULL )
+        log_msg( LOG_LEVEL_WARN, "Cannot create shared memory %s, counters are only shown by /%s", stats_shm, CMD_STATS );
     else
-        server_error( "Invalid arguments" );
+        server_error( "Error allocating counters" );
+
+    for( i = 0; i < NUM_COMMANDS; i++ )
+        stats_name_command( command_position( &commands[ i ] ), commands[ i ].command_string );
+    for( i = 0; i < NUM_ADMIN_COMMANDS; i++ )
+        stats_name_command( command_position( &admin_commands[ i ] ), admin_commands[ i ].command_string );
+
+    // a vanished client must surface as a write error, not kill the server
+    signal( SIGPIPE, SIG_IGN );
+
+    // a missing block file just means nothing is blocked yet
+    res = load_block_file( block_file );
+    if( res >= 0 )
+        log_msg( LOG_LEVEL_INFO, "Loaded %d blocked addresses from %s", res, block_file );
+    else if( errno != ENOENT )
+        log_msg( LOG_LEVEL_WARN, "Cannot read block file %s", block_file );
+
+    // room history is kept in memory only if the log directory can't be used
+    if( mkdir( history_dir, 0755 ) < 0 && errno != EEXIST )
+    {
+        log_msg( LOG_LEVEL_WARN, "Cannot create history directory %s, history will not be saved", history_dir );
+        history_dir = NULL;
+    }
+
+    // every reactor is listening before any of them starts accepting
+    reactors = calloc( num_reactors, sizeof( reactor_t ) );
+    if( reactors == NULL )
+        server_error( "Error allocating reactors" );
+
+    for( i = 0; i < num_reactors; i++ )
+        init_reactor( &reactors[ i ], i, port );
+
+    // SIGUSR1 writes out the trace, it only wakes reactor 0 which does the work
+    signal( SIGUSR1, request_trace_dump );
+
+    // create lobby (default) chatroom, it is never reclaimed
+    if( open_chat_room( DFLT_CHATROOM_NAME, &lobby ) != SUCCESS )
+        server_error( "Error creating lobby" );
+
+    // The reactors are the whole thread pool, however many clients connect.
+    // They run until the server exits, so nobody joins them, and their
+    // stacks are sized for the event loop instead of the 8M default.
+    if( pthread_attr_init( &attr ) != 0 ||
+        pthread_attr_setstacksize( &attr, stack_size ) != 0 ||
+        pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED ) != 0 )
+        server_error( "Invalid thread stack size" );
+
+    for( i = 1; i < num_reactors; i++ )
+        if( pthread_create( &reactors[ i ].thread, &attr, run_reactor, &reactors[ i ] ) != 0 )
+            server_error( "Error creating reactor thread" );
+
+    pthread_attr_destroy( &attr );
+
+    // the main thread is reactor 0
+    reactors[ 0 ].thread = pthread_self();
+    run_reactor( &reactors[ 0 ] );
+
+    return EXIT_SUCCESS;
+}
+#endif /* CHAT_SERVER_NO_MAIN */
+
+// Only async-signal-safe work here: note the request and wake reactor 0
+// through its mailbox
+void request_trace_dump( int sig )
+{
+    int saved_errno = errno;
+    uint64_t one = 1;
+
+    __atomic_store_n( &trace_dump_requested, 1, __ATOMIC_RELEASE );
+    write( reactors[ 0 ].mailbox.event_fd, &one, sizeof( one ) );
+
+    errno = saved_errno;
+}
+
+// Give a reactor its own listening socket on the server port, its event loop
+// descriptor and its mailbox
+void init_reactor( reactor_t *reactor, int id, short int port )
+{
+    int                 res;        /* temporary result         */
+    struct sockaddr_in  servaddr;   /* socket address structure */
+    struct epoll_event  ev;
 
-    // create listening socket
-    list_s = socket( AF_INET, SOCK_STREAM, 0 );
-    if( list_s < 0 )
+    reactor->id = id;
+
+    // create listening socket, the port is shared by every reactor's socket
+    reactor->listen_fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if( reactor->listen_fd < 0 )
         server_error( "Error creating listening socket" );
 
-    set_sock_reuse( list_s );
+    set_sock_reuse( reactor->listen_fd );
+    set_sock_reuseport( reactor->listen_fd );
+    set_sock_nonblock( reactor->listen_fd );
 
     // initialize socket address structure
     memset( &servaddr, 0, sizeof( servaddr ) );
@@ -60,54 +277,413 @@ int main( int argc, char *argv[ ] )
     servaddr.sin_port = htons( port );
 
     //  bind socket address to listening socket
-    res = bind( list_s, (struct sockaddr *) &servaddr, sizeof( servaddr ) );
+    res = bind( reactor->listen_fd, (struct sockaddr *) &servaddr, sizeof( servaddr ) );
     if( res < 0 )
         server_error( "Error calling bind()" );
 
-    res = listen( list_s, LISTENQ );
+    res = listen( reactor->listen_fd, LISTENQ );
     if( res < 0 )
         server_error( "Error calling listen()" );
 
-    // create lobby (default) chatroom
-    init_chatroom( &lobby, 0, DFLT_CHATROOM_NAME );
+    reactor->epoll_fd = epoll_create1( 0 );
+    if( reactor->epoll_fd < 0 )
+        server_error( "Error calling epoll_create1()" );
+
+    if( init_mailbox( &reactor->mailbox ) < 0 )
+        server_error( "Error calling eventfd()" );
+
+    // listening socket is registered with a NULL user
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    res = epoll_ctl( reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &ev );
+    if( res < 0 )
+        server_error( "Error calling epoll_ctl()" );
+
+    // mailbox stays readable until it is emptied
+    ev.events = EPOLLIN;
+    ev.data.ptr = &reactor->mailbox;
+    res = epoll_ctl( reactor->epoll_fd, EPOLL_CTL_ADD, reactor->mailbox.event_fd, &ev );
+    if( res < 0 )
+        server_error( "Error calling epoll_ctl()" );
+}
+
+// Event loop of one reactor: accept, read, parse and deliver for the
+// connections this thread owns, and run mail posted by other reactors
+void *run_reactor( void *arg )
+{
+    int                 i;          /* event index              */
+    int                 num_events; /* ready events             */
+    reactor_t          *reactor = arg;
+    struct epoll_event  events[ MAX_EVENTS ];
+    cpu_set_t           cpus;
+    struct timespec     now;
+
+    this_reactor = reactor;
+    stats_attach( reactor->id );
+
+    // keep the reactor and the cache lines of its connections on one core (best effort)
+    CPU_ZERO( &cpus );
+    CPU_SET( reactor->id % sysconf( _SC_NPROCESSORS_ONLN ), &cpus );
+    pthread_setaffinity_np( pthread_self(), sizeof( cpus ), &cpus );
 
     while( 1 )
     {
-        // wait for connection
-        conn_s = accept( list_s, (struct sockaddr*)&client_addr, &c_len );
-        if( conn_s < 0 )
-            server_error( "Error calling accept()" );
+        // wait for connections, client input and mail.  Retired items need
+        // the epoch to move on twice, so while any are waiting come back
+        // soon to retry even if nothing happens meanwhile.
+        num_events = epoll_wait( reactor->epoll_fd, events, MAX_EVENTS, epoch_pending() ? EPOCH_POLL_MS : -1 );
+        if( num_events < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            server_error( "Error calling epoll_wait()" );
+        }
+
+        // users and rooms seen while handling these events stay valid until epoch_exit()
+        epoch_enter();
+
+        for( i = 0; i < num_events; i++ )
+        {
+            if( events[ i ].data.ptr == NULL )
+            {
+                accept_clients( reactor );
+                continue;
+            }
+
+            if( events[ i ].data.ptr == &reactor->mailbox )
+            {
+                handle_mail( reactor );
+                continue;
+            }
+
+            // send queued output first, user_proc() may release the slot
+            if( events[ i ].events & EPOLLOUT )
+                flush_user( (user_t *)events[ i ].data.ptr );
+
+            if( events[ i ].events & ~EPOLLOUT )
+                user_proc( (user_t *)events[ i ].data.ptr );
+        }
+
+        epoch_exit();
+
+        // free what was retired while handling these events
+        if( epoch_pending() )
+            epoch_reclaim();
+
+        // once a second, see whether a room should go to a less loaded reactor
+        clock_gettime( CLOCK_MONOTONIC_COARSE, &now );
+        if( now.tv_sec != reactor->load_time )
+            balance_rooms( reactor, now.tv_sec );
+    }
+
+    return NULL;
+}
+
+// Run what other reactors posted for our connections and rooms.
+//
+// A connection that has closed since keeps its slot until this thread reclaims
+// it, so a generation that still matches means the mail is for the connection
+// it was posted for.  A room is only closed by its owner and its generation
+// moves on when it does; mail for a room that has moved follows it, and the
+// new owner holds back what was posted to it directly until the former owner
+// has passed on the rest, so lines go out in the order they were sent.
+void handle_mail( reactor_t *reactor )
+{
+    mail_t *mail;
+    mail_t *next;
+    user_t *user;
+    chat_room_t *room;
+    reactor_t *owner;
+    char path[ TRACE_FILE_SIZE ];
+
+    // the SIGUSR1 handler wakes reactor 0 through its mailbox
+    if( __atomic_exchange_n( &trace_dump_requested, 0, __ATOMIC_ACQ_REL ) )
+        dump_trace( path, sizeof( path ) );
+
+    for( mail = mailbox_take( &reactor->mailbox ); mail != NULL; mail = next )
+    {
+        next = mail->next;
 
-        printf( "client_addr: %d \n", client_addr.sin_addr.s_addr );
-        printf( "client_addr: %s \n", inet_ntoa( client_addr.sin_addr ) );
+        if( mail->type < MAIL_CHAT )
+        {
+            user = mail->target;
+
+            if( __atomic_load_n( &user->generation, __ATOMIC_ACQUIRE ) == mail->generation )
+            {
+                switch( mail->type )
+                {
+                case MAIL_SEND:
+                    send_to_user( user, mail->buf );
+                    break;
+
+                case MAIL_REPLY:
+                    queue_reply( user, mail->generation, mail->buf );
+                    break;
 
-        // search for available thread
-        for( i = 0; i < MAX_CONN; i++ )
+                case MAIL_LOGOUT:
+                    logout( user, 0, NULL );
+                    break;
+                }
+            }
+        }
+        else
         {
-            if( user_thread[ i ].used == false )
+            room = mail->target;
+
+            if( __atomic_load_n( &room->generation, __ATOMIC_ACQUIRE ) == mail->generation )
             {
-                // found an available thread
-                user_thread[ i ].user_ip_addr = client_addr.sin_addr;
-                user_thread[ i ].user_id = i;
-                user_thread[ i ].connection = conn_s;
-                user_thread[ i ].used = true;
-                user_thread[ i ].logout = false;
-                user_thread[ i ].admin = false;
-                user_thread[ i ].login_failure = false;
-
-                // spawn new thread
-                pthread_create( &user_thread[ i ].thread, NULL, user_proc, &user_thread[ i ] );
-                break;
+                owner = room_owner( room );
+                if( owner != reactor )
+                {
+                    mail->forwarded = true;
+                    mailbox_post( &owner->mailbox, mail );
+                    continue;
+                }
+
+                // posted here after a move, it goes after what the former owner passes on
+                if( room->handoff && !mail->forwarded )
+                {
+                    mail->next = NULL;
+                    if( room->held_tail != NULL )
+                        room->held_tail->next = mail;
+                    else
+                        room->held = mail;
+                    room->held_tail = mail;
+                    continue;
+                }
+
+                run_room_mail( room, mail );
             }
         }
 
+        if( mail->buf != NULL )
+            msg_buf_unref( mail->buf );
+        free( mail );
+    }
+}
+
+// Carry out mail for a room this reactor owns
+void run_room_mail( chat_room_t *room, mail_t *mail )
+{
+    switch( mail->type )
+    {
+    case MAIL_CHAT:
+        room_fanout( room, mail->from_id, mail->buf );
+        break;
+
+    case MAIL_HISTORY:
+        room_history( room, mail->from_id, mail->from_generation, mail->arg );
+        break;
+
+    case MAIL_CLOSE:
+        close_chat_room( room );
+        break;
+
+    case MAIL_HANDOFF:
+        finish_handoff( room );
+        break;
+    }
+}
+
+// The former owner has passed on everything it had for the room, what was
+// posted here meanwhile can run now.  A held MAIL_CLOSE closes the room and
+// the mail behind it is then dropped.
+void finish_handoff( chat_room_t *room )
+{
+    mail_t *mail = room->held;
+    mail_t *next;
+
+    room->handoff = false;
+    room->held = NULL;
+    room->held_tail = NULL;
+
+    for( ; mail != NULL; mail = next )
+    {
+        next = mail->next;
+
+        if( __atomic_load_n( &room->generation, __ATOMIC_ACQUIRE ) == mail->generation )
+            run_room_mail( room, mail );
+
+        if( mail->buf != NULL )
+            msg_buf_unref( mail->buf );
+        free( mail );
+    }
+}
+
+// Grace period callback for a room moved by balance_rooms().  Everything
+// posted to the former owner while it had the room is in its mailbox by
+// now, the marker goes in behind it and is passed on after it.
+void post_handoff( void *ptr )
+{
+    mail_t *mail = ptr;
+
+    mailbox_post( &reactors[ mail->arg ].mailbox, mail );
+}
+
+// Hand work for the connection of the given generation to the reactor that
+// owns it, the mail holds its own reference to buf
+void post_mail( user_t *user, unsigned int generation, int type, msg_buf_t *buf )
+{
+    mail_t *mail = malloc( sizeof( mail_t ) );
+
+    if( mail == NULL )
+        return;
+
+    mail->type = type;
+    mail->target = user;
+    mail->generation = generation;
+    mail->from_id = INTERN_NONE;
+    mail->from_generation = 0;
+    mail->arg = 0;
+    mail->buf = buf != NULL ? msg_buf_ref( buf ) : NULL;
+    mail->forwarded = false;
+
+    mailbox_post( &__atomic_load_n( &user->reactor, __ATOMIC_ACQUIRE )->mailbox, mail );
+}
+
+// Rooms are owned by one reactor at a time.  Once a second each reactor totals
+// the deliveries its rooms needed; one carrying well over the least loaded
+// reactor's share hands it the busiest room that does not overshoot half the
+// difference.  Loads not reported for a while belong to idle reactors.
+void balance_rooms( reactor_t *reactor, time_t now )
+{
+    int             i;
+    chat_room_t    *room;
+    chat_room_t    *move = NULL;
+    mail_t         *handoff = NULL;
+    unsigned long   moved = 0;
+    unsigned long   load = 0;
+    unsigned long   other_load;
+    unsigned long   coolest_load = 0;
+    reactor_t      *coolest = NULL;
+
+    for( i = 0; i < num_reactors; i++ )
+    {
+        if( &reactors[ i ] == reactor )
+            continue;
+
+        other_load = 0;
+        if( __atomic_load_n( &reactors[ i ].load_time, __ATOMIC_RELAXED ) >= now - 1 )
+            other_load = __atomic_load_n( &reactors[ i ].load, __ATOMIC_RELAXED );
+
+        if( coolest == NULL || other_load < coolest_load )
+        {
+            coolest = &reactors[ i ];
+            coolest_load = other_load;
+        }
+    }
+
+    stat_sem_wait( &room_table_mutex );
+
+    for( room = active_rooms; room != NULL; room = room->room_next )
+        if( room_owner( room ) == reactor )
+            load += room->load;
+
+    if( coolest != NULL && load > BALANCE_MIN_LOAD && load > 2 * coolest_load )
+    {
+        for( room = active_rooms; room != NULL; room = room->room_next )
+        {
+            if( room_owner( room ) == reactor && !room->handoff && room->load > 0 && room->load <= ( load - coolest_load ) / 2 &&
+                ( move == NULL || room->load > move->load ) )
+                move = room;
+        }
+    }
+
+    // start the next second, the moved room's count belongs to its new owner after this
+    for( room = active_rooms; room != NULL; room = room->room_next )
+    {
+        if( room_owner( room ) == reactor )
+        {
+            if( room == move )
+                moved = room->load;
+            room->load = 0;
+        }
+    }
+
+    // the marker that ends the hand-off, without it the room stays put
+    if( move != NULL && ( handoff = malloc( sizeof( mail_t ) ) ) != NULL )
+    {
+        log_msg( LOG_LEVEL_INFO, "Moving chatroom %s from reactor %d to reactor %d", move->room_name, reactor->id, coolest->id );
+
+        handoff->type = MAIL_HANDOFF;
+        handoff->target = move;
+        handoff->generation = __atomic_load_n( &move->generation, __ATOMIC_ACQUIRE );
+        handoff->from_id = INTERN_NONE;
+        handoff->from_generation = 0;
+        handoff->arg = reactor->id;
+        handoff->buf = NULL;
+        handoff->forwarded = false;
+
+        // other reactors looking for a light load this second see the move
+        __atomic_add_fetch( &coolest->load, moved, __ATOMIC_RELAXED );
+        load -= moved;
+        move->handoff = true;
+        __atomic_store_n( &move->owner, coolest, __ATOMIC_RELEASE );
+    }
+
+    stat_sem_post( &room_table_mutex );
+
+    // mail is posted inside an epoch section, once the sections that could
+    // have seen this reactor as the owner are over the marker can follow
+    if( handoff != NULL )
+        epoch_retire( handoff, post_handoff );
+
+    __atomic_store_n( &reactor->load, load, __ATOMIC_RELAXED );
+    __atomic_store_n( &reactor->load_time, now, __ATOMIC_RELAXED );
+}
+
+// accept every pending connection on the (edge-triggered) listening socket
+void accept_clients( reactor_t *reactor )
+{
+    int                 res;        /* temporary result         */
+    int                 conn_s;     /* connection socket        */
+    user_t             *user;
+    struct sockaddr_in  client_addr;
+    char                addr_text[ INET_ADDRSTRLEN ];
+    socklen_t           c_len;
+
+    while( 1 )
+    {
+        c_len = sizeof( client_addr );
+        conn_s = accept( reactor->listen_fd, (struct sockaddr*)&client_addr, &c_len );
+        if( conn_s < 0 )
+        {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                return;
+            if( errno == EINTR || errno == ECONNABORTED )
+                continue;
+            server_error( "Error calling accept()" );
+        }
+
+        // turn blocked addresses away before anything is allocated for them
+        if( is_blocked( client_addr.sin_addr ) )
+        {
+            write_client( conn_s, "\nYour address is blocked from this chat server. \n" );
+            stats_add( refused, 1 );
+
+            res = close( conn_s );
+            if( res < 0 )
+                server_error( "Error calling close()" );
+            continue;
+        }
+
+        log_msg( LOG_LEVEL_DEBUG, "client_addr: %d", client_addr.sin_addr.s_addr );
+        log_msg( LOG_LEVEL_DEBUG, "client_addr: %s", inet_ntop( AF_INET, &client_addr.sin_addr, addr_text, sizeof( addr_text ) ) );
+
+        // claim an available user slot
+        user = claim_user_slot();
+        if( user != NULL )
+        {
+            attach_client( reactor, user, conn_s, client_addr.sin_addr );
+        }
         // turn away excessive connections
-        if( i == MAX_CONN )
+        else
         {
-            printf( "Turned away a client \n" );
+            log_msg( LOG_LEVEL_WARN, "Turned away a client" );
 
-            // no threads available, send server busy message to client and close conn_s
+            // no slots available, send server busy message to client and close conn_s
             write_client( conn_s, "\nCould not connect to chat server, all circuits busy. \n" );
+            stats_add( refused, 1 );
 
             // close the connection
             res = close( conn_s );
@@ -117,54 +693,120 @@ int main( int argc, char *argv[ ] )
     }
 }
 
-void *user_proc( void *arg )
+// Give a claimed slot its connection and have the reactor serve it, starting
+// with the username prompt
+void attach_client( reactor_t *reactor, user_t *user, int conn_s, struct in_addr addr )
+{
+    struct epoll_event  ev;
+
+    // The slot is live (e.g. to a broadcast) from the moment it was claimed.
+    // A sender that read the previous owner's reactor writes under the lock,
+    // so it sees the slot either still logged out or fully set up.
+    stat_sem_wait( &user->write_mutex );
+    user->user_ip_addr = addr;
+    user->connection = conn_s;
+    __atomic_store_n( &user->reactor, reactor, __ATOMIC_RELEASE );
+    user->logout = false;
+    user->admin = false;
+    user->login_failure = false;
+    user->state = USER_STATE_USERNAME;
+    init_line_buffer( &user->line_buf );
+    init_out_queue( &user->out_queue );
+    stat_sem_post( &user->write_mutex );
+
+    set_sock_nonblock( conn_s );
+    set_sock_nodelay( conn_s );
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = user;
+    if( epoll_ctl( reactor->epoll_fd, EPOLL_CTL_ADD, conn_s, &ev ) < 0 )
+        server_error( "Error calling epoll_ctl()" );
+
+    stats_add( connections, 1 );
+    log_msg( LOG_LEVEL_INFO, "Client connected on thread %d (reactor %d), obtaining username...", user->user_id, reactor->id );
+
+    // prompt for client's username, the reply arrives as a readiness event
+    write_user( user, "\nEnter username: " );
+}
+
+// handle a readiness event on a client socket: drain every complete line and
+// feed it to the login flow or the chat/command processor
+void user_proc( user_t *this_thread )
 {
     int result;
-    int conn_s;
+    uint64_t trace_ns;
     char msg[ MAX_LINE ]; /*  character buffer          */
-    user_t *this_thread;
-
-    this_thread = (user_t *)arg;
 
-    printf( "Client connected on thread %d, obtaining username... \n", this_thread->user_id );
+    while( this_thread->logout == false )
+    {
+        result = read_client( this_thread->connection, &this_thread->line_buf, msg );
 
-    conn_s = this_thread->connection;
+        if( result == READ_AGAIN )
+            return;
 
-    get_username( this_thread );
+        if( result == CONN_ERR )
+            break;
 
-    if( this_thread->login_failure == false )
-    {
-        // set user's chatroom to lobby (default chatroom)
-        if( this_thread->logout == false )
-            add_user_to_chatroom( this_thread, &lobby );
+        stats_add( messages_in, 1 );
+        stats_add( bytes_in, result );
 
-        // main loop to receive and process client messages
-        while( this_thread->logout == false )
+        switch( this_thread->state )
         {
-            result = read_client( conn_s, msg );
+        case USER_STATE_USERNAME:
+            get_username( this_thread, msg );
+            break;
+
+        case USER_STATE_PASSWORD:
+            admin_check( this_thread, msg );
+            break;
 
-            if( result == CONN_ERR )
-                break;
+        default:
+            // a sampled line is traced to its last delivery, wherever that happens
+            trace_current = trace_sample();
+            trace_instant( trace_current, "read_client", result );
+            trace_ns = trace_start( trace_current );
 
             // deep copy msg to this_thread
             memset( this_thread->user_msg, 0, BUFFER_SIZE);
             strcpy( this_thread->user_msg, msg );
 
             process_client_msg( this_thread, msg );
+
+            trace_span( trace_current, "process_client_msg", trace_ns, 0 );
+            trace_current = 0;
+            break;
         }
     }
 
-    printf( "%s on thread %d disconnected, resetting all values. \n", this_thread->user_name, this_thread->user_id );
+    disconnect_user( this_thread );
+}
 
-    write_chatroom( this_thread, "%s left the chat.", this_thread->user_name );
+void disconnect_user( user_t *this_thread )
+{
+    int result;
+    int conn_s = this_thread->connection;
+
+    log_msg( LOG_LEVEL_INFO, "%s on thread %d disconnected, resetting all values.", this_thread->user_name, this_thread->user_id );
+
+    if( this_thread->chat_room != NULL )
+        write_chatroom( this_thread, "%s left the chat.", this_thread->user_name );
     reset_user( this_thread );
 
-    // close the connection
+    // last attempt to deliver queued output (e.g. the reason for a block),
+    // nothing more is queued from here on
+    stat_sem_wait( &this_thread->write_mutex );
+    this_thread->logout = true;
+    out_queue_flush( &this_thread->out_queue, conn_s );
+    out_queue_clear( &this_thread->out_queue );
+    stat_sem_post( &this_thread->write_mutex );
+
+    // close the connection, this also removes it from the event loop
     result = close( conn_s );
     if( result < 0 )
         server_error( "Error calling close()" );
+    stats_add( disconnections, 1 );
 
-    return NULL ;
+    release_user_slot( this_thread );
 }
 
 void process_client_msg( user_t *user, char *chat_msg )
@@ -193,315 +835,1013 @@ void process_client_msg( user_t *user, char *chat_msg )
 int get_command( char *msg, char **argv )
 {
     int num_args = 0;
+    char *save;         /* strtok_r() position, reactors parse at the same time */
 
     if( strncmp( msg, CMD_SIG, strlen( CMD_SIG ) ) )
         return 0;
 
-    argv[ num_args ] = strtok( msg + strlen( CMD_SIG ), " " );
+    argv[ num_args ] = strtok_r( msg + strlen( CMD_SIG ), " ", &save );
 
     while( (num_args < MAX_ARGS)&&(argv[ num_args++ ] ))
-        argv[ num_args ] = strtok( NULL, " " );
+        argv[ num_args ] = strtok_r( NULL, " ", &save );
 
     return --num_args;
 }
 
+// Index both command tables by name, once at startup.  Admin entries share the
+// index and are told apart by which table they point into.  Seeds are tried
+// until no two names hash to the same slot, so a lookup is one hash and one
+// name compare.  Duplicate names never fit and stop the server.  The index
+// never changes after this, so every reactor reads it without taking a lock.
+void init_commands( void )
+{
+    uint32_t seed;
+
+    if( 2 * ( NUM_COMMANDS + NUM_ADMIN_COMMANDS ) > COMMAND_INDEX_SIZE )
+        server_error( "Error indexing commands" );
+
+    for( seed = 0; seed < COMMAND_SEED_TRIES; seed++ )
+    {
+        if( place_commands( seed ) )
+        {
+            command_seed = seed;
+            return;
+        }
+    }
+
+    server_error( "Error indexing commands" );
+}
+
+// FNV-1a of the case-folded name, the seed picks one of a family of hashes
+uint32_t command_hash( const char *name, uint32_t seed )
+{
+    uint32_t hash = 2166136261u ^ ( seed * 2654435761u );
+
+    for( ; *name != '\0'; name++ )
+    {
+        hash ^= (unsigned char)tolower( (unsigned char)*name );
+        hash *= 16777619u;
+    }
+
+    return hash ^ ( hash >> 15 );
+}
+
+bool place_commands( uint32_t seed )
+{
+    int i;
+    command_t *command;
+    command_t **slot;
+
+    memset( command_index, 0, sizeof( command_index ) );
+
+    for( i = 0; i < NUM_COMMANDS + NUM_ADMIN_COMMANDS; i++ )
+    {
+        command = ( i < NUM_COMMANDS ) ? &commands[ i ] : &admin_commands[ i - NUM_COMMANDS ];
+        slot = &command_index[ command_hash( command->command_string, seed ) & ( COMMAND_INDEX_SIZE - 1 ) ];
+        if( *slot != NULL )
+            return false;
+        *slot = command;
+    }
+
+    return true;
+}
+
+// look up a command the given user may run, NULL if there is none
+command_t *find_command( user_t *user, char *name )
+{
+    command_t *command = command_index[ command_hash( name, command_seed ) & ( COMMAND_INDEX_SIZE - 1 ) ];
+
+    if( command == NULL || strcicmp( command->command_string, name ) != 0 )
+        return NULL;
+
+    if( command >= admin_commands && command < admin_commands + NUM_ADMIN_COMMANDS && !user->admin )
+        return NULL;
+
+    return command;
+}
+
+int command_position( command_t *command )
+{
+    if( command >= admin_commands && command < admin_commands + NUM_ADMIN_COMMANDS )
+        return NUM_COMMANDS + ( command - admin_commands );
+
+    return command - commands;
+}
+
 void process_command( user_t *user, int argc, char **argv )
 {
 #ifdef DEBUG_CMD
     int j;
-    printf( "argc: %d \n", argc );
+    log_msg( LOG_LEVEL_DEBUG, "argc: %d", argc );
     for( j = 0; j < argc; j++ )
-    printf( "argv[ %d ]: <<< %s >>>\n", j, argv[ j ] );
+    log_msg( LOG_LEVEL_DEBUG, "argv[ %d ]: <<< %s >>>", j, argv[ j ] );
 #endif
 
-    int i, k;
-    bool found = false;
     int ret_val;
-    int num_commands = sizeof( commands ) / sizeof(command_t);
-    int num_admin_commands = sizeof ( admin_commands ) / sizeof( admin_command_t );
+    int position;
+    uint64_t start_ns;
+    command_t *command = find_command( user, argv[ 0 ] );
+
+    // catch unknown commands
+    if( NULL == command )
+    {
+        stats_add( invalid_commands, 1 );
+        write_user( user, "Invalid command: %s \n", argv[ 0 ] );
+        write_user( user, "type \"/help\" for a list of commands. \n" );
+        return;
+    }
+
+    // execute desired command
+    start_ns = timestamp_mono_ns();
+    ret_val = command->command_function( user, argc, argv );
+    stats_latency( command_ns, start_ns );
+
+    position = command_position( command );
+    if( position < STATS_MAX_COMMANDS )
+        stats_add( commands[ position ], 1 );
+
+    if( ret_val == DISPLAY_USAGE )
+        write_user( user, "Usage: %s%s %s \n", CMD_SIG, argv[ 0 ], command->command_parameter_usage );
+}
+
+// write to all clients with locking performed
+void write_all_clients( char *msg, ... )
+{
+    user_t *user;
+    char full_msg[ MAX_LINE ]; /* constructed message      */
+    int len;
+    msg_buf_t *wire;
+    va_list ap;
+
+    va_start( ap, msg );
+    len = vsnprintf( full_msg, MAX_LINE, msg, ap );
+    va_end( ap );
+
+    // serialize once, every recipient's queue shares the same bytes
+    wire = new_wire_msg( full_msg, len );
+    if( wire == NULL )
+        return;
 
-    for( i = 0; i < num_commands; i++ )
+    // loop through all live connections and send message to each
+    stat_sem_wait( &user_table_mutex );
+    for( user = live_users; user != NULL; user = user->live_next )
     {
-        if( strcicmp( argv[ 0 ], commands[ i ].command_string ) == 0 )
+        // queue chat message to active client (including client who sent message)
+        send_to_user( user, wire );
+    }
+    stat_sem_post( &user_table_mutex );
+
+    msg_buf_unref( wire );
+}
+
+// format a message and queue it for a client
+void write_user( user_t *user, char *msg, ... )
+{
+    char        ret_buf[ MAX_LINE ];
+    int         len;
+    msg_buf_t  *buf;
+    va_list     ap;
+
+    va_start( ap, msg );
+    len = vsnprintf( ret_buf, MAX_LINE, msg, ap );
+    va_end( ap );
+
+    if( len >= MAX_LINE )
+        len = MAX_LINE - 1;
+
+    buf = msg_buf_copy( ret_buf, len );
+    if( buf == NULL )
+        return;
+
+    send_to_user( user, buf );
+    msg_buf_unref( buf );
+}
+
+// Start collecting a multi-line response for a client
+void reply_begin( reply_t *reply, user_t *user )
+{
+    reply->user = user;
+    reply->generation = __atomic_load_n( &user->generation, __ATOMIC_ACQUIRE );
+    reply->page = NULL;
+}
+
+// A reply was asked for, so it is queued whatever out_queue_limit says.
+// Called on the reactor that owns the user.  A slot claimed again since the
+// reply was begun has a new generation before it is attached (under the lock).
+void queue_reply( user_t *user, unsigned int generation, msg_buf_t *page )
+{
+    stat_sem_wait( &user->write_mutex );
+
+    if( user->logout == false &&
+        __atomic_load_n( &user->generation, __ATOMIC_ACQUIRE ) == generation &&
+        out_queue_push( &user->out_queue, page ) == 0 )
+    {
+        if( out_queue_flush( &user->out_queue, user->connection ) == OUT_QUEUE_ERR )
+            logout( user, 0, NULL );
+    }
+
+    stat_sem_post( &user->write_mutex );
+}
+
+// hand the filled part of the current page to the client's queue
+static void reply_flush_page( reply_t *reply )
+{
+    user_t *user = reply->user;
+
+    if( reply->page == NULL )
+        return;
+
+    if( reply->page->len > 0 )
+    {
+        // replies built by a room's owner go to a user on another reactor
+        if( __atomic_load_n( &user->reactor, __ATOMIC_ACQUIRE ) != this_reactor )
+            post_mail( user, reply->generation, MAIL_REPLY, reply->page );
+        else
+            queue_reply( user, reply->generation, reply->page );
+    }
+
+    msg_buf_unref( reply->page );
+    reply->page = NULL;
+}
+
+// Format a line onto the response.  Lines are packed into pages of
+// REPLY_PAGE_SIZE bytes and a page only goes out once it is full.
+void reply_line( reply_t *reply, char *msg, ... )
+{
+    int         len;
+    va_list     ap;
+
+    for( ;; )
+    {
+        if( reply->page == NULL )
         {
-            found = true;
-            // execute desired command
-            ret_val = commands[ i ].command_function( user, argc, argv );
+            reply->page = msg_buf_new( REPLY_PAGE_SIZE );
+            if( reply->page == NULL )
+                return;
+            reply->page->len = 0;
+        }
 
-            if( ret_val == DISPLAY_USAGE )
-                write_client( user->connection, "Usage: %s%s %s \n", CMD_SIG, argv[ 0 ], commands[ i ].command_parameter_usage );
+        va_start( ap, msg );
+        len = vsnprintf( reply->page->data + reply->page->len, REPLY_PAGE_SIZE - reply->page->len, msg, ap );
+        va_end( ap );
 
+        if( len >= MAX_LINE )
+            len = MAX_LINE - 1;
+
+        // the line fit, or it could not fit any page
+        if( reply->page->len + len < REPLY_PAGE_SIZE || reply->page->len == 0 )
             break;
-        }
+
+        reply_flush_page( reply );
     }
-    
-    if ( true == user->admin )
+
+    reply->page->len += len;
+}
+
+// send what is left of the response
+void reply_end( reply_t *reply )
+{
+    reply_flush_page( reply );
+}
+
+// build the bytes a chat line goes out as ("<text> \n")
+msg_buf_t *new_wire_msg( char *text, int len )
+{
+    msg_buf_t *wire;
+
+    if( len >= MAX_LINE )
+        len = MAX_LINE - 1;
+
+    wire = msg_buf_new( len + 2 );
+    if( wire == NULL )
+        return NULL;
+
+    memcpy( wire->data, text, len );
+    wire->data[ len ] = ' ';
+    wire->data[ len + 1 ] = '\n';
+
+    return wire;
+}
+
+// Queue bytes for a client and push out as much as its socket takes right
+// now.  Never blocks, whatever the socket does not accept stays queued until
+// the event loop reports the socket writable again.  Past out_queue_limit the
+// message is dropped for this client, or the client is disconnected.
+// A client owned by another reactor is handed the message through its mailbox.
+void send_to_user( user_t *user, msg_buf_t *buf )
+{
+    uint64_t trace_ns = trace_start( buf->trace_id );
+
+    if( __atomic_load_n( &user->reactor, __ATOMIC_ACQUIRE ) != this_reactor )
+    {
+        post_mail( user, __atomic_load_n( &user->generation, __ATOMIC_ACQUIRE ), MAIL_SEND, buf );
+        trace_span( buf->trace_id, "post_mail", trace_ns, user->user_id );
+        return;
+    }
+
+    stat_sem_wait( &user->write_mutex );
+
+    if( user->logout == false )
     {
-        for( k = 0; k < num_admin_commands; k++ )
+        if( user->out_queue.bytes + buf->len > out_queue_limit )
         {
-            if( strcicmp( argv[ 0 ], admin_commands[ k ].command_string ) == 0 )
+            if( out_queue_policy == OVERFLOW_DISCONNECT )
             {
-                found = true;
-                // execute desired command
-                ret_val = admin_commands[ k ].command_function( user, argc, argv );
+                log_msg( LOG_LEVEL_WARN, "%s on thread %d is not reading, disconnecting.", user->user_name, user->user_id );
+                out_queue_clear( &user->out_queue );
+                logout( user, 0, NULL );
+            }
+            stats_add( dropped, 1 );
+        }
+        else if( out_queue_push( &user->out_queue, buf ) == 0 )
+        {
+            if( out_queue_flush( &user->out_queue, user->connection ) == OUT_QUEUE_ERR )
+                logout( user, 0, NULL );
+        }
+    }
+
+    stat_sem_post( &user->write_mutex );
+
+    trace_span( buf->trace_id, "write_client", trace_ns, user->user_id );
+}
+
+// socket became writable, send what is queued
+void flush_user( user_t *user )
+{
+    stat_sem_wait( &user->write_mutex );
+
+    if( out_queue_flush( &user->out_queue, user->connection ) == OUT_QUEUE_ERR )
+    {
+        out_queue_clear( &user->out_queue );
+        logout( user, 0, NULL );
+    }
+
+    stat_sem_post( &user->write_mutex );
+}
+
+void server_error( char *msg )
+{
+    destroy_user_thread();
+    fprintf( stderr, "%s\n", msg );
+    exit( EXIT_FAILURE );
+}
+
+// Map the connection table.  The mapping is not committed up front, a slot's
+// pages are only backed once that slot is first claimed.
+void init_user_thread( int max_conn )
+{
+    struct rlimit limit;
+
+    user_thread = mmap( NULL, max_conn * sizeof( user_t ), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+    if( user_thread == MAP_FAILED )
+        server_error( "Error mapping connection table" );
+
+    user_thread_size = max_conn;
+    user_thread_unused = 0;
+    user_free_head = -1;
+    live_users = NULL;
+    stat_sem_init( &user_table_mutex, &user_table_class, "users" );
+
+    if( hash_map_init( &user_index, true ) != HASH_MAP_OK )
+        server_error( "Error allocating user index" );
+
+    if( init_intern() != HASH_MAP_OK )
+        server_error( "Error allocating name table" );
+
+    // allow one descriptor per connection (best effort, capped by the hard limit)
+    if( getrlimit( RLIMIT_NOFILE, &limit ) == 0 && limit.rlim_cur < max_conn + LISTENQ )
+    {
+        limit.rlim_cur = max_conn + LISTENQ;
+        if( limit.rlim_max != RLIM_INFINITY && limit.rlim_cur > limit.rlim_max )
+            limit.rlim_cur = limit.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &limit );
+    }
+}
+
+void destroy_user_thread( void )
+{
+    int i; /* user_thread index           */
+
+    if( user_thread == NULL )
+        return;
+
+    for( i = 0; i < user_thread_unused; i++ )
+        stat_sem_destroy( &user_thread[ i ].write_mutex );
+
+    munmap( user_thread, user_thread_size * sizeof( user_t ) );
+    user_thread = NULL;
+}
+
+// Take a slot from the free list, or the next never-used slot if the free list
+// is empty, and link it into the list of live connections
+user_t *claim_user_slot( void )
+{
+    user_t *user = NULL;
+    int attempt;
+
+    for( attempt = 0; user == NULL && attempt < 2; attempt++ )
+    {
+        // released slots only come back once no fanout can still be using them
+        if( attempt > 0 )
+            epoch_reclaim();
+
+        stat_sem_wait( &user_table_mutex );
+
+        if( user_free_head != -1 )
+        {
+            user = &user_thread[ user_free_head ];
+            user_free_head = user->next_free;
+        }
+        else if( user_thread_unused < user_thread_size )
+        {
+            user = &user_thread[ user_thread_unused ];
+            user->user_id = user_thread_unused++;
+            stat_sem_init( &user->write_mutex, &write_mutex_class, "slot %d", user->user_id );
+            user->logout = true;
+        }
+
+        if( user != NULL )
+        {
+            user->used = true;
+            user->named = false;
+            user->name_id = INTERN_NONE;
+            user->reply_id = INTERN_NONE;
+            memset( user->user_name, 0, MAX_USER_NAME_LEN );
+
+            // mail posted for the slot's previous connection is ignored from here on
+            __atomic_add_fetch( &user->generation, 1, __ATOMIC_RELEASE );
+
+            // Live but not attached yet: still logged out, and anything sent
+            // meanwhile goes through the mailbox of the reactor attaching it
+            __atomic_store_n( &user->reactor, this_reactor, __ATOMIC_RELEASE );
+
+            user->live_prev = NULL;
+            user->live_next = live_users;
+            if( live_users != NULL )
+                live_users->live_prev = user;
+            live_users = user;
+        }
+
+        stat_sem_post( &user_table_mutex );
+    }
+
+    return user;
+}
+
+// Unlink a slot from the live list and push it on the free list
+void release_user_slot( user_t *user )
+{
+    stat_sem_wait( &user_table_mutex );
+
+    if( user->live_prev != NULL )
+        user->live_prev->live_next = user->live_next;
+    else
+        live_users = user->live_next;
+
+    if( user->live_next != NULL )
+        user->live_next->live_prev = user->live_prev;
+
+    user->used = false;
+
+    stat_sem_post( &user_table_mutex );
+
+    // a fanout that picked the user out of a room snapshot may still be using it
+    epoch_retire( user, free_user_slot );
+}
+
+// put a released slot back on the free list
+void free_user_slot( void *slot )
+{
+    user_t *user = slot;
+
+    stat_sem_wait( &user_table_mutex );
+    user->next_free = user_free_head;
+    user_free_head = user->user_id;
+    stat_sem_post( &user_table_mutex );
+}
+
+// handle a line received while waiting for the client's username
+void get_username( user_t *user, char *msg )
+{
+    int     i;
+    int     result;
+
+    // an empty name can't be looked up or addressed by anyone
+    if( '\0' == msg[ 0 ] )
+    {
+        write_user( user, "Error: username cannot be empty, please try again. \n" );
+        write_user( user, "\nEnter username: " );
+        return;
+    }
+
+    // verify username is not greater than the maximum number of allowed characters
+    if( strlen( msg ) >= MAX_USER_NAME_LEN )
+    {
+        write_user( user, "Error: exceeded maximum username length of %d characters, please try again. \n", MAX_USER_NAME_LEN );
+        write_user( user, "\nEnter username: " );
+        return;
+    }
+
+    // verify username is alphanumeric
+    for( i = 0; i < strlen( msg ); i++ )
+    {
+        if( !isalnum( msg[ i ] ) )
+        {
+            write_user( user, "Invalid character: %c, user name must be alphanumeric. \n", msg[ i ] );
+            write_user( user, "\nEnter username: " );
+            return;
+        }
+    }
+
+    // Interned names are kept for good, so only a name that is free gets one.
+    // One taken meanwhile fails the put below, it was interned by its holder.
+    if( hash_map_get( &user_index, msg ) != NULL )
+    {
+        write_user( user, "username %s is already in use, please try again. \n", msg );
+        write_user( user, "\nEnter username: " );
+        return;
+    }
+
+    // without an id the user's mutes would not work, so no login
+    user->name_id = intern_name( msg );
+    if( user->name_id == INTERN_NONE )
+    {
+        write_user( user, "Error: the server can't take any new usernames, please try a name used before. \n" );
+        write_user( user, "\nEnter username: " );
+        return;
+    }
+
+    // set username before the name is published
+    strncpy( user->user_name, msg, strlen( msg ) );
+
+    // claim the name in the user index, this fails if it is already in use
+    result = hash_map_put( &user_index, user->user_name, user );
+    if( result != HASH_MAP_OK )
+    {
+        memset( user->user_name, 0, MAX_USER_NAME_LEN );
+        user->name_id = INTERN_NONE;
+
+        if( result == HASH_MAP_EXISTS )
+            write_user( user, "username %s is already in use, please try again. \n", msg );
+        write_user( user, "\nEnter username: " );
+        return;
+    }
+
+    user->named = true;
+    intern_set_owner( user->name_id, user );
+
+    // admin must supply a password before logging in
+    if( strcmp( user->user_name, ADMIN_NAME ) == 0 )
+    {
+        write_user( user, "\nEnter password: " );
+        user->state = USER_STATE_PASSWORD;
+        return;
+    }
+
+    login_user( user );
+}
+
+// handle a line received while waiting for the admin password
+bool admin_check( user_t *user_submitted, char *password )
+{
+    if( strcmp( password, ADMIN_PASSWORD ) == 0 )
+    {
+        user_submitted->admin = true;
+        write_user( user_submitted, "\nWelcome Admin! \n" );
+        login_user( user_submitted );
+
+        return true;
+    }
+
+    write_user( user_submitted, "\nWrong password! \n" );
+    user_submitted->logout = true;
+    user_submitted->login_failure = true;
+
+    return false;
+}
+
+// respond to client and place the freshly logged in user in the lobby
+void login_user( user_t *user )
+{
+    // the address may have been blocked since the connection was accepted
+    if( is_blocked( user->user_ip_addr ) )
+    {
+        write_user( user, "\nYour address is blocked from this chat server. \n" );
+        logout( user, 0, NULL );
+        return;
+    }
+
+    user->state = USER_STATE_CHAT;
+    stats_add( logins, 1 );
+
+    write_user( user, "\nConnected to chat server.  You are logged in as %s. \n", user->user_name );
+
+    log_msg( LOG_LEVEL_INFO, "%s is running on thread %d.", user->user_name, user->user_id );
+
+    // set user's chatroom to lobby (default chatroom)
+    add_user_to_chatroom( user, lobby );
+}
+
+void init_chatroom( chat_room_t *room, int id, char *name )
+{
+    room->room_id = id;
+    strncpy( room->room_name, name, MAX_ROOM_NAME_LEN );
+    room->user_count = 0;
+    room->muting_members = 0;
+    room->members = NULL;
+    room->reserved = 0;
+    room->closing = false;
+    room->handoff = false;
+    room->held = NULL;
+    room->held_tail = NULL;
+    room->load = 0;
+    stat_sem_init( &room->members_mutex, &members_mutex_class, "room %s", room->room_name );
+
+    // spread new rooms over the reactors, balance_rooms() moves them by load later
+    room->owner = &reactors[ id % num_reactors ];
+    __atomic_add_fetch( &room->generation, 1, __ATOMIC_RELEASE );
+
+    // a re-used room starts with an empty history (its slot ring is kept)
+    if( room->history.lines == NULL )
+        init_history( &room->history, history_depth );
+    else
+        history_clear( &room->history );
+
+    room->history_log.fd = -1;
+    room->history_log.index_fd = -1;
+}
+
+chat_room_t *find_chat_room( char *name )
+{
+    return hash_map_get( &room_index, name );
+}
+
+// Register a new room under name, re-using a reclaimed room if one is available.
+// Returns SUCCESS with the room in room_out, ROOM_EXISTS if a room with that
+// name already exists, ROOM_CLOSING if one is still being closed, or FAILURE
+// if out of memory.
+//
+// The room's log is opened and read while the room is still private, outside
+// room_table_mutex.  The name is claimed in opening_rooms meanwhile, as it is
+// by a closing room until its log is closed, so no two rooms have the same
+// log open.
+int open_chat_room( char *name, chat_room_t **room_out )
+{
+    chat_room_t *room;
+    chat_room_t *holder;
+    int id;
+    int result;
+
+    stat_sem_wait( &room_table_mutex );
+
+    if( free_rooms != NULL )
+    {
+        room = free_rooms;
+        free_rooms = room->room_next;
+    }
+    else
+    {
+        room = calloc( 1, sizeof( chat_room_t ) );
+        if( room == NULL )
+        {
+            stat_sem_post( &room_table_mutex );
+            return FAILURE;
+        }
+    }
+
+    id = next_room_id++;
+
+    stat_sem_post( &room_table_mutex );
+
+    init_chatroom( room, id, name );
+
+    // another reactor may be opening or closing the same name, or have
+    // published it since it was looked up
+    stat_sem_wait( &room_table_mutex );
 
-                if( ret_val == DISPLAY_USAGE )
-                    write_client( user->connection, "Usage: %s%s %s \n", CMD_SIG, argv[ 0 ], admin_commands[ k ].command_parameter_usage );
+    holder = hash_map_get( &opening_rooms, room->room_name );
+    if( holder != NULL )
+        result = holder->closing ? ROOM_CLOSING : ROOM_EXISTS;
+    else if( find_chat_room( room->room_name ) != NULL )
+        result = ROOM_EXISTS;
+    else if( hash_map_put( &opening_rooms, room->room_name, room ) != HASH_MAP_OK )
+        result = FAILURE;
+    else
+        result = SUCCESS;
 
-                break;
-            }
-        }
-    }
-    // catch unknown commands
-    if( false == found )
+    stat_sem_post( &room_table_mutex );
+
+    if( result != SUCCESS )
     {
-        write_client( user->connection, "Invalid command: %s \n", argv[ 0 ] );
-        write_client( user->connection, "type \"/help\" for a list of commands. \n" );
+        recycle_chat_room( room );
+        return result;
     }
-}
 
-// write to all clients with locking performed
-void write_all_clients( char *msg, ... )
-{
-    int i; /* user_thread index        */
-    char full_msg[ MAX_LINE ]; /* constructed message      */
-    va_list ap;
+    // pick up the room's history where it left off
+    if( history_dir != NULL && history_log_open( &room->history_log, history_dir, room->room_name ) == HISTORY_LOG_OK )
+        history_log_read( &room->history_log, &room->history, history_depth );
 
-    va_start( ap, msg );
-    vsprintf( full_msg, msg, ap );
-    va_end( ap );
+    stat_sem_wait( &room_table_mutex );
 
-    // loop through all threads and send message to each that is in use
-    for( i = 0; i < MAX_CONN; i++ )
+    result = hash_map_put( &room_index, room->room_name, room );
+    if( result == HASH_MAP_OK )
     {
-        if( user_thread[ i ].used == true )
-        {
-            sem_wait( &user_thread[ i ].write_mutex );
+        room->room_prev = NULL;
+        room->room_next = active_rooms;
+        if( active_rooms != NULL )
+            active_rooms->room_prev = room;
+        active_rooms = room;
+    }
 
-            // send chat message to active client (including client who sent message)
-            write_client( user_thread[ i ].connection, "%s \n", full_msg );
+    hash_map_remove_value( &opening_rooms, room->room_name, room );
 
-            sem_post( &user_thread[ i ].write_mutex );
-        }
+    stat_sem_post( &room_table_mutex );
+
+    if( result != HASH_MAP_OK )
+    {
+        history_log_close( &room->history_log );
+        recycle_chat_room( room );
+        return FAILURE;
     }
-}
 
-void server_error( char *msg )
-{
-    destroy_user_thread();
-    fprintf( stderr, "%s\n", msg );
-    exit( EXIT_FAILURE );
+    *room_out = room;
+    return SUCCESS;
 }
 
-void init_user_thread( void )
+// Close a room nobody is in (live counts joins in progress too) unless it is
+// the lobby or already closing.  Its name goes out of room_index at once, so
+// the room is either usable or gone; the name stays claimed in opening_rooms
+// until the owner has closed the room's log.
+void close_empty_room( chat_room_t *room )
 {
-    int i; /* user_thread index           */
+    bool closing;
 
-    memset( &user_thread, 0, sizeof( user_thread ) );
+    stat_sem_wait( &room->members_mutex );
+    closing = __atomic_load_n( &room->user_count, __ATOMIC_RELAXED ) == 0 && !room->closing && room != lobby;
+    if( closing )
+        room->closing = true;
+    stat_sem_post( &room->members_mutex );
 
-    for( i = 0; i < MAX_CONN; i++ )
-        sem_init( &user_thread[ i ].write_mutex, 0, 1 );
-}
+    if( !closing )
+        return;
 
-void destroy_user_thread( void )
-{
-    int i; /* user_thread index           */
+    // without the claim the name stays listed until the room is closed
+    stat_sem_wait( &room_table_mutex );
+    if( hash_map_put( &opening_rooms, room->room_name, room ) == HASH_MAP_OK )
+        hash_map_remove_value( &room_index, room->room_name, room );
+    stat_sem_post( &room_table_mutex );
 
-    for( i = 0; i < MAX_CONN; i++ )
-        sem_destroy( &user_thread[ i ].write_mutex );
+    // the owner closes it once everything sent to the room has gone out
+    if( room_runs_here( room ) )
+        close_chat_room( room );
+    else
+        post_room_mail( room, MAIL_CLOSE, INTERN_NONE, 0, 0, NULL );
 }
 
-void get_username( user_t *user )
+// Unregister an empty room and keep it (with its allocations) for re-use.
+// The room is marked closing, so no join can still be on its way in.
+// Runs on the room's owner, mail still on its way to the room is dropped.
+void close_chat_room( chat_room_t *room )
 {
-    int     i;
-    int     result;
-    char    msg[ MAX_LINE ];
-    bool    try_again = true;
+    member_set_t *members = room->members;
 
-    while( try_again == true )
-    {
-        try_again = false;
-
-        // prompt and save client's username
-        write_client( user->connection, "\nEnter username: " );
+    __atomic_add_fetch( &room->generation, 1, __ATOMIC_RELEASE );
 
-        result = read_client( user->connection, msg );
+    stat_sem_wait( &room_table_mutex );
 
-        if( result == CONN_ERR )
-        {
-            user->logout = true;
-            user->login_failure = true;
-            return;
-        }
+    hash_map_remove_value( &room_index, room->room_name, room );
 
-        // verify username is not greater than the maximum number of allowed characters
-        if( strlen( msg ) >= MAX_USER_NAME_LEN )
-        {
-            write_client( user->connection, "Error: exceeded maximum username length of %d characters, please try again. \n", MAX_USER_NAME_LEN );
-            try_again = true;
-            continue;
-        }
+    if( room->room_prev != NULL )
+        room->room_prev->room_next = room->room_next;
+    else
+        active_rooms = room->room_next;
 
-        // verify username is not already in use
-        for( i = 0; i < MAX_CONN; i++ )
-        {
-            if( ( true == user_thread[ i ].used ) && ( strcicmp( user_thread[ i ].user_name, msg ) == 0 ) )
-            {
-                write_client( user->connection, "username %s is already in use, please try again. \n", msg );
-                try_again = true;
-                continue;
-            }
-        }
+    if( room->room_next != NULL )
+        room->room_next->room_prev = room->room_prev;
 
-        // verify username is alphanumeric
-        for( i = 0; i < strlen( msg ); i++ )
-        {
-            if( !isalnum( msg[ i ] ) )
-            {
-                write_client( user->connection, "Invalid character: %c, user name must be alphanumeric. \n", msg[ i ] );
-                try_again = true;
-                continue;
-            }
-        }
-    }
+    stat_sem_post( &room_table_mutex );
 
-    // set username and respond to client
-    strncpy( user->user_name, msg, strlen( msg ) );
+    history_log_close( &room->history_log );
 
-    // check username for admin
-    admin_check( user );
+    // mail held for a hand-off still in progress was for the room just closed
+    finish_handoff( room );
 
-    if( user->logout == true )
-        return;
+    // the name can be opened again now the log is closed
+    stat_sem_wait( &room_table_mutex );
+    hash_map_remove_value( &opening_rooms, room->room_name, room );
+    stat_sem_post( &room_table_mutex );
 
-    write_client( user->connection, "\nConnected to chat server.  You are logged in as %s. \n", user->user_name );
+    __atomic_store_n( &room->members, NULL, __ATOMIC_RELEASE );
+    epoch_retire( members, free );
 
-    printf( "%s is running on thread %d.\n", user->user_name, user->user_id );
+    // the room is re-used only once nobody can be looking at it
+    epoch_retire( room, recycle_chat_room );
 }
 
-bool admin_check( user_t *user_submitted )
+void recycle_chat_room( void *ptr )
 {
-    // declare variables for use in checking password
-    char msg[ sizeof( ADMIN_PASSWORD ) ];
-    int result;
-
-    if( strcmp( user_submitted->user_name, ADMIN_NAME ) == 0 )
-    {
-        // prompt for password
-        write_client( user_submitted->connection, "\nEnter password: " );
-
-        result = read_client( user_submitted->connection, msg );
+    chat_room_t *room = ptr;
 
-        if( result == CONN_ERR )
-        {
-            user_submitted->logout = true;
-            user_submitted->login_failure = true;
-
-            return false;
-        }
-
-        if( strcmp( msg, ADMIN_PASSWORD ) == 0 )
-        {
-            user_submitted->admin = true;
-            write_client( user_submitted->connection, "\nWelcome Admin! \n" );
+    stat_sem_destroy( &room->members_mutex );
 
-            return true;
-        }
-        else
-        {
-            write_client( user_submitted->connection, "\nWrong password! \n" );
-            user_submitted->logout = true;
-            user_submitted->login_failure = true;
+    stat_sem_wait( &room_table_mutex );
+    room->room_next = free_rooms;
+    free_rooms = room;
+    stat_sem_post( &room_table_mutex );
+}
 
-            return false;
-        }
-    }
+// reactor running the room's fanout and history
+reactor_t *room_owner( chat_room_t *room )
+{
+    return __atomic_load_n( &room->owner, __ATOMIC_ACQUIRE );
+}
 
-    return false;
+// whether this reactor can run work for the room itself rather than post it,
+// a room still being handed over to it takes its mail in order
+bool room_runs_here( chat_room_t *room )
+{
+    return room_owner( room ) == this_reactor && !room->handoff;
 }
 
-void init_chatroom( chat_room_t *room, int id, char *name )
+// Hand work for a room to the reactor that owns it, the mail holds its own
+// reference to buf
+void post_room_mail( chat_room_t *room, int type, int from_id, unsigned int from_generation, int arg, msg_buf_t *buf )
 {
-    int i;
+    mail_t *mail = malloc( sizeof( mail_t ) );
 
-    room->room_id = id;
-    strncpy( room->room_name, name, MAX_ROOM_NAME_LEN );
-    room->user_count = 0;
-    for( i = 0; i < MAX_USERS_IN_ROOM; i++ )
-        room->users[ i ] = NULL;
-    sem_init( &room->history_mutex, 0, 1 );
+    if( mail == NULL )
+        return;
+
+    mail->type = type;
+    mail->target = room;
+    mail->generation = __atomic_load_n( &room->generation, __ATOMIC_ACQUIRE );
+    mail->from_id = from_id;
+    mail->from_generation = from_generation;
+    mail->arg = arg;
+    mail->buf = buf != NULL ? msg_buf_ref( buf ) : NULL;
+    mail->forwarded = false;
+
+    mailbox_post( &room_owner( room )->mailbox, mail );
 }
 
+// Send a chat line to the user's room.  The line is formatted here, the
+// fanout and the history append run on the reactor that owns the room.
 void write_chatroom( user_t *user, char *msg, ... )
 {
-    int i; /* user_thread index        */
     char full_msg[ MAX_LINE ]; /* constructed message      */
+    int len;
+    msg_buf_t *wire;
+    chat_room_t *room = user->chat_room;
     va_list ap;
 
     va_start( ap, msg );
-    vsprintf( full_msg, msg, ap );
+    len = vsnprintf( full_msg, MAX_LINE, msg, ap );
     va_end( ap );
 
-    // loop through all users in chatroom
-    for( i = 0; i < MAX_USERS_IN_ROOM; i++ )
+    // serialize once, every recipient's queue shares the same bytes
+    wire = new_wire_msg( full_msg, len );
+    if( wire == NULL )
+        return;
+    wire->trace_id = trace_current;
+
+    if( room_runs_here( room ) )
+        room_fanout( room, user->name_id, wire );
+    else
     {
-        // check that each user in the chatroom is used before sending message
-        if( user->chat_room->users[ i ] != NULL && user->chat_room->users[ i ]->used == true )
+        trace_instant( wire->trace_id, "post_room_mail", room_owner( room )->id );
+        post_room_mail( room, MAIL_CHAT, user->name_id, 0, 0, wire );
+    }
+
+    msg_buf_unref( wire );
+}
+
+// Deliver a chat line to every member of a room and add it to the room's
+// history.  Mutes are between names, the sender's are looked up by its id.
+void room_fanout( chat_room_t *room, int sender_id, msg_buf_t *wire )
+{
+    int i; /* room member index        */
+    int count;
+    member_set_t *members;
+    user_t *member;
+    user_t *sender;
+    bool filter;
+    int recipients = 0;
+    uint64_t start_ns = timestamp_mono_ns();
+    uint64_t trace_ns = trace_start( wire->trace_id );
+
+    // mute filtering is skipped entirely when no member of the room mutes anyone
+    filter = __atomic_load_n( &room->muting_members, __ATOMIC_RELAXED ) > 0;
+
+    // loop through a snapshot of the users in chatroom, joins and leaves don't wait for us
+    epoch_enter();
+    sender = filter ? intern_owner( sender_id ) : NULL;
+    members = room_members( room, &count );
+    for( i = 0; i < count; i++ )
+    {
+        member = room_member( members, i );
+
+        // skip slots of users who have left
+        if( member != NULL )
         {
             // Filter out unwanted messages from ignore list            
-            if ( (!is_ignoring_user_name(user->chat_room->users[i], user->user_name ))&&(!is_ignoring_user_name(user, user->chat_room->users[i]->user_name)))            
+            if ( !filter || ( (!is_ignoring_user_id( member, sender_id ))&&(!is_ignoring_user_id( sender, member->name_id )) ) )
             {                
-                printf( "writing to %s on thread %d\n", user->chat_room->users[ i ]->user_name, user->chat_room->users[ i ]->user_id );
-                sem_wait( &user->chat_room->users[ i ]->write_mutex );
-                // send message to user in chatroom (including user who sent message)                
-                write_client( user->chat_room->users[ i ]->connection, "%s \n", full_msg );
-                sem_post( &user->chat_room->users[ i ]->write_mutex );            
+                log_msg( LOG_LEVEL_DEBUG, "writing to %s on thread %d", member->user_name, member->user_id );
+                // queue message to user in chatroom (including user who sent message)                
+                send_to_user( member, wire );
+                recipients++;
             }        
         }
 
     }
+    epoch_exit();
 
-    // Write the message to the next available line of chatroom's history (only if it isn't blank)
-    if ( '\0' != msg[ 0 ] )
-        write_chatroom_history( user, full_msg );
-    
-    return;
+    room->load += count;
+    trace_span( wire->trace_id, "room_fanout", trace_ns, recipients );
+
+    // Write the message to the next available line of chatroom's history (the wire adds " \n")
+    trace_ns = trace_start( wire->trace_id );
+    write_chatroom_history( room, sender_id, wire->data, wire->len - 2 );
+    trace_span( wire->trace_id, "write_chatroom_history", trace_ns, 0 );
+
+    stats_add( fanouts, 1 );
+    stats_add( fanout_recipients, recipients );
+    stats_latency( fanout_ns, start_ns );
 }
 
-void write_chatroom_history( user_t *user, char *message )
+void write_chatroom_history( chat_room_t *room, int sender_id, char *message, size_t len )
 {   
-    
-    if ( NULL == user )
+    time_t ltime;   /* calendar time */
+
+    if ( 0 == len )
         return;
-        
-    sem_wait( &user->chat_room->history_mutex );
-        memset( user->chat_room->history[user->chat_room->history_count].message, 0, BUFFER_SIZE);
-        
-		time_t ltime;           /* calendar time */
-		ltime = time(NULL);
-        
-        // Populate the history entry (user_name, timestamp, message
-        strcpy(user->chat_room->history[user->chat_room->history_count].user_name, user->user_name);
-		strftime(user->chat_room->history[user->chat_room->history_count].timestamp, TIMESTAMP_SIZE, "%a %I:%M:%S %p", localtime(&ltime)); /* populate timestamp string */
-        strcpy(user->chat_room->history[user->chat_room->history_count].message, message);
-        
-        // Update pointer for next history entry
-        user->chat_room->history_count = (user->chat_room->history_count + 1) % HISTORY_SIZE;
 
-    sem_post( &user->chat_room->history_mutex );
-    
-    return;
+    ltime = timestamp_now();
+    history_append( &room->history, ltime, sender_id, message, len );
+    history_log_append( &room->history_log, ltime, interned_name( sender_id ), message, len );
 }
 
 bool chatroom_is_active( chat_room_t *room )
 {
-    return room->user_count != 0 ? true : false;
+    return __atomic_load_n( &room->user_count, __ATOMIC_RELAXED ) != 0 ? true : false;
+}
+
+// Room members are published to readers as a member_set_t.  Readers take the
+// set and its count without locking (inside epoch_enter()/epoch_exit()).
+// Writers, serialized by members_mutex, only ever fill the next unused slot or
+// clear a member's slot in place; anything else builds a new set and retires
+// the old one.
+member_set_t *room_members( chat_room_t *room, int *count )
+{
+    member_set_t *members = __atomic_load_n( &room->members, __ATOMIC_ACQUIRE );
+
+    *count = members != NULL ? __atomic_load_n( &members->count, __ATOMIC_ACQUIRE ) : 0;
+    return members;
+}
+
+// member in slot i of a set, NULL if that member has left
+user_t *room_member( member_set_t *members, int i )
+{
+    return __atomic_load_n( &members->users[ i ], __ATOMIC_ACQUIRE );
+}
+
+// Publish a new set holding the room's current members packed at the front.
+// Called with members_mutex held.
+static int repack_members( chat_room_t *room, int capacity )
+{
+    member_set_t *old_set = room->members;
+    member_set_t *new_set;
+    user_t *member;
+    int i, count = 0;
+
+    new_set = malloc( sizeof( member_set_t ) + capacity * sizeof( user_t * ) );
+    if( new_set == NULL )
+        return FAILURE;
+
+    for( i = 0; old_set != NULL && i < old_set->count; i++ )
+    {
+        member = old_set->users[ i ];
+        if( member != NULL )
+        {
+            member->room_index = count;
+            new_set->users[ count++ ] = member;
+        }
+    }
+    new_set->capacity = capacity;
+    new_set->count = count;
+
+    __atomic_store_n( &room->members, new_set, __ATOMIC_RELEASE );
+    epoch_retire( old_set, free );
+
+    return SUCCESS;
 }
 
 int remove_user_from_chatroom( user_t *user )
 {
-    int i;
+    int live;
     struct chat_room_t *room_pointer;
+    member_set_t *members;
 
     // check if user is not currently in a chatroom
     if( user->chat_room == NULL )
@@ -509,58 +1849,99 @@ int remove_user_from_chatroom( user_t *user )
 
     room_pointer = user->chat_room;
 
-    for( i = 0; i < MAX_USERS_IN_ROOM; i++ )
-    {
-        if( user->chat_room->users[ i ] == user )
-        {
-            // announce to the room this user is leaving
-            write_chatroom( user, "%s left the chatroom.", user->user_name );
-            user->chat_room->user_count--;
+    // announce to the room this user is leaving
+    write_chatroom( user, "%s left the chatroom.", user->user_name );
 
-            user->chat_room->users[ i ] = NULL;
-            user->chat_room = NULL;
+    stat_sem_wait( &room_pointer->members_mutex );
 
-            return SUCCESS;
-        }
-    }
+    // vacate the leaving user's slot
+    members = room_pointer->members;
+    __atomic_store_n( &members->users[ user->room_index ], NULL, __ATOMIC_RELEASE );
+    live = __atomic_sub_fetch( &room_pointer->user_count, 1, __ATOMIC_RELAXED );
 
-    if( room_pointer->user_count == 0 )
-    {
-        sem_destroy( &room_pointer->history_mutex );
-    }
+    if( user->mutes != NULL )
+        __atomic_sub_fetch( &room_pointer->muting_members, 1, __ATOMIC_RELAXED );
+
+    // pack the set once most of it is vacant slots
+    if( members->count > DFLT_ROOM_CAPACITY && live < members->count / 4 )
+        repack_members( room_pointer, 2 * live > DFLT_ROOM_CAPACITY ? 2 * live : DFLT_ROOM_CAPACITY );
+
+    stat_sem_post( &room_pointer->members_mutex );
+
+    __atomic_store_n( &user->chat_room, NULL, __ATOMIC_RELEASE );
+
+    // reclaim rooms nobody is in any more
+    if( live == 0 )
+        close_empty_room( room_pointer );
 
     return SUCCESS;
 }
 
 int add_user_to_chatroom( user_t *user, chat_room_t *room )
 {
-    int i;
+    member_set_t *members;
+    int live;
+    int result = SUCCESS;
 
-    for( i = 0; i < MAX_USERS_IN_ROOM; i++ )
+    if( user->chat_room == room )
     {
-        if( room->users[ i ] == NULL )
-        {
-            // remove user from previous chatroom (if applicable)
-            remove_user_from_chatroom( user );
+        write_user( user, "You are already in chatroom %s. \n", room->room_name );
+        return FAILURE;
+    }
 
-            // set user's chatroom
-            user->chat_room = room;
+    // Reserve a slot in the member set, packing or growing it.  The reservation
+    // counts as a member so the room can't close while the user leaves the old one.
+    stat_sem_wait( &room->members_mutex );
+    if( room->closing )
+    {
+        stat_sem_post( &room->members_mutex );
+        write_user( user, "Chatroom %s does not exist. \n", room->room_name );
+        return FAILURE;
+    }
 
-            // add user to chatroom's user* array and increment user_count
-            user->chat_room->users[ i ] = user;
-            user->chat_room->user_count++;
+    live = __atomic_add_fetch( &room->user_count, 1, __ATOMIC_RELAXED );
+    room->reserved++;
 
-            printf( "%s joined chatroom %s \n", user->user_name, room->room_name );
-            write_client( user->connection, "You have joined chatroom %s. \n", room->room_name );
-            write_chatroom( user, "%s has joined the chatroom.", user->user_name );
+    members = room->members;
+    if( members == NULL || members->count + room->reserved > members->capacity )
+        result = repack_members( room, 2 * live > DFLT_ROOM_CAPACITY ? 2 * live : DFLT_ROOM_CAPACITY );
 
-            return SUCCESS;
-        }
+    if( result == FAILURE )
+    {
+        __atomic_sub_fetch( &room->user_count, 1, __ATOMIC_RELAXED );
+        room->reserved--;
+    }
+    stat_sem_post( &room->members_mutex );
+
+    if( result == FAILURE )
+    {
+        write_user( user, "Error: chatroom %s is full. \n", room->room_name );
+        return FAILURE;
     }
 
-    write_client( user->connection, "Error: chatroom %s is full. \n", room );
+    // remove user from previous chatroom (if applicable)
+    remove_user_from_chatroom( user );
 
-    return FAILURE;
+    // add user to the next free slot, readers see it once count covers it
+    stat_sem_wait( &room->members_mutex );
+    room->reserved--;
+    members = room->members;
+    user->room_index = members->count;
+    __atomic_store_n( &members->users[ members->count ], user, __ATOMIC_RELAXED );
+    __atomic_store_n( &members->count, members->count + 1, __ATOMIC_RELEASE );
+
+    if( user->mutes != NULL )
+        __atomic_add_fetch( &room->muting_members, 1, __ATOMIC_RELAXED );
+
+    // set user's chatroom
+    __atomic_store_n( &user->chat_room, room, __ATOMIC_RELEASE );
+    stat_sem_post( &room->members_mutex );
+
+    log_msg( LOG_LEVEL_INFO, "%s joined chatroom %s", user->user_name, room->room_name );
+    write_user( user, "You have joined chatroom %s. \n", room->room_name );
+    write_chatroom( user, "%s has joined the chatroom.", user->user_name );
+
+    return SUCCESS;
 }
 
 // ********** COMMANDS *************
@@ -568,65 +1949,46 @@ int add_user_to_chatroom( user_t *user, chat_room_t *room )
 int help( user_t *user_submitter, int argc, char **argv )
 {
     int i, j;
-    bool found_command = false;
-    int num_commands = sizeof( commands ) / sizeof(command_t);
-    int num_admincommands = sizeof( admin_commands ) / sizeof( admin_command_t );
+    command_t *command;
     bool is_admin = user_submitter->admin;
+    reply_t reply;
 
     switch( argc )
     {
     case 1:
-        write_client( user_submitter->connection, "available commands: \n" );
+        reply_begin( &reply, user_submitter );
+        reply_line( &reply, "available commands: \n" );
 
-        for( i = 0; i < num_commands; i++ )
+        for( i = 0; i < NUM_COMMANDS; i++ )
         {
-            write_client( user_submitter->connection, "\t%s \n", commands[ i ].command_string );
+            reply_line( &reply, "\t%s \n", commands[ i ].command_string );
         }
 
         if( is_admin )
         {
-            write_client( user_submitter->connection, "admin commands: \n" );
-            for( j = 0; j < num_admincommands; j++ )
+            reply_line( &reply, "admin commands: \n" );
+            for( j = 0; j < NUM_ADMIN_COMMANDS; j++ )
             {
-                write_client( user_submitter->connection, "\t%s \n", admin_commands[ j ].command_string );
+                reply_line( &reply, "\t%s \n", admin_commands[ j ].command_string );
             }
         }
 
+        reply_end( &reply );
         return SUCCESS;
 
     case 2:
-        for( i = 0; i < num_commands; i++ )
-        {
-            if( strcicmp( commands[ i ].command_string, argv[ 1 ] ) == 0 )            
-            {
-                found_command = true;
-                write_client( user_submitter->connection, "Usage: %s%s %s \n", CMD_SIG, commands[ i ].command_string , commands[ i ].command_parameter_usage );                
-                break;
-            }
-        }
-
-        if( is_admin )
-        {
-            for( j = 0; i < num_admincommands; j++ )
-            {
-                if( strcicmp( admin_commands[ j ].command_string, argv[ 1 ] ) == 0 )
-                {
-                    found_command = true;
-                    write_client( user_submitter->connection, "Usage: %s%s %s \n", CMD_SIG, admin_commands[ i ].command_string , admin_commands[ i ].command_parameter_usage );
-                    break;
-                }
-            }
-        }
+        command = find_command( user_submitter, argv[ 1 ] );
 
         // catch unknown commands
-        if( found_command == false )
+        if( NULL == command )
         {
-            write_client( user_submitter->connection, "Invalid command: %s \n", argv[ 1 ] );
+            write_user( user_submitter, "Invalid command: %s \n", argv[ 1 ] );
 
             return FAILURE;
         }
-        else
-            return SUCCESS;
+
+        write_user( user_submitter, "Usage: %s%s %s \n", CMD_SIG, command->command_string , command->command_parameter_usage );
+        return SUCCESS;
     }
 
     return DISPLAY_USAGE;
@@ -634,20 +1996,34 @@ int help( user_t *user_submitter, int argc, char **argv )
 
 int logout( user_t *user_submitter, int argc, char **argv )
 {
+    // only the owning reactor may touch the connection
+    if( __atomic_load_n( &user_submitter->reactor, __ATOMIC_ACQUIRE ) != this_reactor )
+    {
+        post_mail( user_submitter, __atomic_load_n( &user_submitter->generation, __ATOMIC_ACQUIRE ), MAIL_LOGOUT, NULL );
+        return SUCCESS;
+    }
+
+    // already on its way out, the descriptor may be closed
+    if( user_submitter->logout )
+        return SUCCESS;
+
     user_submitter->logout = true;
-    user_submitter->used = false;
+
+    // wake the event loop on the target's socket so it is disconnected
+    // even if it is not the user currently being processed
+    shutdown( user_submitter->connection, SHUT_RD );
     return SUCCESS;
 }
 
 int kick_user( user_t *user_submitter, int argc, char **argv )
 {
-    int i;
+    user_t *user = NULL;
     int result = FAILURE;
     char *user_name = argv[ 1 ];
 
     if ( false == user_submitter->admin )
     {
-        write_client( user_submitter->connection, "Only Admin can block. \n");
+        write_user( user_submitter, "Only Admin can block. \n");
         return FAILURE;
     }
     
@@ -658,24 +2034,21 @@ int kick_user( user_t *user_submitter, int argc, char **argv )
         return DISPLAY_USAGE;
     }
 
-    // iterate through all users to find the one targeted for kick
-    for( i = 0; i < MAX_CONN; i++ )
+    // look up the user targeted for kick
+    if( is_logged_in( user_name, &user ) )
     {
-        if( strcmp( user_thread[ i ].user_name, user_name ) == 0 )
-        {
-            // Call logout command on the targeted user
-            result = logout( &user_thread[ i ], argc, argv );
+        // Call logout command on the targeted user
+        result = logout( user, argc, argv );
 
-            if( result == SUCCESS )
-            {
-                write_client( user_submitter->connection, "User %s was kicked. \n", user_name );
-                return result;
-            }
+        if( result == SUCCESS )
+        {
+            write_user( user_submitter, "User %s was kicked. \n", user_name );
+            return result;
         }
     }
 
     // send message to user_submitter and return targeted user was not found
-    write_client( user_submitter->connection, "Could not find %s. \n", user_name );
+    write_user( user_submitter, "Could not find %s. \n", user_name );
 
     return result;
 }
@@ -695,84 +2068,86 @@ int kick_all_users_in_chat_room( user_t *user_submitter, int argc, char **argv )
 
     if ( false == user_submitter->admin )
     {
-        write_client( user_submitter->connection, "Only Admin can block. \n");
+        write_user( user_submitter, "Only Admin can block. \n");
         return FAILURE;
     }
 
     
-    // iterate through all chatrooms to check if chatroom with room_name exists
-    for( i = 0; i < MAX_ROOMS; i++ )
-    {
-        if( strcmp( chatrooms[ i ].room_name, room_name ) == 0 )
-        {
-            room = &chatrooms[ i ];
-            break;
-        }
-    }
+    // check if chatroom with room_name exists
+    room = find_chat_room( room_name );
 
     // Could not find the room
     if( room == NULL )
     {
-        write_client( user_submitter->connection, "Chatroom %s does not exist. \n", room_name );
+        write_user( user_submitter, "Chatroom %s does not exist. \n", room_name );
         return FAILURE;
     }
     struct user_t *current_user;
+    member_set_t *members;
+    int count;
     // Run the logout command on each user one by one
-    for( i = 0; i < room->user_count; i++ )
+    epoch_enter();
+    members = room_members( room, &count );
+    for( i = 0; i < count; i++ )
     {
-        if( room->users[ i ] != NULL )
+        current_user = room_member( members, i );
+        if( current_user != NULL )
         {
-            current_user = room->users[i];
             result = logout( current_user, argc, argv );
             if( result == SUCCESS )
             {
-                write_client( user_submitter->connection, "User %s was kicked. \n", room->users[ i ]->user_name );
+                write_user( user_submitter, "User %s was kicked. \n", current_user->user_name );
             }
         }
     }
+    epoch_exit();
 
     return SUCCESS;
 }
 
 int list_chat_rooms( user_t *user_submitter, int argc, char **argv )
 {
-    int i;
+    chat_room_t *room;
     bool active_rooms_found = false;
+    reply_t reply;
 
-    write_client( user_submitter->connection, "active chatrooms: \n" );
+    reply_begin( &reply, user_submitter );
+    reply_line( &reply, "active chatrooms: \n" );
 
-    //search for active chat rooms to print to user_submitter
-    for( i = 0; i < MAX_ROOMS; i++ )
+    //walk the active chat rooms to print to user_submitter
+    stat_sem_wait( &room_table_mutex );
+    for( room = active_rooms; room != NULL; room = room->room_next )
     {
-        printf( "%d", chatrooms[ i ].user_count );
+        log_msg( LOG_LEVEL_DEBUG, "chatroom %s: %d users", room->room_name, __atomic_load_n( &room->user_count, __ATOMIC_RELAXED ) );
 
-        if( chatroom_is_active( &chatrooms[ i ] ) )
+        if( chatroom_is_active( room ) )
         {
-            write_client( user_submitter->connection, "\t%s \n", chatrooms[ i ].room_name );
+            reply_line( &reply, "\t%s \n", room->room_name );
             active_rooms_found = true;
-            printf( "%s", chatrooms[ i ].room_name );
         }
     }
+    stat_sem_post( &room_table_mutex );
 
     if( active_rooms_found == false )
-        write_client( user_submitter->connection, "\tno results to display \n" );
+        reply_line( &reply, "\tno results to display \n" );
 
+    reply_end( &reply );
     return SUCCESS;
 }
 
 int create_chat_room( user_t *user_submitter, int argc, char **argv )
 {
-    int     i;
-    int     room_idx = -1;
     char   *new_name = argv[ 1 ];
+    chat_room_t *room;
+    int     result;
 
     if( new_name != NULL )
     {
         // verify chatroom name is not greater than the maximum number of allowed characters
         if( strlen( new_name ) >= MAX_ROOM_NAME_LEN )
         {
-            write_client(
-                            user_submitter->connection,
+            write_user(
+                            user_submitter,
                             "Error: exceeded maximum chatroom name length of %d characters. \n",
                             MAX_ROOM_NAME_LEN
                         );
@@ -780,39 +2155,34 @@ int create_chat_room( user_t *user_submitter, int argc, char **argv )
             return FAILURE;
         }
 
-        //search for inactive chat room
-        for( i = 0; i < MAX_ROOMS; i++ )
+        //register the new chat room, this is what decides whether the name is free
+        result = open_chat_room( new_name, &room );
+        if( result == ROOM_EXISTS )
         {
-            if( chatrooms[ i ].user_count < 1 && room_idx == -1 )
-            {
-                room_idx = i;
-            }
-            else if( strncmp( chatrooms[ i ].room_name, new_name, MAX_ROOM_NAME_LEN ) == 0 )
-            {
-                write_client( user_submitter->connection, "Cannot create room: room with that name already exists! \n" );
-                i = MAX_ROOMS + 1;
-                room_idx = i;
+            write_user( user_submitter, "Cannot create room: room with that name already exists! \n" );
 
-                return FAILURE;
-            }
+            return FAILURE;
         }
 
-        if( room_idx == -1 )
+        if( result == ROOM_CLOSING )
         {
-            write_client( user_submitter->connection, "Cannot create room: max number of rooms reached! \n" );
+            write_user( user_submitter, "Cannot create room: chatroom %s is still closing, please try again. \n", new_name );
 
             return FAILURE;
         }
-        else if( room_idx < MAX_ROOMS )
-        {
-            write_client( user_submitter->connection, "Creating chatroom: %s. \n", new_name );
 
-            //initialize the new chat room
-            init_chatroom( &chatrooms[ room_idx ], room_idx, new_name );
+        if( result != SUCCESS )
+        {
+            write_user( user_submitter, "Cannot create room: out of memory! \n" );
 
-            // put user in room
-            join_chat_room( user_submitter, argc, argv );
+            return FAILURE;
         }
+
+        write_user( user_submitter, "Creating chatroom: %s. \n", new_name );
+
+        // put user in room, a room its creator never got into would stay empty
+        if( add_user_to_chatroom( user_submitter, room ) != SUCCESS )
+            close_empty_room( room );
     }
     else
     {
@@ -824,7 +2194,7 @@ int create_chat_room( user_t *user_submitter, int argc, char **argv )
 
 int join_chat_room( user_t *user_submitter, int argc, char **argv )
 {
-    int i;
+    chat_room_t *room;
     char *room_name = argv[ 1 ];
 
     // verify a room name was provided
@@ -833,20 +2203,18 @@ int join_chat_room( user_t *user_submitter, int argc, char **argv )
         return DISPLAY_USAGE;
     }
 
-    // iterate through all chatrooms to check if chatroom with room_name exists
-    for( i = 0; i < MAX_ROOMS; i++ )
+    // check if chatroom with room_name exists
+    room = find_chat_room( room_name );
+    if( room != NULL )
     {
-        if( strcmp( chatrooms[ i ].room_name, room_name ) == 0 )
-        {
-            if( add_user_to_chatroom( user_submitter, &chatrooms[ i ] ) )
-                return SUCCESS;
-            else
-                return FAILURE;
-        }
+        if( add_user_to_chatroom( user_submitter, room ) )
+            return SUCCESS;
+        else
+            return FAILURE;
     }
 
     // send message to user_submitter and return failure if no rooms were available
-    write_client( user_submitter->connection, "Chatroom %s does not exist. \n", room_name );
+    write_user( user_submitter, "Chatroom %s does not exist. \n", room_name );
 
     return FAILURE;
 }
@@ -860,14 +2228,14 @@ int leave_chat_room( user_t *user_submitter, int argc, char **argv )
     if( ret_val == FAILURE )
         return ret_val;
 
-    ret_val = add_user_to_chatroom( user_submitter, &lobby );
+    ret_val = add_user_to_chatroom( user_submitter, lobby );
 
     return ret_val;
 }
 
 int where_am_i( user_t *user_submitter, int argc, char **argv )
 {
-    write_client( user_submitter->connection, "You are in chatroom %s. \n", user_submitter->chat_room->room_name );
+    write_user( user_submitter, "You are in chatroom %s. \n", user_submitter->chat_room->room_name );
 
     return SUCCESS;
 }
@@ -875,28 +2243,37 @@ int where_am_i( user_t *user_submitter, int argc, char **argv )
 int list_chat_room_users( user_t *user_submitter, int argc, char **argv )
 {
     int i;
+    int count;
+    user_t *user;
+    member_set_t *members;
     bool first_line = true;
     char ignore_status[20];
     memset(ignore_status, 0, 20);
+    reply_t reply;
 
-    // Iterate through user_thread struct and print all users in same room
-    for( i = 0; i < MAX_CONN; i++ )
+    reply_begin( &reply, user_submitter );
+
+    // Iterate through the room's members and print them
+    epoch_enter();
+    members = room_members( user_submitter->chat_room, &count );
+    for( i = 0; i < count; i++ )
     {
-        if( user_submitter->chat_room == user_thread[ i ].chat_room && user_thread[ i ].used == true )
+        user = room_member( members, i );
+        if( user != NULL )
         {
             if ( true == first_line )            
             {                
                 first_line = false;                
-                write_client( user_submitter->connection, "--- All Users in Chatroom %s --- \n", user_submitter->chat_room->room_name );            
+                reply_line( &reply, "--- All Users in Chatroom %s --- \n", user_submitter->chat_room->room_name );            
             }
 
-            if ( is_ignoring_user_name( user_submitter, user_thread[i].user_name ) )            
+            if ( is_ignoring_user_id( user_submitter, user->name_id ) )            
             {                
                 sprintf(ignore_status, "(ignored) ");
             }            
             else            
             {                
-                if ( is_ignoring_user_name(&user_thread[i], user_submitter->user_name) )                    
+                if ( is_ignoring_user_id( user, user_submitter->name_id ) )                    
                 {
                     sprintf(ignore_status, " (ignoring you) ");
                 }
@@ -905,10 +2282,12 @@ int list_chat_room_users( user_t *user_submitter, int argc, char **argv )
     
             }
             
-            write_client( user_submitter->connection, "\t%s \t%s\n", user_thread[ i ].user_name, ignore_status );        
+            reply_line( &reply, "\t%s \t%s\n", user->user_name, ignore_status );        
         }
     }
+    epoch_exit();
 
+    reply_end( &reply );
     return SUCCESS;
 }
 
@@ -918,25 +2297,32 @@ int list_all_users( user_t *user_submitter, int argc, char **argv )
     memset(ignore_status, 0, 20);
     
     bool first_line = true;    
-    int i;
+    user_t *user;
+    chat_room_t *room;
+    reply_t reply;
 
-    for( i = 0; i < MAX_CONN; i++ )
+    reply_begin( &reply, user_submitter );
+
+    stat_sem_wait( &user_table_mutex );
+    for( user = live_users; user != NULL; user = user->live_next )
     {
-        if ( true == user_thread[i].used)        
+        // users still logging in are not in a room yet
+        room = __atomic_load_n( &user->chat_room, __ATOMIC_ACQUIRE );
+        if ( ( true == user->used ) && ( NULL != room ) )
         {            
             if ( true == first_line )            
             {                
                 first_line = false;                
-                write_client( user_submitter->connection, "--- All Online Users --- \n" );            
+                reply_line( &reply, "--- All Online Users --- \n" );            
             }            
             
-            if ( is_ignoring_user_name( user_submitter, user_thread[i].user_name ) )            
+            if ( is_ignoring_user_id( user_submitter, user->name_id ) )            
             {                
                 sprintf(ignore_status, "(ignored) ");
             }            
             else            
             {                
-                if ( is_ignoring_user_name(&user_thread[i], user_submitter->user_name) )                    
+                if ( is_ignoring_user_id( user, user_submitter->name_id ) )                    
                 {
                     sprintf(ignore_status, " (ignoring you) ");
                 }
@@ -944,17 +2330,17 @@ int list_all_users( user_t *user_submitter, int argc, char **argv )
                     sprintf(ignore_status,"                 ");
             }
             
-            write_client( user_submitter->connection, "\t%s \t%s \t%s \n", user_thread[ i ].user_name, user_thread[ i ].chat_room->room_name , ignore_status );
+            reply_line( &reply, "\t%s \t%s \t%s \n", user->user_name, room->room_name , ignore_status );
         }    
     }
+    stat_sem_post( &user_table_mutex );
 
+    reply_end( &reply );
     return SUCCESS;
 }
 
 int whisper_user( user_t *user_submitter, int argc, char **argv )
 {
-    int     i;
-    char   *target_user_name = argv[ 1 ];
     char   *message;
 
     if( argc < 3 )
@@ -966,21 +2352,21 @@ int whisper_user( user_t *user_submitter, int argc, char **argv )
     user_t *whisper_target = NULL;
     if( !is_logged_in( argv[ 1 ], &whisper_target ) )
     {
-        write_client( user_submitter->connection, "Cannot send message. %s is not logged in. \n", argv[ 1 ] );
+        write_user( user_submitter, "Cannot send message. %s is not logged in. \n", argv[ 1 ] );
         return FAILURE;
     }
 
     // Fail if target user is being ignored    
-    if( ( NULL != whisper_target ) && ( is_ignoring_user_name( user_submitter, whisper_target->user_name ) ) )
+    if( ( NULL != whisper_target ) && ( is_ignoring_user_id( user_submitter, whisper_target->name_id ) ) )
     {
-        write_client( user_submitter->connection, "Cannot send message. You are ignoring %s. \n", argv[ 1 ] );
+        write_user( user_submitter, "Cannot send message. You are ignoring %s. \n", argv[ 1 ] );
         return FAILURE;
     }
 
     // Don't talk to yourself
     if( 0 == strcicmp( user_submitter->user_name, whisper_target->user_name ) )
     {
-        write_client( user_submitter->connection, "Talking to yourself? \n" );
+        write_user( user_submitter, "Talking to yourself? \n" );
         return FAILURE;
     }
 
@@ -988,57 +2374,52 @@ int whisper_user( user_t *user_submitter, int argc, char **argv )
     int offset = strlen( argv[ 0 ] ) + 1 + strlen( argv[ 1 ] );
     message = strstr( user_submitter->user_msg + offset, argv[ 2 ] );
 
-    for( i = 0; i < MAX_CONN; i++ )
+    // Suceed but don't actually send message if target is ignoring user            
+    if( !is_ignoring_user_id( whisper_target, user_submitter->name_id ) )
     {
-        if( strcicmp( target_user_name, user_thread[ i ].user_name ) == 0 )
-        {
-            // Suceed but don't actually send message if target is ignoring user            
-            if( !is_ignoring_user_name( &user_thread[ i ], user_submitter->user_name ) )
-            {
-                write_client( user_thread[ i ].connection, "(%s: %s) \n", user_submitter->user_name, message );
-                user_thread[ i ].reply_user = user_submitter;
-            }
-            return SUCCESS;
-        }
+        write_user( whisper_target, "(%s: %s) \n", user_submitter->user_name, message );
+        __atomic_store_n( &whisper_target->reply_id, user_submitter->name_id, __ATOMIC_RELAXED );
     }
 
-    write_client( user_submitter->connection, "Cannot send message: no user with the specified user name found. \n" );
-    return FAILURE;
+    return SUCCESS;
 }
 
 int reply_user( user_t *user_submitter, int argc, char **argv )
 {
     char   *message;
+    int     reply_id = __atomic_load_n( &user_submitter->reply_id, __ATOMIC_RELAXED );
+    user_t *reply_target;
 
     if( argc < 2 )
     {
         return DISPLAY_USAGE;
     }
     
-    if ( NULL == user_submitter->reply_user )
+    if ( INTERN_NONE == reply_id )
     {
-        write_client( user_submitter->connection, "Cannot send message: no one to reply to. \n" );
+        write_user( user_submitter, "Cannot send message: no one to reply to. \n" );
         return FAILURE;
     }
     
-    // If reply_user has logged off, fail.
-    if ( false == user_submitter->reply_user->used ) 
+    // If the user who whispered has logged off, fail.
+    reply_target = intern_owner( reply_id );
+    if ( NULL == reply_target ) 
     {
-        write_client( user_submitter->connection, "Cannot send message: user is not logged in. \n" );
+        write_user( user_submitter, "Cannot send message: user is not logged in. \n" );
         return FAILURE;
     }
     
     // If we're ignoring the reply user, don't reply 
-    if ( is_ignoring_user_name( user_submitter, user_submitter->reply_user->user_name ) )
+    if ( is_ignoring_user_id( user_submitter, reply_id ) )
     {
-        write_client( user_submitter->connection, "Cannot send message: you're ignoring %s \n", user_submitter->reply_user->user_name);
+        write_user( user_submitter, "Cannot send message: you're ignoring %s \n", reply_target->user_name);
         return FAILURE;
     }
     
     // If reply user is ignoring us, don't reply 
-    if ( is_ignoring_user_name( user_submitter->reply_user, user_submitter->user_name ) )
+    if ( is_ignoring_user_id( reply_target, user_submitter->name_id ) )
     {
-        write_client( user_submitter->connection, "Cannot send message: %s is ignoring you. \n", user_submitter->reply_user->user_name);
+        write_user( user_submitter, "Cannot send message: %s is ignoring you. \n", reply_target->user_name);
         return FAILURE;
     }
 
@@ -1047,15 +2428,9 @@ int reply_user( user_t *user_submitter, int argc, char **argv )
     message = strstr( user_submitter->user_msg + offset, argv[ 1 ] );
 
     //Send message
-    if( user_submitter->reply_user != NULL )
-    {
-        write_client( user_submitter->reply_user->connection, "(%s: %s) \n", user_submitter->user_name, message );
-        user_submitter->reply_user->reply_user = user_submitter;
-        return SUCCESS;
-    }
-
-    write_client( user_submitter->connection, "Cannot send message: no user has whispered you. \n" );
-    return FAILURE;
+    write_user( reply_target, "(%s: %s) \n", user_submitter->user_name, message );
+    __atomic_store_n( &reply_target->reply_id, user_submitter->name_id, __ATOMIC_RELAXED );
+    return SUCCESS;
 }
 
 /***********************************************************************
@@ -1079,7 +2454,6 @@ int reply_user( user_t *user_submitter, int argc, char **argv )
 ***********************************************************************/
 int mute_user( user_t *user_submitter, int argc, char **argv )
 {
-    int i;                              /* loop counter */
     user_t *mute_user_pointer = NULL;   /* pointer to user we will mute */
 
     // Prompt if they gave wrong arguments
@@ -1096,53 +2470,42 @@ int mute_user( user_t *user_submitter, int argc, char **argv )
     // Fail if the user is not logged in
     if( !is_logged_in( argv[ 1 ], &mute_user_pointer ) )
     {
-        write_client( user_submitter->connection, "ERROR: Cannot mute %s. User is not logged in. \n", argv[ 1 ] );
+        write_user( user_submitter, "ERROR: Cannot mute %s. User is not logged in. \n", argv[ 1 ] );
         return FAILURE;
     }
 
     // Fail if they're trying to mute themselves. Silly.
     if( mute_user_pointer == user_submitter )
     {
-        write_client( user_submitter->connection, "You can't mute yourself. \n" );
+        write_user( user_submitter, "You can't mute yourself. \n" );
         return FAILURE;
     }
     
     // Fail if they're trying to mute the administrator
     if ( 0 == strcicmp(mute_user_pointer->user_name, ADMIN_NAME) )
     {
-        write_client( user_submitter->connection, "Cannot mute %s. Nobody puts %s in a corner. \n", ADMIN_NAME, ADMIN_NAME);
+        write_user( user_submitter, "Cannot mute %s. Nobody puts %s in a corner. \n", ADMIN_NAME, ADMIN_NAME);
         return FAILURE;
     }
 
     // Fail if the submitting user is already ignoring the target user
-    if( is_ignoring_user_name( user_submitter, mute_user_pointer->user_name ) )
+    if( is_ignoring_user_id( user_submitter, mute_user_pointer->name_id ) )
     {
-        write_client( user_submitter->connection, "ERROR: You are already ignoring %s. \n", argv[ 1 ] );
+        write_user( user_submitter, "ERROR: You are already ignoring %s. \n", argv[ 1 ] );
         return FAILURE;
     }
 
-    // Find a blank place in the user's mute list and stick 'em in
-    i = 0;
-    bool found = false; /* for output of mute list */
-    while( ( i < MAX_CONN ) && ( !found ) )
-    {
-        if( '\0' == user_submitter->muted_users[ i ][ 0 ] )
-            found = true;
-        i++;
-
-    }
-
-    if( false == found )  // Mute list is full
+    // Stick 'em in the user's mute list
+    if( FAILURE == set_muted( user_submitter, mute_user_pointer->name_id, true ) )  // Mute list is full
     {
-        write_client( user_submitter->connection, "ERROR: Can't mute %s. Your mute list is full. \n", argv[ 1 ] );
+        write_user( user_submitter, "ERROR: Can't mute %s. Your mute list is full. \n", argv[ 1 ] );
         return FAILURE;
     }
 
-    // If we got this far, we can go ahead and mute the user and let everybody know.
-    strcpy( user_submitter->muted_users[ --i ], mute_user_pointer->user_name );
-    if ( false == is_ignoring_user_name( mute_user_pointer, user_submitter->user_name ) )
-        write_client( mute_user_pointer->connection, "%s is ignoring you. \n", user_submitter->user_name );
-    write_client( user_submitter->connection, "You are now ignoring %s. \n", argv[ 1 ] );
+    // If we got this far, the user is muted, let everybody know.
+    if ( false == is_ignoring_user_id( mute_user_pointer, user_submitter->name_id ) )
+        write_user( mute_user_pointer, "%s is ignoring you. \n", user_submitter->user_name );
+    write_user( user_submitter, "You are now ignoring %s. \n", argv[ 1 ] );
     return SUCCESS;
 }
 
@@ -1160,35 +2523,28 @@ int unmute_user( user_t *user_submitter, int argc, char **argv )
     }    
     
     // Fail if the given username isn't in the user's mute list
-    if ( !is_ignoring_user_name( user_submitter, argv[1] ))
+    int unmute_id = intern_lookup( argv[1] );
+    if ( !is_ignoring_user_id( user_submitter, unmute_id ))
     {
-        write_client( user_submitter->connection, "Error. %s is not muted. \n", argv[1]);
+        write_user( user_submitter, "Error. %s is not muted. \n", argv[1]);
         return FAILURE;
     }
     
     
-    int i=0;                      /* loop counter */
     user_t *other_user = NULL;
-    while ( i < MAX_CONN)
+    if ( SUCCESS == set_muted( user_submitter, unmute_id, false ) )
     {
-        if ( 0 == strcicmp(user_submitter->muted_users[i], argv[1]) )
+        if ( is_logged_in(argv[1], &other_user))
         {
-            printf( "after strcicmp \n");
-            user_submitter->muted_users[i][0] = '\0';
-            
-            if ( is_logged_in(argv[1], &other_user))
-            {
-                printf( "user is logged in \n");
-                if ((NULL != other_user) && ( false == is_ignoring_user_name( other_user, user_submitter->user_name) ) )
-                    write_client(other_user->connection, "%s has stopped ignoring you. \n", user_submitter->user_name);
-            }
-            write_client( user_submitter->connection, "You are no longer ignoring %s. \n", argv[1]);
-            return SUCCESS;
+            log_msg( LOG_LEVEL_DEBUG, "user is logged in" );
+            if ((NULL != other_user) && ( false == is_ignoring_user_id( other_user, user_submitter->name_id) ) )
+                write_user( other_user, "%s has stopped ignoring you. \n", user_submitter->user_name);
         }
-        i++;
+        write_user( user_submitter, "You are no longer ignoring %s. \n", argv[1]);
+        return SUCCESS;
     }
     
-    write_client( user_submitter->connection, "Error. Cannot unmute %s. \n", argv[1]);
+    write_user( user_submitter, "Error. Cannot unmute %s. \n", argv[1]);
     return FAILURE;
 }
 
@@ -1213,21 +2569,24 @@ void print_mute_list( user_t *user_submitter )
     
     int i;                          /* loop counter */    
     bool first_line = true;    
-    for ( i = 0; i < MAX_CONN; i++ )    
+    mute_list_t *mutes = user_submitter->mutes;
+    reply_t reply;
+
+    reply_begin( &reply, user_submitter );
+    for ( i = 0; mutes != NULL && i < mutes->count; i++ )    
     {        
-        if ( '\0' != user_submitter->muted_users[i][0] )        
-        {            
-            if ( true == first_line )            
-            {                
-                write_client( user_submitter->connection, "--- Muted Users ---- \n");                
-                first_line = false;            
-            }            
-            write_client( user_submitter->connection, "\t %s \n", user_submitter->muted_users[i] );        
-        }    
+        if ( true == first_line )            
+        {                
+            reply_line( &reply, "--- Muted Users ---- \n");                
+            first_line = false;            
+        }            
+        reply_line( &reply, "\t %s \n", interned_name( mutes->ids[i] ) );        
     }    
     
     if ( true == first_line )        
-        write_client( user_submitter->connection, "You haven't muted anyone yet. \n");    
+        reply_line( &reply, "You haven't muted anyone yet. \n");    
+
+    reply_end( &reply );
     return;
 }
 
@@ -1250,60 +2609,130 @@ void print_mute_list( user_t *user_submitter )
 ***********************************************************************/
 bool is_logged_in( char *user_name, user_t **user_pointer )
 {
-    *user_pointer = NULL;
-    int i = 0;
-    bool match_found = false;
-
-    // Loop over all users; find one that is connected and has same name
-    while( ( !match_found ) & ( i < MAX_CONN ) )
-    {
-        if( ( true == user_thread[ i ].used ) && ( strcicmp( user_name, user_thread[ i ].user_name ) == 0 ) )
-        {
-            *user_pointer = &user_thread[ i ];
-            match_found = true;
-        }
-        i++;
-    }
+    // Look the name up in the (case-insensitive) user index
+    *user_pointer = hash_map_get( &user_index, user_name );
 
     // Indicate whether we found a match
-    return match_found;
+    return *user_pointer != NULL;
 }
 
 /***********************************************************************
 * is_ignoring_user_name - indicate whether given name is in ignore list*
 * parameters:
 *   user_ignoring - pointer to a user_t that is doing the ignoring
-*   user_ignored  - pointer to a user_t for the person being ignored
 *   ignore_name   - char * that has name of person being ignored*
 * returns: A bool indicating whether  the first user is ignoring the
-*          second user
 *          second user. Does case-insensitive comparison, so Amy == amy*
 ***********************************************************************/
 bool is_ignoring_user_name( user_t *user_ignoring, char *ignore_name )
 {
     // Can't ignore a blank user    
-    if( ( NULL == user_ignoring ) || ( '\0' == ignore_name ) )
+    if( ( NULL == user_ignoring ) || ( NULL == ignore_name ) || ( '\0' == ignore_name[ 0 ] ) )
         return false;
 
-    bool user_found_in_mute_list = false;
-    int i = 0;
+    return is_ignoring_user_id( user_ignoring, intern_lookup( ignore_name ) );
+}
+
+/***********************************************************************
+* is_ignoring_user_id - indicate whether given interned name id is in
+*                       the user's ignore list
+* parameters:
+*   user_ignoring - pointer to a user_t that is doing the ignoring
+*   ignore_id     - interned id of the person being ignored
+* returns: A bool indicating whether the first user is ignoring the
+*          second user. Binary search of the sorted mute list.
+***********************************************************************/
+bool is_ignoring_user_id( user_t *user_ignoring, int ignore_id )
+{
+    mute_list_t *mutes;
+    int low, high, mid;
+
+    if( ( NULL == user_ignoring ) || ( INTERN_NONE == ignore_id ) )
+        return false;
+
+    epoch_enter();
+    mutes = __atomic_load_n( &user_ignoring->mutes, __ATOMIC_ACQUIRE );
+    if( NULL == mutes )
+    {
+        epoch_exit();
+        return false;
+    }
+
+    low = 0;
+    high = mutes->count - 1;
+    while( low <= high )
+    {
+        mid = ( low + high ) / 2;
+        if( mutes->ids[ mid ] == ignore_id )
+        {
+            epoch_exit();
+            return true;
+        }
+        if( mutes->ids[ mid ] < ignore_id )
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+
+    epoch_exit();
+    return false;
+}
+
+/***********************************************************************
+* set_muted - add or remove an interned id from a user's mute list
+*
+* The mute list is never modified in place: a new sorted list is built
+* and swapped in, so a reader always sees a complete list.  Keeps the
+* room's count of muting members up to date for the fanout fast path.
+*
+* returns: FAILURE if the list is full (or out of memory), else SUCCESS
+***********************************************************************/
+int set_muted( user_t *user, int id, bool muted )
+{
+    mute_list_t *old_list = user->mutes;
+    mute_list_t *new_list = NULL;
+    int old_count = ( NULL == old_list ) ? 0 : old_list->count;
+    int new_count = muted ? old_count + 1 : old_count - 1;
+    int i, j;
+
+    if( new_count > MAX_MUTED_USERS )
+        return FAILURE;
 
-    while( ( !user_found_in_mute_list ) && ( i < MAX_CONN ) )
+    if( new_count > 0 )
     {
-        if( 0 == strcicmp( user_ignoring->muted_users[ i ], ignore_name ) )
-            user_found_in_mute_list = true;
+        new_list = malloc( sizeof( mute_list_t ) + new_count * sizeof( int ) );
+        if( NULL == new_list )
+            return FAILURE;
 
-        i++;
+        // copy the old ids, inserting or skipping id in sorted position
+        for( i = 0, j = 0; i < old_count; i++ )
+        {
+            if( muted && old_list->ids[ i ] > id && j == i )
+                new_list->ids[ j++ ] = id;
+            if( old_list->ids[ i ] != id )
+                new_list->ids[ j++ ] = old_list->ids[ i ];
+        }
+        if( muted && j < new_count )
+            new_list->ids[ j++ ] = id;
+        new_list->count = j;
     }
 
-    return user_found_in_mute_list;
+    __atomic_store_n( &user->mutes, new_list, __ATOMIC_RELEASE );
+
+    // user started or stopped muting anyone at all
+    if( NULL != user->chat_room && ( NULL == old_list ) != ( NULL == new_list ) )
+        __atomic_add_fetch( &user->chat_room->muting_members, ( NULL == new_list ) ? -1 : 1, __ATOMIC_RELAXED );
+
+    // fanout may still be reading the old list
+    epoch_retire( old_list, free );
+
+    return SUCCESS;
 }
 
 int get_history( user_t *user_submitter, int argc, char **argv )
 {
-    int i = 0; /* loop counter */
-    int line_num;
-    int total_lines = HISTORY_SIZE;
+    int total_lines = -1;     /* all available history */
+    unsigned int generation;
     struct chat_room_t *user_room = user_submitter->chat_room;
 
     // Make sure the user has a valid room first
@@ -1313,68 +2742,122 @@ int get_history( user_t *user_submitter, int argc, char **argv )
     // Fail if they gave too many arguments    
     if ( argc > 2 )        
         return DISPLAY_USAGE;
-    
+
+    // Otherwise, print just the requested number of lines
+    if ( argc == 2 )
+    {
+        total_lines = atoi( argv[ 1 ] );
+        if ( total_lines < 0 )
+            total_lines = 0;
+    }
+
+    // the room's history is only read by the reactor that owns the room, the
+    // reply goes to this connection and not to whoever has the name by then
+    generation = __atomic_load_n( &user_submitter->generation, __ATOMIC_ACQUIRE );
+    if ( room_runs_here( user_room ) )
+        room_history( user_room, user_submitter->user_id, generation, total_lines );
+    else
+        post_room_mail( user_room, MAIL_HISTORY, user_submitter->user_id, generation, total_lines, NULL );
+
+    return SUCCESS;
+}
+
+// Send the last lines of a room's history (all of it if lines is negative) to
+// the connection in slot user_id, if the slot still has the connection of that
+// generation.  Runs on the room's owner.
+void room_history( chat_room_t *user_room, int user_id, unsigned int generation, int lines )
+{
+    int i = 0; /* loop counter */
+    int line_num;
+    int total_lines;
+    time_t last_time = -1;
+    char timestamp[ TIMESTAMP_SIZE ];
+    user_t *user_submitter = &user_thread[ user_id ];
+    history_t *history;
+    history_t log_lines;      /* lines read back from the room's log */
+    history_line_t *line;
+    reply_t reply;
+
+    // the connection closed since asking, the slot may belong to another one
+    // (it is only claimed again once this epoch is over)
+    if ( __atomic_load_n( &user_submitter->generation, __ATOMIC_ACQUIRE ) != generation )
+        return;
+
     // If they didn't provide a # of lines, print all available history
     // Otherwise, print just the requested number of lines
-    if ( argc == 2 ) 
+    history = &user_room->history;
+    total_lines = history->count;
+    if ( lines >= 0 ) 
     {        
-		total_lines = atoi( argv[ 1 ] );
-        if ( total_lines > HISTORY_SIZE )
-            total_lines = HISTORY_SIZE; 
-        i = 0;
-        line_num = ( user_room->history_count - 1 + HISTORY_SIZE ) % HISTORY_SIZE;
-        while( ( line_num != user_room->history_count )&&( i < total_lines ) )
+        total_lines = lines;
+        if ( total_lines > MAX_HISTORY_READ )
+            total_lines = MAX_HISTORY_READ;
+
+        // go to the room's log for more lines than are kept in memory
+        if ( ( total_lines > history->count ) && ( user_room->history_log.count > (uint64_t)history->count ) )
         {
-            if ( is_valid_history_line( user_submitter, line_num ) )
-                i++;
-            line_num = ( line_num - 1 + HISTORY_SIZE ) % HISTORY_SIZE;
-        }  
-        line_num = ( line_num + 1 + HISTORY_SIZE ) % HISTORY_SIZE;
+            init_history( &log_lines, total_lines );
+            if ( HISTORY_LOG_OK == history_log_read( &user_room->history_log, &log_lines, total_lines ) )
+                history = &log_lines;
+            else
+                history_destroy( &log_lines );
+        }
     }
-    else   
+
+    // Walk back from the newest line to find where the visible lines start
+    line_num = history->count;
+    while( ( line_num > 0 )&&( i < total_lines ) )
     {
-        line_num = ( user_room->history_count + 1 + HISTORY_SIZE ) % HISTORY_SIZE;
-        i = total_lines;
-    }
+        line_num--;
+        if ( is_valid_history_line( user_submitter, history_line( history, line_num ) ) )
+            i++;
+    }  
 
-    write_client( user_submitter->connection, "--- Chatroom History --- \n" );
+    reply_begin( &reply, user_submitter );
+    reply.generation = generation;
+    reply_line( &reply, "--- Chatroom History --- \n" );
     
-    // Print out each of the non blank lines, going forwards until we hit the end of history
-    do
+    // Print out each of the visible lines, going forwards until we hit the end of history
+    for ( ; line_num < history->count; line_num++ )
     {
-        if ( is_valid_history_line( user_submitter, line_num) )
+        line = history_line( history, line_num );
+        if ( is_valid_history_line( user_submitter, line ) )
         {
-            write_client( user_submitter->connection, "[%s] %s \n", user_room->history[ line_num ].timestamp, user_room->history[ line_num ].message );
-            i--;
+            // lines sent in the same second share a timestamp
+            if ( line->time != last_time )
+            {
+                timestamp_format( line->time, timestamp ); /* populate timestamp string */
+                last_time = line->time;
+            }
+            reply_line( &reply, "[%s] %s \n", timestamp, line->message );
         }
-        line_num = ( line_num + 1 ) % HISTORY_SIZE;
     }
-    while ( ( i > 0 )&&( line_num != user_room->history_count ) );
-    return SUCCESS;
+
+    reply_end( &reply );
+
+    if ( history != &user_room->history )
+        history_destroy( history );
 }
 
-// Determine whether the given line of the history array should be printed for the current user
-bool is_valid_history_line( user_t *user_submitter, int line_num )
+// Determine whether the given line of the room's history should be printed for the current user
+bool is_valid_history_line( user_t *user_submitter, history_line_t *line )
 {
-    if ( line_num  > HISTORY_SIZE )
-        line_num = line_num % HISTORY_SIZE;
-    
     // Don't show blank lines
-    if ( '\0' == user_submitter->chat_room->history[ line_num ].message[ 0 ] )
+    if ( ( NULL == line ) || ( 0 == line->len ) )
     {
         return false;
     }
     
     // Don't show lines from users that are muted by this user
-    if ( is_ignoring_user_name( user_submitter, user_submitter->chat_room->history[ line_num ].user_name ) )
+    if ( is_ignoring_user_id( user_submitter, line->sender_id ) )
         return false;
     
-    user_t *history_user = NULL;
-    
     // Don't show things from logged in users who have muted this user
-    if ( is_logged_in( user_submitter->chat_room->history[ line_num ].user_name, &history_user ) )
+    user_t *history_user = intern_owner( line->sender_id );
+    
+    if ( NULL != history_user )
     {            
-        if ( is_ignoring_user_name( history_user, user_submitter->user_name ) )
+        if ( is_ignoring_user_id( history_user, user_submitter->name_id ) )
             return false;
     }
     
@@ -1385,79 +2868,154 @@ bool is_valid_history_line( user_t *user_submitter, int line_num )
 
 int reset_user(user_t *user_submitter )
 {
-    // Remove this user from everyone's reply lists
-    int i = 0;
-    for ( i = 0 ; i < MAX_CONN ; i++ )
-    {
-        if ( user_submitter == user_thread[ i ].reply_user )
-            user_thread[ i ].reply_user = NULL;
-    }
+    mute_list_t *old_list;
+
+    // Release the user's name, replies to it find no owner from here on
+    if( user_submitter->named )
+        hash_map_remove_value( &user_index, user_submitter->user_name, user_submitter );
+    user_submitter->named = false;
+    if( intern_owner( user_submitter->name_id ) == user_submitter )
+        intern_set_owner( user_submitter->name_id, NULL );
 
     user_submitter->admin = false;
-    user_submitter->used = false;
-    memset( user_submitter->user_name, 0, MAX_USER_NAME_LEN);
+    __atomic_store_n( &user_submitter->reply_id, INTERN_NONE, __ATOMIC_RELAXED );
     remove_user_from_chatroom( user_submitter );
 
+    // mute list is dropped once the user is out of its room, the name and id
+    // stay readable until the slot is claimed again
+    old_list = user_submitter->mutes;
+    __atomic_store_n( &user_submitter->mutes, NULL, __ATOMIC_RELEASE );
+    epoch_retire( old_list, free );
+
     return true;
 }
 
-bool block_is_active( blocked_ip_t *block )
+// Is the address inside any blocked range.  Runs for every accepted
+// connection, the lookup takes no lock.
+bool is_blocked( struct in_addr addr )
 {
-    return block->active != 0 ? true : false;
+    ip_prefix_t prefix;
+    bool blocked;
+
+    ip_prefix_from_in_addr( addr, &prefix );
+
+    epoch_enter();
+    blocked = ip_trie_lookup( &block_list, &prefix ) != NULL;
+    epoch_exit();
+
+    return blocked;
 }
 
-int open_blocks()
+// Block a range, replacing any block of exactly the same range
+int add_block( ip_prefix_t *range, char *user_name, char *reason )
 {
-    int i;
-    int cnt = MAX_BLOCKED;
-    for(i = 0; i < MAX_BLOCKED; i++){
-        if(blocks[i].active == 1){
-            cnt--;
-        }
+    int id;
+    void *old_block;
+    blocked_ip_t *block = malloc( sizeof( blocked_ip_t ) + strlen( reason ) + 1 );
+
+    if( NULL == block )
+        return FAILURE;
+
+    id = __atomic_fetch_add( &next_block_id, 1, __ATOMIC_RELAXED );
+    block->id = id;
+    block->range = *range;
+    strncpy( block->user_name, user_name, MAX_USER_NAME_LEN - 1 );
+    block->user_name[ MAX_USER_NAME_LEN - 1 ] = '\0';
+    strcpy( block->reason, reason );
+
+    if( ip_trie_insert( &block_list, range, block, &old_block ) != IP_TRIE_OK )
+    {
+        free( block );
+        return FAILURE;
     }
-    return cnt;
+
+    // accepts may still be looking at the block this replaced
+    epoch_retire( old_block, free );
+
+    return id;
 }
 
-int add_user_to_block_list(user_t *user_submitter, char *reason)
+// Read blocks from a file: an address or address/bits range per line,
+// optionally followed by the reason.  Blank lines and '#' comments are skipped.
+int load_block_file( char *path )
 {
-    int i;
+    FILE *file;
+    char line[ MAX_LINE ];
+    char *text;
+    char *reason;
+    char *save;
+    ip_prefix_t range;
+    int line_num = 0;
+    int count = 0;
+
+    file = fopen( path, "r" );
+    if( NULL == file )
+        return FAILURE;
+
+    while( fgets( line, MAX_LINE, file ) != NULL )
+    {
+        line_num++;
+
+        text = strtok_r( line, " \t\r\n", &save );
+        if( NULL == text || '#' == text[ 0 ] )
+            continue;
+
+        reason = strtok_r( NULL, "\r\n", &save );
+        while( NULL != reason && isspace( *reason ) )
+            reason++;
+        if( NULL == reason || '\0' == *reason )
+            reason = "*No reason given*";
 
-    //Find open spot to block
-    for(i = 0; i < MAX_BLOCKED; i++){
-        if( !block_is_active( &blocks[i] ) ){
-            blocks[i].active = 1;
-            blocks[i].id = i;
-            blocks[i].user_ip_addr = user_submitter->user_ip_addr;
-            strcpy( blocks[i].user_name, user_submitter->user_name);
-            strcpy( blocks[i].reason, reason);
-            return open_blocks();
+        if( ip_prefix_parse( text, &range ) != IP_TRIE_OK )
+        {
+            log_msg( LOG_LEVEL_WARN, "%s line %d: not an address or range: %s", path, line_num, text );
+            continue;
         }
+
+        if( add_block( &range, "", reason ) != FAILURE )
+            count++;
     }
-    return FAILURE;
+
+    fclose( file );
+
+    return count;
 }
 
-int remove_block_list_id(user_t *user_submitter, int id_num)
+// Disconnect everyone logged in from inside a newly blocked range, except the
+// admin who blocked it.  Those still logging in are turned away by login_user().
+void kick_blocked_users( ip_prefix_t *range, char *reason, user_t *user_submitter )
 {
-    int i;
-    for(i = 0; i < MAX_BLOCKED; i++){
-        if ( blocks[i].id == id_num ){
-            blocks[i].active = 0;
-            write_client( user_submitter->connection, "Unblocked: %s @ %s \n", blocks[i].user_name, inet_ntoa( blocks[i].user_ip_addr ));
-            return SUCCESS;
+    user_t *user;
+    ip_prefix_t addr;
+
+    stat_sem_wait( &user_table_mutex );
+    for( user = live_users; user != NULL; user = user->live_next )
+    {
+        if( user == user_submitter || NULL == __atomic_load_n( &user->chat_room, __ATOMIC_ACQUIRE ) )
+            continue;
+
+        ip_prefix_from_in_addr( user->user_ip_addr, &addr );
+        if( ip_prefix_contains( range, &addr ) )
+        {
+            // Inform the user why they have been blocked then kick them
+            write_user( user, "You have been blocked. Reason: %s \n", reason );
+            logout( user, 0, NULL );
         }
     }
-    write_client( user_submitter->connection, "Could not find ID %d \n", id_num);
-    return FAILURE;
+    stat_sem_post( &user_table_mutex );
 }
 
 int block_user_ip( user_t *user_submitter, int argc, char **argv )
 {
-    int i, open_spots;
+    int id;
+    user_t *user = NULL;
     char *user_name = argv[ 1 ];
+    ip_prefix_t range;
+    char range_text[ IP_PREFIX_TEXT_SIZE ];
     
     if ( false == user_submitter->admin )
     {
-        write_client( user_submitter->connection, "Only Admin can block. \n");
+        write_user( user_submitter, "Only Admin can block. \n");
         return FAILURE;
     }
 
@@ -1480,44 +3038,71 @@ int block_user_ip( user_t *user_submitter, int argc, char **argv )
         block_reason = strstr(user_submitter->user_msg + offset, argv[2]);
     }
 
-    // iterate through all users to find the one targeted for kick
-    for( i = 0; i < MAX_CONN; i++ )
+    // block an address or range as given, or the address a user is connected from
+    if( ip_prefix_parse( user_name, &range ) == IP_TRIE_OK )
+        user_name = "";
+    else if( is_logged_in( user_name, &user ) )
+        ip_prefix_from_in_addr( user->user_ip_addr, &range );
+    else
     {
-        if( strcmp( user_thread[ i ].user_name, user_name ) == 0 )
-        {
-            // Block the targeted user
-            open_spots = add_user_to_block_list( &user_thread[ i ], block_reason );
+        // send message to user_submitter and return targeted user was not found
+        write_user( user_submitter, "Could not find %s. \n", user_name );
+        return FAILURE;
+    }
 
+    ip_prefix_format( &range, range_text, sizeof( range_text ) );
 
-            if( open_spots >= 0 )
-            {
-                // Inform the user why they have been blocked then kick them
-                write_client( user_thread[ i ].connection, "You have been blocked. Reason: %s \n", block_reason );
-                logout( &user_thread[ i ], argc, argv );
+    id = add_block( &range, user_name, block_reason );
+    if( id == FAILURE )
+    {
+        write_user( user_submitter, "Could not block %s. \n", range_text );
+        return FAILURE;
+    }
 
-                write_client( user_submitter->connection, "User %s was blocked. \n", user_name );
-                write_client( user_submitter->connection, "%d blocks available out of %d.\n", open_spots, MAX_BLOCKED);
-                return SUCCESS;
-            }
-            else {
-                write_client( user_submitter->connection, "Could not block %s. \n", user_name );
-                write_client( user_submitter->connection, "%d blocks available out of %d.\n", 0, MAX_BLOCKED);
-                return FAILURE;
-            }
-        }
+    if( NULL != user )
+    {
+        // Inform the user why they have been blocked then kick them
+        write_user( user, "You have been blocked. Reason: %s \n", block_reason );
+        logout( user, argc, argv );
     }
+    else
+        kick_blocked_users( &range, block_reason, user_submitter );
 
-    // send message to user_submitter and return targeted user was not found
-    write_client( user_submitter->connection, "Could not find %s. \n", user_name );
+    if( '\0' != user_name[ 0 ] )
+        write_user( user_submitter, "User %s was blocked (ID %d, %s). \n", user_name, id, range_text );
+    else
+        write_user( user_submitter, "Address %s was blocked (ID %d). \n", range_text, id );
+    write_user( user_submitter, "%d addresses or ranges blocked. \n", (int)ip_trie_count( &block_list ) );
 
-    return FAILURE;
+    return SUCCESS;
+}
+
+// finds the block with a given id for unblock_user_ip()
+typedef struct block_search_t
+{
+    int             id;
+    ip_prefix_t     range;
+    bool            found;
+} block_search_t;
+
+static void match_block_id( void *value, void *arg )
+{
+    blocked_ip_t *block = value;
+    block_search_t *search = arg;
+
+    if( block->id == search->id )
+    {
+        search->range = block->range;
+        search->found = true;
+    }
 }
 
 int unblock_user_ip( user_t *user_submitter, int argc, char **argv )
 {
-    int i;
-    int result = FAILURE;
     char *id_str = argv[ 1 ];
+    char range_text[ IP_PREFIX_TEXT_SIZE ];
+    block_search_t search;
+    blocked_ip_t *block;
 
     // verify a user name was provided and the number of args is correct
     if( id_str == NULL || 2 > argc)
@@ -1527,55 +3112,289 @@ int unblock_user_ip( user_t *user_submitter, int argc, char **argv )
 
     if ( false == user_submitter->admin )
     {
-        write_client( user_submitter->connection, "Only Admin can block. \n");
+        write_user( user_submitter, "Only Admin can block. \n");
         return FAILURE;
     }
 
-    
-    
-    // Convert to int
-    int target_id = atoi(id_str);
+    // Unblock the range as given, or the block with that ID
+    search.found = ip_prefix_parse( id_str, &search.range ) == IP_TRIE_OK;
+    if( !search.found )
+    {
+        search.id = atoi( id_str );
+        epoch_enter();
+        ip_trie_walk( &block_list, match_block_id, &search );
+        epoch_exit();
+    }
+
+    block = search.found ? ip_trie_remove( &block_list, &search.range ) : NULL;
+    if( NULL == block )
+    {
+        write_user( user_submitter, "Could not find %s \n", id_str );
+        return FAILURE;
+    }
+
+    ip_prefix_format( &block->range, range_text, sizeof( range_text ) );
+    write_user( user_submitter, "Unblocked: %s @ %s \n", block->user_name, range_text );
 
-    return remove_block_list_id(user_submitter, target_id);
+    // accepts may still be looking at it
+    epoch_retire( block, free );
+
+    return SUCCESS;
+}
+
+static void list_block( void *value, void *arg )
+{
+    blocked_ip_t *block = value;
+    reply_t *reply = arg;
+    char range_text[ IP_PREFIX_TEXT_SIZE ];
+
+    ip_prefix_format( &block->range, range_text, sizeof( range_text ) );
+    reply_line( reply, "%4d: %-10s | %18s | %s \n", block->id, block->user_name, range_text, block->reason );
 }
 
 int list_blocked_users( user_t *user_submitter, int argc, char **argv )
 {
-    bool first_line = true;
+    if ( false == user_submitter->admin )
+    {
+        write_user( user_submitter, "Only Admin can block. \n");
+        return FAILURE;
+    }
+
+    reply_t reply;
+    reply_begin( &reply, user_submitter );
+
+    // No blocks where found
+    if ( 0 == ip_trie_count( &block_list ) )
+    {
+        reply_line( &reply, "--- All Blocked Users --- \nNone\n" );
+        reply_end( &reply );
+        return SUCCESS;
+    }
+
+    // Print the header, then each block in address order
+    reply_line( &reply, "--- All Blocked Users --- \n" );
+    reply_line( &reply, "%4s: %-10s | %18s | %s \n", "ID", "User Name", "Address or Range", "Reason");
+
+    epoch_enter();
+    ip_trie_walk( &block_list, list_block, &reply );
+    epoch_exit();
+
+    reply_end( &reply );
+    return SUCCESS;
+}
+
+int set_log_level( user_t *user_submitter, int argc, char **argv )
+{
+    int level;
+
+    if ( false == user_submitter->admin )
+    {
+        write_user( user_submitter, "Only Admin can change the log level. \n");
+        return FAILURE;
+    }
+
+    if( argc > 2 )
+        return DISPLAY_USAGE;
+
+    // with no level given just show the current one
+    if( argc == 2 )
+    {
+        level = log_parse_level( argv[ 1 ] );
+        if( level < 0 )
+            return DISPLAY_USAGE;
+
+        log_set_level( level );
+        log_msg( LOG_LEVEL_INFO, "%s set the log level to %s", user_submitter->user_name, log_level_name( level ) );
+    }
+
+    write_user( user_submitter, "Log level is %s. \n", log_level_name( __atomic_load_n( &log_level, __ATOMIC_RELAXED ) ) );
+    return SUCCESS;
+}
+
+// one line for a latency histogram, percentiles are bucket tops
+static void reply_latency( reply_t *reply, char *name, stats_hist_t *hist )
+{
+    if( hist->count == 0 )
+    {
+        reply_line( reply, "%-18s none \n", name );
+        return;
+    }
+
+    reply_line( reply, "%-18s %llu, mean %.1f us, p50 < %.1f us, p99 < %.1f us, p99.9 < %.1f us \n", name,
+                (unsigned long long)hist->count, hist->sum_ns / 1000.0 / hist->count,
+                stats_percentile( hist, 500 ) / 1000.0, stats_percentile( hist, 990 ) / 1000.0,
+                stats_percentile( hist, 999 ) / 1000.0 );
+}
+
+// The same totals a scraper gets from the shared memory segment
+int show_stats( user_t *user_submitter, int argc, char **argv )
+{
     int i;
+    stats_slot_t total;
+    reply_t reply;
 
     if ( false == user_submitter->admin )
     {
-        write_client( user_submitter->connection, "Only Admin can block. \n");
+        write_user( user_submitter, "Only Admin can view server stats. \n");
         return FAILURE;
     }
 
-    
-    
-    for( i = 0; i < MAX_BLOCKED; i++ )
+    if( argc > 1 )
+        return DISPLAY_USAGE;
+
+    stats_sum( stats_segment, &total );
+
+    reply_begin( &reply, user_submitter );
+    reply_line( &reply, "--- Server Stats --- \n" );
+    reply_line( &reply, "%-18s %lld s on %d reactors \n", "Uptime:", (long long)( timestamp_now() - stats_segment->start_time ), num_reactors );
+    reply_line( &reply, "%-18s %llu open, %llu accepted, %llu refused \n", "Connections:",
+                (unsigned long long)( total.connections - total.disconnections ),
+                (unsigned long long)total.connections, (unsigned long long)total.refused );
+    reply_line( &reply, "%-18s %llu \n", "Logins:", (unsigned long long)total.logins );
+    reply_line( &reply, "%-18s %llu (%llu bytes) \n", "Messages in:",
+                (unsigned long long)total.messages_in, (unsigned long long)total.bytes_in );
+    reply_line( &reply, "%-18s %llu (%llu bytes sent), %llu dropped \n", "Messages out:",
+                (unsigned long long)total.messages_out, (unsigned long long)total.bytes_out, (unsigned long long)total.dropped );
+    reply_line( &reply, "%-18s %llu to %llu recipients \n", "Fanouts:",
+                (unsigned long long)total.fanouts, (unsigned long long)total.fanout_recipients );
+    reply_line( &reply, "%-18s %lld bytes, at most %llu on one connection \n", "Queued output:",
+                (long long)total.queued_bytes, (unsigned long long)total.queue_high_water );
+    reply_latency( &reply, "Fanout latency:", &total.fanout_ns );
+    reply_latency( &reply, "Command latency:", &total.command_ns );
+
+    reply_line( &reply, "%-18s %llu invalid \n", "Commands:", (unsigned long long)total.invalid_commands );
+    for( i = 0; i < (int)stats_segment->num_commands; i++ )
+        if( total.commands[ i ] > 0 )
+            reply_line( &reply, "  %-16s %llu \n", stats_segment->command_names[ i ], (unsigned long long)total.commands[ i ] );
+
+    reply_end( &reply );
+    return SUCCESS;
+}
+
+// Write the trace rings to a new file in the working directory
+int dump_trace( char *path, size_t size )
+{
+    int count;
+
+    snprintf( path, size, TRACE_FILE_FORMAT, (int)getpid(), __atomic_add_fetch( &trace_dumps, 1, __ATOMIC_RELAXED ) );
+
+    count = trace_dump( path );
+    if( count < 0 )
+        log_msg( LOG_LEVEL_WARN, "Cannot write trace file %s", path );
+    else
+        log_msg( LOG_LEVEL_INFO, "Wrote %d trace events to %s", count, path );
+
+    return count;
+}
+
+int set_trace( user_t *user_submitter, int argc, char **argv )
+{
+    long every;
+    int count;
+    char *endptr;
+    char path[ TRACE_FILE_SIZE ];
+
+    if ( false == user_submitter->admin )
     {
-        if ( block_is_active( &blocks[i] ) )
-        {
-            // Print the header
-            if ( true == first_line )
-            {
-                first_line = false;
-                write_client( user_submitter->connection, "--- All Blocked Users --- \n" );
-                write_client(user_submitter->connection, "%2s: %-10s | %15s | %s \n",
-                                    "ID", "User Name", "User IP Address", "Reason");
-            }
+        write_user( user_submitter, "Only Admin can trace. \n");
+        return FAILURE;
+    }
+
+    if( argc > 2 )
+        return DISPLAY_USAGE;
 
-            // List each person
-            write_client(user_submitter->connection, "%2d: %-10s | %15s | %s \n",
-                    blocks[i].id, blocks[i].user_name, inet_ntoa( blocks[i].user_ip_addr ), blocks[i].reason);
+    if( argc == 2 && strcicmp( argv[ 1 ], "dump" ) == 0 )
+    {
+        count = dump_trace( path, sizeof( path ) );
+        if( count < 0 )
+            write_user( user_submitter, "Could not write trace file %s. \n", path );
+        else
+            write_user( user_submitter, "Wrote %d trace events to %s. \n", count, path );
+        return SUCCESS;
+    }
+
+    // with no argument just show the sampling
+    if( argc == 2 )
+    {
+        if( strcicmp( argv[ 1 ], "off" ) == 0 )
+            every = 0;
+        else
+        {
+            every = strtol( argv[ 1 ], &endptr, 0 );
+            if( *endptr || every <= 0 )
+                return DISPLAY_USAGE;
         }
+
+        trace_set_every( every );
+        log_msg( LOG_LEVEL_INFO, "%s set trace sampling to %ld", user_submitter->user_name, every );
     }
 
-    // No blocks where found
-    if ( true == first_line ){
-        write_client( user_submitter->connection, "--- All Blocked Users --- \nNone\n" );
+    every = __atomic_load_n( &trace_every, __ATOMIC_RELAXED );
+    if( every == 0 )
+        write_user( user_submitter, "Tracing is off. \n" );
+    else
+        write_user( user_submitter, "Tracing one chat line in %ld. \n", every );
+
+    return SUCCESS;
+}
+
+#ifdef LOCK_STATS
+static void reply_lock( reply_t *reply, lock_report_t *report )
+{
+    lock_counts_t *counts = &report->counts;
+
+    reply_line( reply, "%-28s %10llu %10llu %10.3f %10.1f %10.3f %10.1f \n", report->name,
+                (unsigned long long)counts->acquisitions, (unsigned long long)counts->contended,
+                counts->wait_ns / 1e6, counts->max_wait_ns / 1e3, counts->hold_ns / 1e6, counts->max_hold_ns / 1e3 );
+}
+#endif
+
+// Wait and hold times of each class of lock and of the locks waited on the
+// longest.  With LOCK_STATS off there is nothing to show.
+int show_locks( user_t *user_submitter, int argc, char **argv )
+{
+    if ( false == user_submitter->admin )
+    {
+        write_user( user_submitter, "Only Admin can view lock stats. \n");
+        return FAILURE;
+    }
+
+    if( argc > 2 || ( argc == 2 && strcicmp( argv[ 1 ], "reset" ) != 0 ) )
+        return DISPLAY_USAGE;
+
+#ifdef LOCK_STATS
+    int i;
+    int count;
+    reply_t reply;
+    lock_report_t report[ LOCK_STATS_TOP ];
+
+    if( argc == 2 )
+    {
+        lock_stats_reset();
+        write_user( user_submitter, "Lock stats reset. \n" );
+        return SUCCESS;
     }
 
+    reply_begin( &reply, user_submitter );
+    reply_line( &reply, "--- Lock Contention --- \n" );
+    reply_line( &reply, "%-28s %10s %10s %10s %10s %10s %10s \n", "Lock", "Acquired", "Contended", "Wait ms", "Max wait us", "Hold ms", "Max hold us" );
+
+    count = lock_stats_classes( report, LOCK_STATS_TOP );
+    for( i = 0; i < count; i++ )
+        reply_lock( &reply, &report[ i ] );
+
+    reply_line( &reply, "--- Most Contended --- \n" );
+    count = lock_stats_top( report, LOCK_STATS_TOP );
+    if( count == 0 )
+        reply_line( &reply, "None \n" );
+    for( i = 0; i < count; i++ )
+        reply_lock( &reply, &report[ i ] );
+
+    reply_end( &reply );
+#else
+    write_user( user_submitter, "Lock stats are not built in, define LOCK_STATS in lock_stats.h. \n" );
+#endif
+
     return SUCCESS;
 }
 
@@ -1598,7 +3417,7 @@ int chat_all( user_t *user_submitter, int argc, char **argv )
     // We need to do the admin check
     if ( false == user_submitter->admin )
     {
-        write_client( user_submitter->connection, "Cannot broadcast. Only Admin users may send a broadcast message. " );
+        write_user( user_submitter, "Cannot broadcast. Only Admin users may send a broadcast message. " );
         return FAILURE;
     }
     
@@ -1612,12 +3431,7 @@ int chat_all( user_t *user_submitter, int argc, char **argv )
     int     offset = strlen( argv[ 0 ] ) + 1;
     message = strstr( user_submitter->user_msg + offset, argv[ 1 ] );
     
-    char    timestamp[TIMESTAMP_SIZE];
-    time_t  ltime;           /* calendar time */
-    ltime = time(NULL);
-    strftime(timestamp, TIMESTAMP_SIZE, "%a %I:%M:%S %p", localtime(&ltime)); /* populate timestamp string */
-        
-    write_all_clients("[%s BROADCAST]: %s \n", timestamp, message);
+    write_all_clients("[%s BROADCAST]: %s \n", timestamp_text(), message);
     return SUCCESS;
 }
 
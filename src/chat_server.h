@@ -11,6 +11,10 @@
 #ifndef CHAT_SERVER_H_
 #define CHAT_SERVER_H_
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE         /*  pthread_setaffinity_np()  */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -20,10 +24,32 @@
 #include <arpa/inet.h>      /*  inet (3) funtions         */
 #include <unistd.h>         /*  misc. UNIX functions      */
 #include <pthread.h>
+#include <sched.h>          /*  CPU affinity              */
 #include <semaphore.h>
+#include <sys/epoll.h>      /*  event loop                */
+#include <sys/mman.h>       /*  connection table mapping  */
+#include <sys/resource.h>   /*  descriptor limit          */
+#include <sys/stat.h>       /*  mkdir()                   */
 #include <time.h>           /*  time functions            */
 #include <ctype.h>          /*  for tolower() function    */
+#include <signal.h>
+#include <getopt.h>
+#include <limits.h>         /*  PTHREAD_STACK_MIN         */
 #include "helper.h"         /*  our own helper functions  */
+#include "msg_buf.h"        /*  shared message buffers    */
+#include "out_queue.h"      /*  per-connection output     */
+#include "hash_map.h"       /*  name lookup               */
+#include "intern.h"         /*  user name ids             */
+#include "history.h"        /*  chat room history         */
+#include "history_log.h"    /*  persistent room history   */
+#include "epoch.h"          /*  lock-free read sections   */
+#include "mailbox.h"        /*  work for other reactors   */
+#include "ip_trie.h"        /*  blocked address ranges    */
+#include "timestamp.h"      /*  cached clock reads        */
+#include "logger.h"         /*  asynchronous server log   */
+#include "stats.h"          /*  live server counters      */
+#include "trace.h"          /*  sampled message tracing   */
+#include "lock_stats.h"     /*  lock wait and hold times  */
 
 
 // constants
@@ -31,20 +57,32 @@
 #define FAILURE             ( -1 )
 #define DISPLAY_USAGE       ( -2 )
 #define NOT_ADMIN           ( -3 )
-#define MAX_ROOMS           5
-#define MAX_CONN            10
-#define MAX_BLOCKED         2
+#define ROOM_EXISTS         ( -4 )              /* open_chat_room(): the name is taken */
+#define ROOM_CLOSING        ( -5 )              /* open_chat_room(): a room of that name is still closing */
+#define DFLT_MAX_CONN       100000              /* connection table size unless given on command line */
+#define MAX_MUTED_USERS     10                  /* mute list entries per user */
+#define DFLT_BLOCK_FILE     "blocked.txt"       /* addresses blocked at startup, one address or range per line */
 #define ECHO_PORT           3456
+#define MAX_EVENTS          64                  /* epoll events handled per wakeup */
+#define EPOCH_POLL_MS       10                  /* epoll timeout while retired items wait to be reclaimed */
+#define REPLY_PAGE_SIZE     ( 16 * MAX_LINE )   /* multi-line responses go out in chunks of at most this */
+#define DFLT_OUT_QUEUE_LIMIT ( 256 * 1024 )     /* bytes queued for a client before the overflow policy applies */
+#define DFLT_STACK_SIZE     ( 256 * 1024 )      /* stack of each event loop thread unless given with -S, the deepest path needs ~16K */
 #define MAX_ARGS            16
 #define MAX_ARG_LEN         64
 #define MAX_CMD_STR_LEN     32
 #define MAX_CMD_USAGE_LEN   512
+#define COMMAND_INDEX_SIZE  128                 /* slots of the command hash, power of 2 at least twice the commands */
+#define COMMAND_SEED_TRIES  100000              /* seeds tried for one that gives every command its own slot */
 #define MAX_USER_NAME_LEN   32                  /* maximum characters including null terminating character */
 #define MAX_ROOM_NAME_LEN   32                  /* maximum characters including null terminating character */
-#define MAX_USERS_IN_ROOM   MAX_CONN
-#define HISTORY_SIZE        50                  /* max lines of history */
+#define DFLT_ROOM_CAPACITY  16                  /* initial size of a room's member array, grows as needed */
+#define BALANCE_MIN_LOAD    10000               /* deliveries per second before a reactor hands rooms off */
+#define DFLT_HISTORY_SIZE   50                  /* lines of history per room unless given with -H */
+#define DFLT_HISTORY_DIR    "history"           /* room history logs unless given with -d */
+#define MAX_HISTORY_READ    1000                /* most lines "/history <lines>" reads back from a room's log */
+
 #define BUFFER_SIZE         1024                /* max length of message */
-#define TIMESTAMP_SIZE      20                  /* length of timestamp ddd HH:MM:SS PM */
 #define DFLT_CHATROOM_NAME  "lobby"
 #define ADMIN_NAME          "Admin"             /*  Admin username  */
 #define ADMIN_PASSWORD      "notPassword"       /*  password for admin login */
@@ -85,75 +123,187 @@
 #define CMD_LISTBLOCK       "listblock"
 
 #define CMD_CHAT_ALL        "broadcast"         /* send a message to all logged-in users            */
+#define CMD_LOG_LEVEL       "loglevel"          /* show or change what the server logs              */
+#define CMD_STATS           "stats"             /* show the server's counters and latencies         */
+#define CMD_TRACE           "trace"             /* sample chat lines for tracing, or dump the trace */
+#define CMD_LOCKS           "locks"             /* lock wait and hold times, if built with LOCK_STATS */
 
 #define SLASH_VALUE         '/'
 
 
+// what to do with a client whose outbound queue passes out_queue_limit
+#define OVERFLOW_DROP       0                   /* drop further messages until the client catches up */
+#define OVERFLOW_DISCONNECT 1                   /* disconnect the client */
+
+// command line options
+#define OPT_STRING          "q:kH:d:t:b:l:s:T:S:"
+#define OPT_OUT_QUEUE_LIMIT 'q'                 /* -q <bytes>: outbound queue high-water mark */
+#define OPT_DISCONNECT_SLOW 'k'                 /* -k: disconnect clients past the mark instead of dropping */
+#define OPT_HISTORY_SIZE    'H'                 /* -H <lines>: history kept per room */
+#define OPT_HISTORY_DIR     'd'                 /* -d <dir>: where room history logs are kept */
+#define OPT_REACTORS        't'                 /* -t <threads>: event loop threads, default one per core */
+#define OPT_BLOCK_FILE      'b'                 /* -b <file>: block list loaded at startup */
+#define OPT_LOG_LEVEL       'l'                 /* -l <level>: error, warn, info or debug */
+#define OPT_STATS_SHM       's'                 /* -s <name>: shared memory segment holding the counters */
+#define OPT_TRACE           'T'                 /* -T <n>: trace one chat line in n, dumped on SIGUSR1 */
+#define OPT_STACK_SIZE      'S'                 /* -S <bytes>: stack of each event loop thread */
+
+// work a reactor can be handed for a connection it owns (mail->target is a user_t)
+#define MAIL_SEND           0                   /* queue mail->buf for the connection */
+#define MAIL_REPLY          1                   /* queue mail->buf, a page of a reply, whatever the queue limit */
+#define MAIL_LOGOUT         2                   /* disconnect the connection */
+// and for a room it owns (mail->target is a chat_room_t)
+#define MAIL_CHAT           3                   /* fan mail->buf out from mail->from_id and add it to history */
+#define MAIL_HISTORY        4                   /* send mail->arg lines of history (-1 all) to mail->from_id */
+#define MAIL_CLOSE          5                   /* the last member has left */
+#define MAIL_HANDOFF        6                   /* the former owner, mail->arg, has passed on all it had for the room */
+
+// login states, a connection moves through these as its lines arrive
+#define USER_STATE_USERNAME 0                   /* waiting for username */
+#define USER_STATE_PASSWORD 1                   /* waiting for admin password */
+#define USER_STATE_CHAT     2                   /* logged in, processing chat and commands */
+
+
 // types
+
+// sorted interned ids of the users someone has muted; a list is never changed
+// in place, set_muted() swaps in a new one
+typedef struct mute_list_t
+{
+    int                 count;
+    int                 ids[ ];
+} mute_list_t;
+
+// An event loop thread.  Every reactor listens on the server port with its own
+// SO_REUSEPORT socket and owns the connections it accepts for their lifetime:
+// only the owner reads, writes and closes them, other threads post to its mailbox.
+typedef struct reactor_t
+{
+    int                 id;
+    pthread_t           thread;
+    int                 epoll_fd;
+    int                 listen_fd;
+    mailbox_t           mailbox;                    /* mail_t for connections and rooms owned here */
+    unsigned long       load;                       /* deliveries its rooms needed in the last second */
+    time_t              load_time;                  /* monotonic second load was reported */
+} reactor_t;
+
 typedef struct user_t
 {
     int                 user_id;
     char                user_name[ MAX_USER_NAME_LEN ];
+    int                 name_id;                    /* interned id of user_name                        */
+    bool                named;                      /* user_name is claimed in user_index              */
     struct chat_room_t *chat_room;                  /* Name of chatroom user is currently in           */
-    struct user_t      *reply_user;                 /* reference to user who whispered to this user    */
-    char                muted_users[ MAX_CONN ][ MAX_USER_NAME_LEN ];    /* users muted by this user   */
+    int                 room_index;                 /* slot in chat_room->members                      */
+    int                 reply_id;                   /* interned name of user who whispered to this user */
+    mute_list_t        *mutes;                      /* users muted by this user, NULL if none          */
     bool                admin;                      /* Whether user is administrative user             */
     bool                login_failure;              /* signifies an invalid password was used to logon */
     int                 connection;                 /* socket file descriptor */
-    pthread_t           thread;
+    reactor_t          *reactor;                    /* event loop that owns the connection */
+    unsigned int        generation;                 /* bumped each time the slot is claimed */
+    int                 state;                      /* USER_STATE_* login progress                     */
+    line_buffer_t       line_buf;                   /* partial line received from the client           */
     bool                used;                       /* Whether user struct is used/contains user data  */
     bool                logout;                     /* Whether user has logged out                     */
-    sem_t               write_mutex;                /* write lock for client's connection */
+    stat_sem_t          write_mutex;                /* write lock for client's connection and out_queue */
+    out_queue_t         out_queue;                  /* output not yet accepted by the socket */
     char                user_msg[ BUFFER_SIZE ];    /* last message sent from this user */
     struct in_addr      user_ip_addr;               /* IP address user is connected from */
+    int                 next_free;                  /* next slot in free list while slot is unused */
+    struct user_t      *live_prev;                  /* neighbours in list of live connections      */
+    struct user_t      *live_next;
 } user_t;
 
-// Struct for storing lines of history so we can apply mutes to history
-typedef struct history_line_t
+// multi-line response being collected for a client, see reply_line()
+typedef struct reply_t
 {
-    char                message[BUFFER_SIZE];           /* line to be logged */
-    char                timestamp[TIMESTAMP_SIZE];      /* when message was sent */
-	char                user_name[MAX_USER_NAME_LEN];   /* user who sent the message */
-} history_line_t;
+    user_t             *user;
+    unsigned int        generation;                 /* of the connection the reply is for */
+    msg_buf_t          *page;                       /* lines not yet queued, NULL if none */
+} reply_t;
 
 
+// members of a room as seen by readers, see room_members()
+typedef struct member_set_t
+{
+    int                 capacity;
+    int                 count;                      /* slots handed out so far */
+    struct user_t      *users[ ];                   /* NULL where a member has left */
+} member_set_t;
+
 typedef struct chat_room_t
 {
     int            room_id;
     char           room_name[ MAX_ROOM_NAME_LEN ];
-    int            user_count;
-    struct user_t *users[ MAX_USERS_IN_ROOM ];
-    struct history_line_t history[HISTORY_SIZE];   /* Chat room's chat history */
-    sem_t          history_mutex;  /* For avoiding history collisions */
-    int            history_count;  /* Points to next available history line */
+    int            user_count;     /* members in the room */
+    int            muting_members; /* members with a non-empty mute list, 0 lets fanout skip filtering */
+    member_set_t  *members;        /* current member set, replaced as a whole when repacked */
+    stat_sem_t     members_mutex;  /* serializes joins and leaves, readers don't take it */
+    int            reserved;       /* slots promised to joins in progress */
+    bool           closing;        /* last member left, no more joins */
+    reactor_t     *owner;          /* runs the room's fanout and history, may hand the room to another */
+    bool           handoff;        /* moved, mail posted straight to the new owner waits for MAIL_HANDOFF */
+    mail_t        *held;           /* that mail, oldest first, only the owner touches it */
+    mail_t        *held_tail;
+    unsigned int   generation;     /* bumped when the room opens and closes, mail for a former room is dropped */
+    unsigned long  load;           /* deliveries this second, kept by the owner */
+    history_t      history;        /* Chat room's chat history, lines keep sender ids so we can apply mutes, only the owner touches it */
+    history_log_t  history_log;    /* Chat room's history on disk, kept across restarts */
+    struct chat_room_t *room_prev; /* neighbours in active room list (room_next links the free list when unused) */
+    struct chat_room_t *room_next;
 } chat_room_t;
 
-// Struct for storing that an IP was blocked by an administrator
-// Blocked users cannot connect to the server
+// Struct for storing that an address range was blocked by an administrator
+// or listed in the block file.  Blocked addresses cannot connect to the server
 typedef struct blocked_ip_t
 {
-    struct in_addr      user_ip_addr;                       /* IP address that was blocked */
-    char                user_name[ MAX_USER_NAME_LEN ];     /* user that was blocked       */
-    char                reason[ BUFFER_SIZE ];              /* Reason user was blocked     */
-    int                 active;                         
-    int                 id;
+    int                 id;                                 /* shown by /listblock, taken by /unblock */
+    ip_prefix_t         range;                              /* addresses that were blocked */
+    char                user_name[ MAX_USER_NAME_LEN ];     /* user that was blocked, empty if blocked by address */
+    char                reason[ ];                          /* Reason user was blocked     */
 } blocked_ip_t;
 
 
 // prototypes
-void *user_proc( void *arg );
+void init_reactor( reactor_t *reactor, int id, short int port );
+void *run_reactor( void *arg );             /* event loop, never returns */
+void handle_mail( reactor_t *reactor );
+void request_trace_dump( int sig );        /* SIGUSR1 handler */
+void post_mail( user_t *user, unsigned int generation, int type, msg_buf_t *buf );   /* hand work for that connection to the user's reactor */
+void balance_rooms( reactor_t *reactor, time_t now );        /* hand a hot room to a less loaded reactor */
+void accept_clients( reactor_t *reactor );
+void attach_client( reactor_t *reactor, user_t *user, int conn_s, struct in_addr addr );
+void user_proc( user_t *user );
+void disconnect_user( user_t *user );
 void process_client_msg( user_t *user, char *chat_msg );
 int get_command( char *msg, char **argv );
+void init_commands( void );
 void process_command( user_t *user, int argc, char **argv );
 void write_all_clients( char *msg, ... );
+void write_user( user_t *user, char *msg, ... );    /* queue formatted output for a client */
+void reply_begin( reply_t *reply, user_t *user );   /* start a multi-line response */
+void reply_line( reply_t *reply, char *msg, ... );
+void reply_end( reply_t *reply );                   /* send whatever is still collected */
+void queue_reply( user_t *user, unsigned int generation, msg_buf_t *page );  /* queue a page of a reply, on the user's reactor */
+void send_to_user( user_t *user, msg_buf_t *buf );  /* queue a shared message for a client */
+msg_buf_t *new_wire_msg( char *text, int len );
+void flush_user( user_t *user );
 void server_error( char *msg );
-void init_user_thread( void );
+void init_user_thread( int max_conn );
 void destroy_user_thread( void );
-void get_username( user_t *user );
-bool admin_check( user_t *user_submitter );
+user_t *claim_user_slot( void );            /* O(1) slot allocation, NULL when table is full */
+void release_user_slot( user_t *user );
+void free_user_slot( void *slot );          /* back on the free list once released and unseen */
+void get_username( user_t *user, char *msg );
+bool admin_check( user_t *user_submitter, char *password );
+void login_user( user_t *user );
 int reset_user( user_t *user_submitter );   /* Clear all values from user struct so it's ready to be re-used */
 bool is_logged_in( char *user_name, user_t **user_pointer );      /* Get reference to user logged in with given name */
 bool is_ignoring_user_name( user_t *user_ignoring, char *ignore_name ); /* Determine if given user is ignoring a name */
+bool is_ignoring_user_id( user_t *user_ignoring, int ignore_id );       /* Same, by interned name id */
+int set_muted( user_t *user, int id, bool muted );   /* add/remove id from user's mute list */
 void print_mute_list( user_t *user_submitter );  /* Print the mute list for given user */
 // String Case-Insensitive Comparison courtesy of
 // http://stackoverflow.com/questions/5820810/case-insensitive-string-comp-in-c
@@ -163,9 +313,24 @@ int strcicmp( char const *a, char const *b );
 
 // chatroom helper functions
 void init_chatroom( chat_room_t *room, int id, char *name );
+chat_room_t *find_chat_room( char *name );  /* O(1) lookup by name, NULL if no such room */
+int open_chat_room( char *name, chat_room_t **room_out );   /* register a new room, ROOM_EXISTS if name is taken */
+void close_empty_room( chat_room_t *room ); /* unlist a room nobody is in and have its owner close it */
+void close_chat_room( chat_room_t *room );  /* reclaim an empty room */
+void recycle_chat_room( void *room );       /* back on the free list once closed and unseen */
+member_set_t *room_members( chat_room_t *room, int *count );   /* current members, read inside epoch_enter() */
+user_t *room_member( member_set_t *members, int i );          /* NULL if that member left */
+reactor_t *room_owner( chat_room_t *room );
+bool room_runs_here( chat_room_t *room );   /* owned by this reactor and not waiting for a hand-off */
+void run_room_mail( chat_room_t *room, mail_t *mail );  /* on the room's owner */
+void finish_handoff( chat_room_t *room );   /* run the mail held while the room was handed over */
+void post_handoff( void *ptr );             /* queue a MAIL_HANDOFF behind the former owner's mail */
+void post_room_mail( chat_room_t *room, int type, int from_id, unsigned int from_generation, int arg, msg_buf_t *buf );  /* hand work to the room's owner */
 void write_chatroom( user_t *user, char *msg, ... );
-void write_chatroom_history( user_t *user, char *message ); /* write message to user's current room's history */
-bool is_valid_history_line(user_t *user_submitter, int line_num); /* indicate whether user should see give line of room's history */
+void room_fanout( chat_room_t *room, int sender_id, msg_buf_t *wire );  /* deliver a chat line, on the room's owner */
+void room_history( chat_room_t *room, int user_id, unsigned int generation, int lines );   /* send history to a connection, on the room's owner */
+void write_chatroom_history( chat_room_t *room, int sender_id, char *message, size_t len ); /* on the room's owner */
+bool is_valid_history_line(user_t *user_submitter, history_line_t *line); /* indicate whether user should see give line of room's history */
 bool chatroom_is_active( chat_room_t *room );
 int add_user_to_chatroom( user_t *user, chat_room_t *room );
 int remove_user_from_chatroom( user_t *user );
@@ -198,10 +363,19 @@ int get_history( user_t *user_submitter, int argc, char **argv );
 
 // admin command functionality
 int chat_all( user_t *user_submitter, int argc, char **argv );
+int set_log_level( user_t *user_submitter, int argc, char **argv );
+int show_stats( user_t *user_submitter, int argc, char **argv );
+int set_trace( user_t *user_submitter, int argc, char **argv );
+int show_locks( user_t *user_submitter, int argc, char **argv );
+int dump_trace( char *path, size_t size );  /* events written to a new trace file, -1 if it can't be written */
 
 int kick_user( user_t *user_submitter, int argc, char **argv );
 int kick_all_users_in_chat_room( user_t *user_submitter, int argc, char **argv );
 
+bool is_blocked( struct in_addr addr );    /* lock-free, checked for every accepted connection */
+int add_block( ip_prefix_t *range, char *user_name, char *reason );    /* id of the new block, FAILURE if out of memory */
+int load_block_file( char *path );         /* number of blocks loaded, FAILURE if unreadable */
+void kick_blocked_users( ip_prefix_t *range, char *reason, user_t *user_submitter );    /* everyone in range but the submitter */
 int block_user_ip( user_t *user_submitter, int argc, char **argv );
 int unblock_user_ip( user_t *user_submitter, int argc, char **argv );
 int list_blocked_users( user_t *user_submitter, int argc, char **argv );
@@ -214,7 +388,18 @@ typedef struct command_t
     char        command_parameter_usage[ MAX_CMD_USAGE_LEN ];
 } command_t;
 
+command_t *find_command( user_t *user, char *name );   /* command the user may run, or NULL */
+int command_position( command_t *command );            /* commands[] then admin_commands[], counters are kept by it */
+uint32_t command_hash( const char *name, uint32_t seed );     /* of the case-folded name */
+bool place_commands( uint32_t seed );                          /* false if two commands share a slot */
+
+// admin commands share the command index, so they share the entry layout
+typedef command_t admin_command_t;
 
+
+// the tables are defined by chat_server.c, other programs linking the server
+// (the benchmarks) include this header without them
+#ifndef CHAT_SERVER_NO_TABLES
 command_t   commands[] =
 {
     { CMD_HELP,             help,                       "[command]"                     },
@@ -239,22 +424,22 @@ command_t   commands[] =
     // { CMD_CHAT_ALL,         chat_all,                   "<message>"                     },
 };
 
-typedef struct admin_command_t
-{
-    char        command_string[ MAX_CMD_STR_LEN ];
-    int         (*command_function) ( user_t *user, int argc, char **argv );
-    char        command_parameter_usage[ MAX_CMD_USAGE_LEN ];
-} admin_command_t;
-
-
 admin_command_t   admin_commands[] =
 {
     { CMD_KICK,             kick_user,                  "<user>"                        },
     { CMD_KICK_ALL,         kick_all_users_in_chat_room,"<chatroomname>"                },
-    { CMD_BLOCK,            block_user_ip,              "<user> [reason]"               },
-    { CMD_UNBLOCK,          unblock_user_ip,            "<blockID>"                     },
+    { CMD_BLOCK,            block_user_ip,              "<user|address[/bits]> [reason]" },
+    { CMD_UNBLOCK,          unblock_user_ip,            "<blockID|address[/bits]>"      },
     { CMD_LISTBLOCK,        list_blocked_users,         ""                              },
     { CMD_CHAT_ALL,         chat_all,                   "<message>"                     },    
+    { CMD_LOG_LEVEL,        set_log_level,              "[error|warn|info|debug]"       },
+    { CMD_STATS,            show_stats,                 ""                              },
+    { CMD_TRACE,            set_trace,                  "[off|<1 in n>|dump]"           },
+    { CMD_LOCKS,            show_locks,                 "[reset]"                       },
 };
 
+#define NUM_COMMANDS        ( (int)( sizeof( commands ) / sizeof( command_t ) ) )
+#define NUM_ADMIN_COMMANDS  ( (int)( sizeof( admin_commands ) / sizeof( admin_command_t ) ) )
+#endif /* CHAT_SERVER_NO_TABLES */
+
 #endif /* CHAT_SERVER_H_ */
@@ -0,0 +1,133 @@
+/*===========================================================================
+ Filename    : epoch.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Epoch based reclamation.  Readers bracket lock-free reads of
+               shared data with epoch_enter()/epoch_exit(), writers hand
+               unlinked data to epoch_retire() and it is reclaimed once no
+               reader can still hold it.
+===========================================================================*/
+
+#include "epoch.h"
+
+
+// Epoch 0 marks a thread outside any read section, so counting starts at 1.
+// Something retired in epoch e is unreachable for readers that enter in e + 1,
+// and once the global epoch is e + 2 every reader of epoch e has left.
+static unsigned long            global_epoch = 1;
+static epoch_record_t          *epoch_records;
+static __thread epoch_record_t *epoch_self;
+
+
+// this thread's record, registered on first use
+static epoch_record_t *self_record( void )
+{
+    epoch_record_t *record = epoch_self;
+
+    if( record != NULL )
+        return record;
+
+    record = calloc( 1, sizeof( epoch_record_t ) );
+    if( record == NULL )
+        abort();
+
+    record->next = __atomic_load_n( &epoch_records, __ATOMIC_ACQUIRE );
+    while( !__atomic_compare_exchange_n( &epoch_records, &record->next, record, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+        ;
+
+    epoch_self = record;
+    return record;
+}
+
+void epoch_enter( void )
+{
+    epoch_record_t *record = self_record();
+
+    if( record->nesting++ == 0 )
+        __atomic_store_n( &record->active, __atomic_load_n( &global_epoch, __ATOMIC_SEQ_CST ), __ATOMIC_SEQ_CST );
+}
+
+void epoch_exit( void )
+{
+    epoch_record_t *record = epoch_self;
+
+    if( --record->nesting == 0 )
+        __atomic_store_n( &record->active, 0, __ATOMIC_RELEASE );
+}
+
+// the epoch moves on only once every thread in a read section has seen it
+static bool try_advance( void )
+{
+    unsigned long   epoch = __atomic_load_n( &global_epoch, __ATOMIC_SEQ_CST );
+    unsigned long   active;
+    epoch_record_t *record;
+
+    for( record = __atomic_load_n( &epoch_records, __ATOMIC_ACQUIRE ); record != NULL; record = record->next )
+    {
+        active = __atomic_load_n( &record->active, __ATOMIC_SEQ_CST );
+        if( active != 0 && active != epoch )
+            return false;
+    }
+
+    return __atomic_compare_exchange_n( &global_epoch, &epoch, epoch + 1, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+}
+
+void epoch_reclaim( void )
+{
+    epoch_record_t   *record = self_record();
+    epoch_garbage_t **link;
+    epoch_garbage_t  *item;
+    unsigned long     epoch;
+
+    // two steps are enough to make everything retired so far safe
+    if( try_advance() )
+        try_advance();
+
+    epoch = __atomic_load_n( &global_epoch, __ATOMIC_SEQ_CST );
+
+    link = &record->garbage;
+    while( ( item = *link ) != NULL )
+    {
+        if( item->epoch + 2 <= epoch )
+        {
+            *link = item->next;
+            record->garbage_count--;
+            item->reclaim( item->ptr );
+            free( item );
+        }
+        else
+            link = &item->next;
+    }
+}
+
+void epoch_retire( void *ptr, void (*reclaim)( void *ptr ) )
+{
+    epoch_record_t  *record = self_record();
+    epoch_garbage_t *item;
+
+    if( ptr == NULL )
+        return;
+
+    // without memory to track it the item is leaked rather than freed early
+    item = malloc( sizeof( epoch_garbage_t ) );
+    if( item == NULL )
+        return;
+
+    item->ptr     = ptr;
+    item->reclaim = reclaim;
+    item->epoch   = __atomic_load_n( &global_epoch, __ATOMIC_SEQ_CST );
+    item->next    = record->garbage;
+    record->garbage = item;
+
+    if( ++record->garbage_count >= EPOCH_RECLAIM_BATCH )
+        epoch_reclaim();
+}
+
+bool epoch_pending( void )
+{
+    return epoch_self != NULL && epoch_self->garbage != NULL;
+}
@@ -0,0 +1,51 @@
+/*===========================================================================
+ Filename    : epoch.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Epoch based reclamation.  Readers bracket lock-free reads of
+               shared data with epoch_enter()/epoch_exit(), writers hand
+               unlinked data to epoch_retire() and it is reclaimed once no
+               reader can still hold it.
+===========================================================================*/
+
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+
+#define EPOCH_RECLAIM_BATCH 64                  /* retired items that trigger a reclaim attempt */
+
+
+typedef struct epoch_garbage_t
+{
+    struct epoch_garbage_t *next;
+    unsigned long           epoch;              /* global epoch when retired */
+    void                   *ptr;
+    void                  (*reclaim)( void *ptr );
+} epoch_garbage_t;
+
+// one per thread, never freed
+typedef struct epoch_record_t
+{
+    unsigned long           active;             /* epoch entered, 0 while outside a read section */
+    int                     nesting;
+    epoch_garbage_t        *garbage;            /* retired by this thread, not yet reclaimed */
+    int                     garbage_count;
+    struct epoch_record_t  *next;               /* registry of all threads */
+} epoch_record_t;
+
+
+// prototypes
+void epoch_enter( void );
+void epoch_exit( void );
+void epoch_retire( void *ptr, void (*reclaim)( void *ptr ) );  /* call reclaim( ptr ) after a grace period */
+void epoch_reclaim( void );                     /* advance the epoch if possible, run what is now safe */
+bool epoch_pending( void );                     /* this thread has retired items waiting */
+
+
+#endif /* EPOCH_H_ */
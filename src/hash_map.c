@@ -0,0 +1,217 @@
+/*===========================================================================
+ Filename    : hash_map.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Thread-safe string keyed hash map, optionally case-insensitive,
+               used to find users (and other named objects) in O(1).
+===========================================================================*/
+
+#include "hash_map.h"
+
+
+// FNV-1a over the (optionally case-folded) key
+static uint32_t hash_key( hash_map_t *map, const char *key )
+{
+    uint32_t hash = 2166136261u;
+
+    for( ; *key; key++ )
+    {
+        hash ^= (unsigned char)( map->fold_case ? tolower( (unsigned char)*key ) : *key );
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static bool key_equal( hash_map_t *map, const char *a, const char *b )
+{
+    if( map->fold_case == false )
+        return strcmp( a, b ) == 0;
+
+    for( ; tolower( (unsigned char)*a ) == tolower( (unsigned char)*b ); a++, b++ )
+    {
+        if( *a == '\0' )
+            return true;
+    }
+
+    return false;
+}
+
+// find the link pointing at key's entry (or the end of its chain)
+static hash_entry_t **find_entry( hash_map_t *map, const char *key, uint32_t hash )
+{
+    hash_entry_t **link;
+
+    link = &map->buckets[ hash & ( map->num_buckets - 1 ) ];
+    while( *link != NULL )
+    {
+        if( ( *link )->hash == hash && key_equal( map, ( *link )->key, key ) )
+            break;
+        link = &( *link )->next;
+    }
+
+    return link;
+}
+
+// double the bucket array, caller holds the write lock
+static void grow( hash_map_t *map )
+{
+    size_t          i;
+    size_t          num_buckets = map->num_buckets * 2;
+    hash_entry_t  **buckets;
+    hash_entry_t   *entry;
+    hash_entry_t   *next;
+
+    buckets = calloc( num_buckets, sizeof( hash_entry_t * ) );
+    if( buckets == NULL )
+        return;
+
+    for( i = 0; i < map->num_buckets; i++ )
+    {
+        for( entry = map->buckets[ i ]; entry != NULL; entry = next )
+        {
+            next = entry->next;
+            entry->next = buckets[ entry->hash & ( num_buckets - 1 ) ];
+            buckets[ entry->hash & ( num_buckets - 1 ) ] = entry;
+        }
+    }
+
+    free( map->buckets );
+    map->buckets = buckets;
+    map->num_buckets = num_buckets;
+}
+
+int hash_map_init( hash_map_t *map, bool fold_case )
+{
+    map->buckets = calloc( HASH_MAP_MIN_SIZE, sizeof( hash_entry_t * ) );
+    if( map->buckets == NULL )
+        return HASH_MAP_NO_MEMORY;
+
+    map->num_buckets = HASH_MAP_MIN_SIZE;
+    map->count = 0;
+    map->fold_case = fold_case;
+    pthread_rwlock_init( &map->lock, NULL );
+
+    return HASH_MAP_OK;
+}
+
+void hash_map_destroy( hash_map_t *map )
+{
+    size_t          i;
+    hash_entry_t   *entry;
+    hash_entry_t   *next;
+
+    for( i = 0; i < map->num_buckets; i++ )
+    {
+        for( entry = map->buckets[ i ]; entry != NULL; entry = next )
+        {
+            next = entry->next;
+            free( entry );
+        }
+    }
+
+    free( map->buckets );
+    map->buckets = NULL;
+    pthread_rwlock_destroy( &map->lock );
+}
+
+void *hash_map_get( hash_map_t *map, const char *key )
+{
+    uint32_t        hash = hash_key( map, key );
+    hash_entry_t   *entry;
+    void           *value = NULL;
+
+    pthread_rwlock_rdlock( &map->lock );
+
+    entry = *find_entry( map, key, hash );
+    if( entry != NULL )
+        value = entry->value;
+
+    pthread_rwlock_unlock( &map->lock );
+
+    return value;
+}
+
+// insert key if it is not present yet, the check and insert are atomic
+int hash_map_put( hash_map_t *map, const char *key, void *value )
+{
+    uint32_t        hash = hash_key( map, key );
+    size_t          key_len = strlen( key );
+    hash_entry_t  **link;
+    hash_entry_t   *entry;
+
+    pthread_rwlock_wrlock( &map->lock );
+
+    link = find_entry( map, key, hash );
+    if( *link != NULL )
+    {
+        pthread_rwlock_unlock( &map->lock );
+        return HASH_MAP_EXISTS;
+    }
+
+    entry = malloc( sizeof( hash_entry_t ) + key_len + 1 );
+    if( entry == NULL )
+    {
+        pthread_rwlock_unlock( &map->lock );
+        return HASH_MAP_NO_MEMORY;
+    }
+
+    entry->next  = NULL;
+    entry->hash  = hash;
+    entry->value = value;
+    memcpy( entry->key, key, key_len + 1 );
+    *link = entry;
+
+    if( ++map->count > map->num_buckets * HASH_MAP_LOAD )
+        grow( map );
+
+    pthread_rwlock_unlock( &map->lock );
+
+    return HASH_MAP_OK;
+}
+
+void *hash_map_remove( hash_map_t *map, const char *key )
+{
+    uint32_t        hash = hash_key( map, key );
+    hash_entry_t  **link;
+    hash_entry_t   *entry;
+    void           *value = NULL;
+
+    pthread_rwlock_wrlock( &map->lock );
+
+    link = find_entry( map, key, hash );
+    entry = *link;
+    if( entry != NULL )
+    {
+        *link = entry->next;
+        value = entry->value;
+        map->count--;
+        free( entry );
+    }
+
+    pthread_rwlock_unlock( &map->lock );
+
+    return value;
+}
+
+void hash_map_remove_value( hash_map_t *map, const char *key, void *value )
+{
+    uint32_t        hash = hash_key( map, key );
+    hash_entry_t  **link;
+    hash_entry_t   *entry;
+
+    pthread_rwlock_wrlock( &map->lock );
+
+    link = find_entry( map, key, hash );
+    entry = *link;
+    if( entry != NULL && entry->value == value )
+    {
+        *link = entry->next;
+        map->count--;
+        free( entry );
+    }
+
+    pthread_rwlock_unlock( &map->lock );
+}
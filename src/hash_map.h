@@ -0,0 +1,56 @@
+/*===========================================================================
+ Filename    : hash_map.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Thread-safe string keyed hash map, optionally case-insensitive,
+               used to find users (and other named objects) in O(1).
+===========================================================================*/
+
+#ifndef HASH_MAP_H_
+#define HASH_MAP_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>          /*  for tolower() function    */
+#include <pthread.h>
+
+
+#define HASH_MAP_OK         0
+#define HASH_MAP_EXISTS     ( -1 )              /* key is already present */
+#define HASH_MAP_NO_MEMORY  ( -2 )
+#define HASH_MAP_MIN_SIZE   16                  /* buckets allocated up front */
+#define HASH_MAP_LOAD       2                   /* entries per bucket before the table doubles */
+
+
+typedef struct hash_entry_t
+{
+    struct hash_entry_t    *next;
+    uint32_t                hash;
+    void                   *value;
+    char                    key[ ];
+} hash_entry_t;
+
+typedef struct hash_map_t
+{
+    hash_entry_t          **buckets;
+    size_t                  num_buckets;        /* always a power of two */
+    size_t                  count;
+    bool                    fold_case;          /* keys compare case-insensitively */
+    pthread_rwlock_t        lock;
+} hash_map_t;
+
+
+// prototypes
+int hash_map_init( hash_map_t *map, bool fold_case );
+void hash_map_destroy( hash_map_t *map );
+void *hash_map_get( hash_map_t *map, const char *key );
+int hash_map_put( hash_map_t *map, const char *key, void *value );     /* fails with HASH_MAP_EXISTS */
+void *hash_map_remove( hash_map_t *map, const char *key );
+void hash_map_remove_value( hash_map_t *map, const char *key, void *value ); /* remove only if key maps to value */
+
+
+#endif /* HASH_MAP_H_ */
@@ -14,30 +14,78 @@
 */
 
 #include "helper.h"
-
-
-// read a line from a socket
-ssize_t read_line( int sockd, void *vptr, size_t maxlen )
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+// read a line from a non-blocking socket
+// data is read from the socket in chunks of up to RECV_BUFFER_SIZE bytes and
+// lines are split out of the buffer, so a single read() may satisfy several
+// calls and a line may be assembled from several reads.
+// returns READ_AGAIN when the socket is drained before a full line arrived,
+// the partial line is kept in line_buf and completed by a later call.
+// At end of file a partial line is still returned, CONN_ERR comes after it.
+ssize_t read_line( int sockd, line_buffer_t *line_buf, void *vptr, size_t maxlen )
 {
     ssize_t     n;
     ssize_t     rc;
-    char        c;
-    char       *buffer;
+    size_t      avail;
+    char       *line;
+    char       *newline;
 
-    buffer = vptr;
-
-    for( n = 1; n < maxlen; n++ )
+    while( 1 )
     {
-        rc = read( sockd, &c, 1 );
+        line  = line_buf->data + line_buf->start;
+        avail = line_buf->end - line_buf->start;
+
+        // a line ends at a newline or once maxlen - 1 characters are buffered
+        newline = memchr( line, '\n', avail < maxlen - 1 ? avail : maxlen - 1 );
+        if( newline != NULL )
+            n = newline - line + 1;
+        else if( avail >= maxlen - 1 )
+            n = maxlen - 1;
+        else
+            n = 0;
+
+        if( n > 0 )
+        {
+            memcpy( vptr, line, n );
+            ( (char *)vptr )[ n ] = 0;
+
+            line_buf->start += n;
+            if( line_buf->start == line_buf->end )
+                line_buf->start = line_buf->end = 0;
+
+            return n;
+        }
 
-        if( rc == 1 )
+        // move the partial line to the front to make room for the next chunk
+        if( line_buf->start > 0 )
         {
-            *buffer++ = c;
-            if( c == '\n' )
-                break;
+            memmove( line_buf->data, line, avail );
+            line_buf->start = 0;
+            line_buf->end   = avail;
+        }
+
+        rc = read( sockd, line_buf->data + line_buf->end, RECV_BUFFER_SIZE - line_buf->end );
+
+        if( rc > 0 )
+        {
+            line_buf->end += rc;
         }
         else if( rc == 0 )
         {
+            // the client closed after a line without a newline
+            if( avail > 0 )
+            {
+                memcpy( vptr, line_buf->data, avail );
+                ( (char *)vptr )[ avail ] = 0;
+                line_buf->start = line_buf->end = 0;
+
+                return avail;
+            }
+
             // this case happens when the client closes unexpectedly
             return CONN_ERR;
         }
@@ -45,16 +93,15 @@ ssize_t read_line( int sockd, void *vptr, size_t maxlen )
         {
             if( errno == EINTR )
                 continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                return READ_AGAIN;
             return CONN_ERR;
         }
     }
-
-    *buffer = 0;
-    return n;
 }
 
 
-// write a line to a socket
+// write a line to a socket, fails rather than waits if a non-blocking one is full
 ssize_t write_line( int sockd, const void *vptr, size_t n )
 {
     size_t      nleft;
@@ -96,12 +143,15 @@ ssize_t write_client( int sock_fd, char *msg, ... )
 }
 
 
-ssize_t read_client( int sock_fd, char *msg_dest )
+ssize_t read_client( int sock_fd, line_buffer_t *line_buf, char *msg_dest )
 {
     int i;
     int ret_val;
 
-    ret_val = read_line( sock_fd, msg_dest, MAX_LINE - 1 );
+    ret_val = read_line( sock_fd, line_buf, msg_dest, MAX_LINE - 1 );
+
+    if( ret_val <= 0 )
+        return ret_val;
 
     // remove carriage returns and newlines from end of message
     for( i = strlen( msg_dest ) - 1; i >= 0; i-- )
@@ -123,3 +173,36 @@ void set_sock_reuse( int sock_fd )
     int one = 1;
     setsockopt( sock_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
 }
+
+
+// Lets several sockets listen on the same port, the kernel spreads incoming
+// connections across them.
+void set_sock_reuseport( int sock_fd )
+{
+    int one = 1;
+    setsockopt( sock_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof( one ) );
+}
+
+
+void init_line_buffer( line_buffer_t *line_buf )
+{
+    line_buf->start = 0;
+    line_buf->end   = 0;
+}
+
+
+// Puts a socket in non-blocking mode so it can be driven by epoll.
+void set_sock_nonblock( int sock_fd )
+{
+    int flags = fcntl( sock_fd, F_GETFL, 0 );
+    fcntl( sock_fd, F_SETFL, flags | O_NONBLOCK );
+}
+
+
+// Sends small writes right away.  Otherwise Nagle holds a second small write
+// until the peer acks the first, and a delayed ack makes that ~40ms.
+void set_sock_nodelay( int sock_fd )
+{
+    int one = 1;
+    setsockopt( sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+}
@@ -30,14 +30,30 @@
 
 #define MAX_LINE            1024    /* maximum string length    */
 #define CONN_ERR            -1      /* connection error         */
+#define READ_AGAIN          0       /* no complete line yet     */
+#define RECV_BUFFER_SIZE    ( 2 * MAX_LINE )    /* per-connection receive buffer */
+
+
+// per-connection receive buffer, filled a chunk at a time and split into lines
+// bytes in [ start, end ) have been received but not yet returned as a line
+typedef struct line_buffer_t
+{
+    char        data[ RECV_BUFFER_SIZE ];
+    size_t      start;
+    size_t      end;
+} line_buffer_t;
 
 
 // prototypes
-ssize_t read_line( int fd, void *vptr, size_t maxlen );
+ssize_t read_line( int fd, line_buffer_t *line_buf, void *vptr, size_t maxlen );
 ssize_t write_line( int fc, const void *vptr, size_t maxlen );
 ssize_t write_client( int sock_fd, char *msg, ... );
-ssize_t read_client( int sock_fd, char *msg_dest );
+ssize_t read_client( int sock_fd, line_buffer_t *line_buf, char *msg_dest );
 void set_sock_reuse( int sock_fd );
+void set_sock_reuseport( int sock_fd );
+void set_sock_nonblock( int sock_fd );
+void set_sock_nodelay( int sock_fd );
+void init_line_buffer( line_buffer_t *line_buf );
 
 
 #endif  /*  PG_SOCK_HELP  */
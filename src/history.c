@@ -0,0 +1,86 @@
+/*===========================================================================
+ Filename    : history.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Chat room history.  A ring of variable length lines, each
+               holding only the raw send time, the sender's interned name
+               id and the message bytes.
+===========================================================================*/
+
+#include "history.h"
+
+
+void init_history( history_t *history, int depth )
+{
+    history->lines = NULL;
+    history->depth = depth;
+    history->next  = 0;
+    history->count = 0;
+}
+
+// drop every line, the slot ring itself is kept for re-use
+void history_clear( history_t *history )
+{
+    int i;
+
+    if( history->lines != NULL )
+    {
+        for( i = 0; i < history->depth; i++ )
+        {
+            free( history->lines[ i ] );
+            history->lines[ i ] = NULL;
+        }
+    }
+
+    history->next  = 0;
+    history->count = 0;
+}
+
+void history_destroy( history_t *history )
+{
+    history_clear( history );
+    free( history->lines );
+    history->lines = NULL;
+}
+
+// add a line, dropping the oldest one once the history is at its depth
+int history_append( history_t *history, time_t time, int sender_id, const char *message, size_t len )
+{
+    history_line_t *line;
+
+    if( history->lines == NULL )
+    {
+        history->lines = calloc( history->depth, sizeof( history_line_t * ) );
+        if( history->lines == NULL )
+            return HISTORY_NO_MEMORY;
+    }
+
+    line = malloc( sizeof( history_line_t ) + len + 1 );
+    if( line == NULL )
+        return HISTORY_NO_MEMORY;
+
+    line->time      = time;
+    line->sender_id = sender_id;
+    line->len       = len;
+    memcpy( line->message, message, len );
+    line->message[ len ] = '\0';
+
+    free( history->lines[ history->next ] );
+    history->lines[ history->next ] = line;
+    history->next = ( history->next + 1 ) % history->depth;
+
+    if( history->count < history->depth )
+        history->count++;
+
+    return HISTORY_OK;
+}
+
+history_line_t *history_line( history_t *history, int index )
+{
+    if( index < 0 || index >= history->count )
+        return NULL;
+
+    return history->lines[ ( history->next - history->count + index + history->depth ) % history->depth ];
+}
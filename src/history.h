@@ -0,0 +1,49 @@
+/*===========================================================================
+ Filename    : history.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Chat room history.  A ring of variable length lines, each
+               holding only the raw send time, the sender's interned name
+               id and the message bytes.
+===========================================================================*/
+
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define HISTORY_OK          0
+#define HISTORY_NO_MEMORY   ( -1 )
+
+
+typedef struct history_line_t
+{
+    time_t      time;                           /* when message was sent */
+    int         sender_id;                      /* interned name id of user who sent the message */
+    size_t      len;
+    char        message[ ];                     /* len bytes plus terminator */
+} history_line_t;
+
+typedef struct history_t
+{
+    history_line_t    **lines;                  /* ring of depth slots, allocated on first line */
+    int                 depth;                  /* lines kept before the oldest is dropped */
+    int                 next;                   /* slot the next line goes in */
+    int                 count;
+} history_t;
+
+
+// prototypes
+void init_history( history_t *history, int depth );
+void history_clear( history_t *history );
+void history_destroy( history_t *history );    /* clear and free the slot ring */
+int history_append( history_t *history, time_t time, int sender_id, const char *message, size_t len );
+history_line_t *history_line( history_t *history, int index );    /* 0 is the oldest line */
+
+
+#endif /* HISTORY_H_ */
@@ -0,0 +1,263 @@
+/*===========================================================================
+ Filename    : history_log.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Persistent chat room history.  Each room appends its lines
+               to its own log file, and a sparse index of record offsets
+               lets the newest lines be read back without scanning the log.
+===========================================================================*/
+
+#include "history_log.h"
+#include "intern.h"
+
+
+// Room names may hold any printable character, anything but letters and digits
+// is written as %XX so every name maps to its own plain file name.
+static void log_path( char *path, const char *dir, const char *room_name, const char *ext )
+{
+    size_t len;
+
+    len = snprintf( path, HISTORY_LOG_PATH_LEN, "%s/", dir );
+    for( ; *room_name && len + 4 < HISTORY_LOG_PATH_LEN; room_name++ )
+    {
+        if( isalnum( (unsigned char)*room_name ) )
+            path[ len++ ] = *room_name;
+        else
+            len += sprintf( path + len, "%%%02X", (unsigned char)*room_name );
+    }
+    snprintf( path + len, HISTORY_LOG_PATH_LEN - len, "%s", ext );
+}
+
+static uint64_t record_size( const history_record_t *record )
+{
+    return sizeof( history_record_t ) + record->name_len + record->msg_len;
+}
+
+// Copy out the header of the record at offset (records are not aligned) and
+// return its name and message bytes, or NULL if the log ends (or is torn)
+// before the record does.
+static const char *record_at( const char *map, uint64_t map_base, uint64_t offset, uint64_t size, history_record_t *record )
+{
+    if( offset + sizeof( history_record_t ) > size )
+        return NULL;
+
+    memcpy( record, map + ( offset - map_base ), sizeof( history_record_t ) );
+    if( record->name_len > HISTORY_LOG_MAX_NAME || record->msg_len > HISTORY_LOG_MAX_MSG ||
+        offset + record_size( record ) > size )
+        return NULL;
+
+    return map + ( offset - map_base ) + sizeof( history_record_t );
+}
+
+static int read_index( history_log_t *log, uint64_t entry, uint64_t *offset )
+{
+    if( pread( log->index_fd, offset, sizeof( *offset ), entry * sizeof( *offset ) ) != sizeof( *offset ) )
+        return HISTORY_LOG_ERR;
+
+    return HISTORY_LOG_OK;
+}
+
+static int write_index( history_log_t *log, uint64_t entry, uint64_t offset )
+{
+    if( pwrite( log->index_fd, &offset, sizeof( offset ), entry * sizeof( offset ) ) != sizeof( offset ) )
+        return HISTORY_LOG_ERR;
+
+    return HISTORY_LOG_OK;
+}
+
+// Map the log from the page holding offset to size.  Returns the mapping and
+// sets base to the file offset it starts at.
+static char *map_log( history_log_t *log, uint64_t offset, uint64_t size, uint64_t *base )
+{
+    char *map;
+
+    *base = offset & ~( (uint64_t)sysconf( _SC_PAGESIZE ) - 1 );
+    if( size == *base )
+        return NULL;
+
+    map = mmap( NULL, size - *base, PROT_READ, MAP_SHARED, log->fd, *base );
+    if( map == MAP_FAILED )
+        return NULL;
+
+    return map;
+}
+
+// Open (creating if needed) the log and index of a room.  Only the records past
+// the last index entry are scanned: they are counted, indexed if the index fell
+// behind, and a record torn by a crash is cut off.
+int history_log_open( history_log_t *log, const char *dir, const char *room_name )
+{
+    char path[ HISTORY_LOG_PATH_LEN ];
+    struct stat st;
+    uint64_t entries;
+    uint64_t offset = 0;
+    uint64_t prev = 0;
+    uint64_t base;
+    uint64_t record_num;
+    history_record_t record;
+    char *map;
+
+    log->fd = -1;
+    log->index_fd = -1;
+    log->count = 0;
+    log->size = 0;
+
+    log_path( path, dir, room_name, ".log" );
+    log->fd = open( path, O_RDWR | O_CREAT | O_APPEND, 0644 );
+    if( log->fd < 0 || fstat( log->fd, &st ) < 0 )
+        goto fail;
+    log->size = st.st_size;
+
+    log_path( path, dir, room_name, ".idx" );
+    log->index_fd = open( path, O_RDWR | O_CREAT, 0644 );
+    if( log->index_fd < 0 || fstat( log->index_fd, &st ) < 0 )
+        goto fail;
+
+    // trust index entries only while they increase and lie inside the log
+    for( entries = 0; entries < st.st_size / sizeof( uint64_t ); entries++ )
+    {
+        if( read_index( log, entries, &offset ) != HISTORY_LOG_OK ||
+            offset >= log->size || ( entries > 0 && offset <= prev ) )
+            break;
+        prev = offset;
+    }
+    if( entries == 0 )
+        prev = 0;
+    ftruncate( log->index_fd, entries * sizeof( uint64_t ) );
+
+    // walk the unindexed tail
+    record_num = entries > 0 ? ( entries - 1 ) * HISTORY_LOG_INTERVAL : 0;
+    offset = prev;
+    map = map_log( log, offset, log->size, &base );
+    while( map != NULL && record_at( map, base, offset, log->size, &record ) != NULL )
+    {
+        if( record_num % HISTORY_LOG_INTERVAL == 0 && record_num / HISTORY_LOG_INTERVAL >= entries )
+            write_index( log, record_num / HISTORY_LOG_INTERVAL, offset );
+
+        offset += record_size( &record );
+        record_num++;
+    }
+    if( map != NULL )
+        munmap( map, log->size - base );
+
+    if( offset < log->size )
+    {
+        ftruncate( log->fd, offset );
+        log->size = offset;
+    }
+    log->count = record_num;
+
+    return HISTORY_LOG_OK;
+
+fail:
+    history_log_close( log );
+    return HISTORY_LOG_ERR;
+}
+
+void history_log_close( history_log_t *log )
+{
+    if( log->fd >= 0 )
+        close( log->fd );
+    if( log->index_fd >= 0 )
+        close( log->index_fd );
+
+    log->fd = -1;
+    log->index_fd = -1;
+}
+
+// Append one record with a single write, indexing it if it starts an interval
+int history_log_append( history_log_t *log, time_t time, const char *sender, const char *message, size_t len )
+{
+    history_record_t record;
+    struct iovec iov[ 3 ];
+    size_t size;
+
+    if( log->fd < 0 )
+        return HISTORY_LOG_ERR;
+
+    record.name_len = strnlen( sender, HISTORY_LOG_MAX_NAME );
+    record.msg_len  = len < HISTORY_LOG_MAX_MSG ? len : HISTORY_LOG_MAX_MSG;
+    record.time     = time;
+    size = record_size( &record );
+
+    iov[ 0 ].iov_base = &record;
+    iov[ 0 ].iov_len  = sizeof( record );
+    iov[ 1 ].iov_base = (void *)sender;
+    iov[ 1 ].iov_len  = record.name_len;
+    iov[ 2 ].iov_base = (void *)message;
+    iov[ 2 ].iov_len  = record.msg_len;
+
+    if( log->count % HISTORY_LOG_INTERVAL == 0 )
+        write_index( log, log->count / HISTORY_LOG_INTERVAL, log->size );
+
+    if( writev( log->fd, iov, 3 ) != (ssize_t)size )
+    {
+        // drop a partial record so the next append starts on a boundary
+        ftruncate( log->fd, log->size );
+        return HISTORY_LOG_ERR;
+    }
+
+    log->size += size;
+    log->count++;
+
+    return HISTORY_LOG_OK;
+}
+
+// Add the newest lines of the log to history, oldest first.  The index gives the
+// offset of the interval holding the first wanted record, so at most
+// HISTORY_LOG_INTERVAL - 1 records are skipped before copying starts.
+int history_log_read( history_log_t *log, history_t *history, int lines )
+{
+    uint64_t first;
+    uint64_t offset;
+    uint64_t base;
+    uint64_t record_num;
+    history_record_t record;
+    const char *data;
+    char name[ HISTORY_LOG_MAX_NAME + 1 ];
+    char *map;
+    int result = HISTORY_LOG_OK;
+
+    if( log->fd < 0 || log->count == 0 || lines <= 0 )
+        return log->fd < 0 ? HISTORY_LOG_ERR : HISTORY_LOG_OK;
+
+    first = log->count > (uint64_t)lines ? log->count - lines : 0;
+    record_num = first - first % HISTORY_LOG_INTERVAL;
+    if( read_index( log, record_num / HISTORY_LOG_INTERVAL, &offset ) != HISTORY_LOG_OK )
+        return HISTORY_LOG_ERR;
+
+    map = map_log( log, offset, log->size, &base );
+    if( map == NULL )
+        return HISTORY_LOG_ERR;
+
+    for( ; record_num < log->count; record_num++ )
+    {
+        data = record_at( map, base, offset, log->size, &record );
+        if( data == NULL )
+        {
+            result = HISTORY_LOG_ERR;
+            break;
+        }
+
+        if( record_num >= first )
+        {
+            memcpy( name, data, record.name_len );
+            name[ record.name_len ] = '\0';
+
+            if( history_append( history, record.time, intern_name( name ),
+                                data + record.name_len, record.msg_len ) != HISTORY_OK )
+            {
+                result = HISTORY_LOG_ERR;
+                break;
+            }
+        }
+
+        offset += record_size( &record );
+    }
+
+    munmap( map, log->size - base );
+
+    return result;
+}
@@ -0,0 +1,63 @@
+/*===========================================================================
+ Filename    : history_log.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Persistent chat room history.  Each room appends its lines
+               to its own log file, and a sparse index of record offsets
+               lets the newest lines be read back without scanning the log.
+===========================================================================*/
+
+#ifndef HISTORY_LOG_H_
+#define HISTORY_LOG_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "history.h"
+
+
+#define HISTORY_LOG_OK          0
+#define HISTORY_LOG_ERR         ( -1 )
+#define HISTORY_LOG_INTERVAL    64              /* records between index entries */
+#define HISTORY_LOG_MAX_NAME    255             /* longest sender name a record can hold */
+#define HISTORY_LOG_MAX_MSG     65535           /* longest message a record can hold */
+#define HISTORY_LOG_PATH_LEN    512
+
+
+// On disk a record is this header followed by the sender name and the message,
+// neither terminated.  The index file is an array of uint64_t offsets, entry k
+// being the offset of record k * HISTORY_LOG_INTERVAL.
+typedef struct history_record_t
+{
+    uint32_t    name_len;
+    uint32_t    msg_len;
+    int64_t     time;
+} history_record_t;
+
+typedef struct history_log_t
+{
+    int         fd;                             /* log file, -1 if the room is not logged */
+    int         index_fd;
+    uint64_t    count;                          /* complete records in the log */
+    uint64_t    size;                           /* bytes of complete records */
+} history_log_t;
+
+
+// prototypes
+int history_log_open( history_log_t *log, const char *dir, const char *room_name );
+void history_log_close( history_log_t *log );
+int history_log_append( history_log_t *log, time_t time, const char *sender, const char *message, size_t len );
+int history_log_read( history_log_t *log, history_t *history, int lines );    /* newest lines into history */
+
+
+#endif /* HISTORY_LOG_H_ */
@@ -0,0 +1,116 @@
+/*===========================================================================
+ Filename    : intern.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : User name interning.  Every distinct (case-insensitive) name
+               gets a small integer id that stays valid for the life of the
+               process, so hot paths compare ids instead of strings.
+===========================================================================*/
+
+#include "intern.h"
+
+
+static hash_map_t       intern_index;           /* folded name -> id + 1 */
+static pthread_mutex_t  intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static int              intern_count;
+
+// id -> name and owner, in pages that never move so readers need no lock
+static intern_entry_t  *intern_pages[ INTERN_MAX_PAGES ];
+
+
+int init_intern( void )
+{
+    return hash_map_init( &intern_index, true );
+}
+
+int intern_lookup( const char *name )
+{
+    // ids are stored off by one so that id 0 is not mistaken for "not found"
+    return (int)(intptr_t)hash_map_get( &intern_index, name ) - 1;
+}
+
+int intern_name( const char *name )
+{
+    int             id;
+    intern_entry_t *page;
+    char           *copy;
+
+    id = intern_lookup( name );
+    if( id != INTERN_NONE )
+        return id;
+
+    pthread_mutex_lock( &intern_lock );
+
+    // somebody may have interned it while we waited
+    id = intern_lookup( name );
+    if( id == INTERN_NONE && intern_count < INTERN_MAX_PAGES * INTERN_PAGE_SIZE )
+    {
+        page = intern_pages[ intern_count >> INTERN_PAGE_BITS ];
+        if( page == NULL )
+        {
+            page = calloc( INTERN_PAGE_SIZE, sizeof( intern_entry_t ) );
+            intern_pages[ intern_count >> INTERN_PAGE_BITS ] = page;
+        }
+
+        copy = strdup( name );
+        if( page != NULL && copy != NULL )
+        {
+            id = intern_count;
+            page[ id & ( INTERN_PAGE_SIZE - 1 ) ].name = copy;
+
+            // publish the name before the id can be found
+            if( hash_map_put( &intern_index, copy, (void *)(intptr_t)( id + 1 ) ) == HASH_MAP_OK )
+                intern_count++;
+            else
+            {
+                free( copy );
+                id = INTERN_NONE;
+            }
+        }
+        else
+            free( copy );
+    }
+
+    pthread_mutex_unlock( &intern_lock );
+
+    return id;
+}
+
+static intern_entry_t *intern_entry( int id )
+{
+    if( id < 0 || id >= INTERN_MAX_PAGES * INTERN_PAGE_SIZE || intern_pages[ id >> INTERN_PAGE_BITS ] == NULL )
+        return NULL;
+
+    return &intern_pages[ id >> INTERN_PAGE_BITS ][ id & ( INTERN_PAGE_SIZE - 1 ) ];
+}
+
+const char *interned_name( int id )
+{
+    intern_entry_t *entry = intern_entry( id );
+
+    if( entry == NULL || entry->name == NULL )
+        return "";
+
+    return entry->name;
+}
+
+// attach whatever currently goes by this name (NULL detaches)
+void intern_set_owner( int id, void *owner )
+{
+    intern_entry_t *entry = intern_entry( id );
+
+    if( entry != NULL )
+        __atomic_store_n( &entry->owner, owner, __ATOMIC_RELEASE );
+}
+
+void *intern_owner( int id )
+{
+    intern_entry_t *entry = intern_entry( id );
+
+    if( entry == NULL )
+        return NULL;
+
+    return __atomic_load_n( &entry->owner, __ATOMIC_ACQUIRE );
+}
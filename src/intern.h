@@ -0,0 +1,43 @@
+/*===========================================================================
+ Filename    : intern.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : User name interning.  Every distinct (case-insensitive) name
+               gets a small integer id that stays valid for the life of the
+               process, so hot paths compare ids instead of strings.
+===========================================================================*/
+
+#ifndef INTERN_H_
+#define INTERN_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hash_map.h"
+
+
+#define INTERN_NONE         ( -1 )              /* name has never been interned */
+#define INTERN_PAGE_BITS    12                  /* names per page = 4096 */
+#define INTERN_PAGE_SIZE    ( 1 << INTERN_PAGE_BITS )
+#define INTERN_MAX_PAGES    1024                /* up to 4M distinct names */
+
+
+typedef struct intern_entry_t
+{
+    char       *name;                           /* name as first interned */
+    void       *owner;                          /* who holds the name now, NULL if nobody */
+} intern_entry_t;
+
+
+// prototypes
+int init_intern( void );
+int intern_name( const char *name );            /* id for name, assigned on first use */
+int intern_lookup( const char *name );          /* id for name or INTERN_NONE, never assigns */
+const char *interned_name( int id );            /* name as first interned */
+void intern_set_owner( int id, void *owner );
+void *intern_owner( int id );                   /* owner for id, NULL if none */
+
+
+#endif /* INTERN_H_ */
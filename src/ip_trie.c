@@ -0,0 +1,345 @@
+/*===========================================================================
+ Filename    : ip_trie.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Longest-prefix match over IPv4 and IPv6 addresses and CIDR
+               ranges.  A path-compressed binary radix trie: readers walk it
+               without locks inside epoch_enter()/epoch_exit(), writers are
+               serialized and publish each change with one pointer store.
+===========================================================================*/
+
+#include "ip_trie.h"
+
+
+// IPv4 addresses sit under ::ffff:0:0/96
+static const uint8_t v4_mapped[ IP_V4_MAPPED_BITS / 8 ] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+
+// bit i of an address, counting from the most significant
+static int prefix_bit( const uint8_t *addr, int i )
+{
+    return ( addr[ i >> 3 ] >> ( 7 - ( i & 7 ) ) ) & 1;
+}
+
+// clear the bits past len
+static void prefix_mask( ip_prefix_t *prefix )
+{
+    int byte = prefix->len >> 3;
+
+    if( prefix->len & 7 )
+        prefix->addr[ byte++ ] &= 0xff << ( 8 - ( prefix->len & 7 ) );
+
+    memset( prefix->addr + byte, 0, sizeof( prefix->addr ) - byte );
+}
+
+// leading bits a and b have in common, at most max; bits before from are
+// already known to match
+static int common_bits( const uint8_t *a, const uint8_t *b, int from, int max )
+{
+    int     i;
+    uint8_t diff;
+
+    for( i = from & ~7; i < max; i += 8 )
+    {
+        diff = a[ i >> 3 ] ^ b[ i >> 3 ];
+        if( diff != 0 )
+        {
+            i += __builtin_clz( diff ) - 24;
+            break;
+        }
+    }
+
+    return i < max ? i : max;
+}
+
+int ip_prefix_parse( const char *text, ip_prefix_t *prefix )
+{
+    char            addr_text[ INET6_ADDRSTRLEN ];
+    const char     *slash = strchr( text, '/' );
+    size_t          addr_len = ( slash != NULL ) ? (size_t)( slash - text ) : strlen( text );
+    struct in_addr  v4;
+    char           *end;
+    long            bits;
+    int             max;
+
+    if( addr_len == 0 || addr_len >= sizeof( addr_text ) )
+        return IP_TRIE_INVALID;
+
+    memcpy( addr_text, text, addr_len );
+    addr_text[ addr_len ] = '\0';
+    memset( prefix, 0, sizeof( ip_prefix_t ) );
+
+    if( inet_pton( AF_INET, addr_text, &v4 ) == 1 )
+    {
+        memcpy( prefix->addr, v4_mapped, sizeof( v4_mapped ) );
+        memcpy( prefix->addr + sizeof( v4_mapped ), &v4, sizeof( v4 ) );
+        max = IP_ADDR_BITS - IP_V4_MAPPED_BITS;
+    }
+    else if( inet_pton( AF_INET6, addr_text, prefix->addr ) == 1 )
+        max = IP_ADDR_BITS;
+    else
+        return IP_TRIE_INVALID;
+
+    bits = max;
+    if( slash != NULL )
+    {
+        bits = strtol( slash + 1, &end, 10 );
+        if( slash[ 1 ] == '\0' || *end != '\0' || bits < 0 || bits > max )
+            return IP_TRIE_INVALID;
+    }
+
+    prefix->len = IP_ADDR_BITS - max + bits;
+    prefix_mask( prefix );
+
+    return IP_TRIE_OK;
+}
+
+void ip_prefix_from_in_addr( struct in_addr addr, ip_prefix_t *prefix )
+{
+    memcpy( prefix->addr, v4_mapped, sizeof( v4_mapped ) );
+    memcpy( prefix->addr + sizeof( v4_mapped ), &addr, sizeof( addr ) );
+    prefix->len = IP_ADDR_BITS;
+}
+
+// IPv4 ranges are written the IPv4 way, a single address without "/bits"
+void ip_prefix_format( const ip_prefix_t *prefix, char *text, size_t size )
+{
+    char    addr_text[ INET6_ADDRSTRLEN ];
+    int     bits = prefix->len;
+    int     max = IP_ADDR_BITS;
+
+    if( prefix->len >= IP_V4_MAPPED_BITS && memcmp( prefix->addr, v4_mapped, sizeof( v4_mapped ) ) == 0 )
+    {
+        inet_ntop( AF_INET, prefix->addr + sizeof( v4_mapped ), addr_text, sizeof( addr_text ) );
+        bits -= IP_V4_MAPPED_BITS;
+        max -= IP_V4_MAPPED_BITS;
+    }
+    else
+        inet_ntop( AF_INET6, prefix->addr, addr_text, sizeof( addr_text ) );
+
+    if( bits == max )
+        snprintf( text, size, "%s", addr_text );
+    else
+        snprintf( text, size, "%s/%d", addr_text, bits );
+}
+
+bool ip_prefix_contains( const ip_prefix_t *range, const ip_prefix_t *addr )
+{
+    return range->len <= addr->len && common_bits( range->addr, addr->addr, 0, range->len ) == range->len;
+}
+
+int ip_trie_init( ip_trie_t *trie )
+{
+    trie->root = NULL;
+    trie->count = 0;
+
+    return pthread_mutex_init( &trie->lock, NULL ) == 0 ? IP_TRIE_OK : IP_TRIE_NO_MEMORY;
+}
+
+// a node for the first len bits of prefix
+static ip_trie_node_t *new_node( const ip_prefix_t *prefix, int len, void *value )
+{
+    ip_trie_node_t *node = malloc( sizeof( ip_trie_node_t ) );
+
+    if( node == NULL )
+        return NULL;
+
+    node->prefix = *prefix;
+    node->prefix.len = len;
+    prefix_mask( &node->prefix );
+    node->value = value;
+    node->child[ 0 ] = NULL;
+    node->child[ 1 ] = NULL;
+
+    return node;
+}
+
+// A new node is filled in completely before the store that links it, so a
+// reader sees the trie either without it or with it.
+int ip_trie_insert( ip_trie_t *trie, const ip_prefix_t *prefix, void *value, void **old_value )
+{
+    ip_trie_node_t **link = &trie->root;
+    ip_trie_node_t  *node;
+    ip_trie_node_t  *leaf;
+    ip_trie_node_t  *branch;
+    int              common;
+    int              result = IP_TRIE_OK;
+
+    *old_value = NULL;
+
+    pthread_mutex_lock( &trie->lock );
+
+    while( ( node = *link ) != NULL )
+    {
+        common = common_bits( node->prefix.addr, prefix->addr, 0,
+                              node->prefix.len < prefix->len ? node->prefix.len : prefix->len );
+
+        // node is a proper prefix of the new one, keep going down
+        if( common == node->prefix.len && common < prefix->len )
+        {
+            link = &node->child[ prefix_bit( prefix->addr, common ) ];
+            continue;
+        }
+
+        // the prefix already has a node, replace its value
+        if( common == node->prefix.len )
+        {
+            *old_value = node->value;
+            if( *old_value == NULL )
+                __atomic_add_fetch( &trie->count, 1, __ATOMIC_RELAXED );
+            __atomic_store_n( &node->value, value, __ATOMIC_RELEASE );
+            pthread_mutex_unlock( &trie->lock );
+            return IP_TRIE_OK;
+        }
+
+        break;
+    }
+
+    if( node == NULL )
+    {
+        // first prefix down this path
+        leaf = new_node( prefix, prefix->len, value );
+        if( leaf == NULL )
+            result = IP_TRIE_NO_MEMORY;
+        else
+            __atomic_store_n( link, leaf, __ATOMIC_RELEASE );
+    }
+    else if( common == prefix->len )
+    {
+        // the new prefix covers node
+        leaf = new_node( prefix, prefix->len, value );
+        if( leaf == NULL )
+            result = IP_TRIE_NO_MEMORY;
+        else
+        {
+            leaf->child[ prefix_bit( node->prefix.addr, common ) ] = node;
+            __atomic_store_n( link, leaf, __ATOMIC_RELEASE );
+        }
+    }
+    else
+    {
+        // node and the new prefix part ways at bit common
+        leaf = new_node( prefix, prefix->len, value );
+        branch = new_node( prefix, common, NULL );
+        if( leaf == NULL || branch == NULL )
+        {
+            free( leaf );
+            free( branch );
+            result = IP_TRIE_NO_MEMORY;
+        }
+        else
+        {
+            branch->child[ prefix_bit( prefix->addr, common ) ] = leaf;
+            branch->child[ prefix_bit( node->prefix.addr, common ) ] = node;
+            __atomic_store_n( link, branch, __ATOMIC_RELEASE );
+        }
+    }
+
+    if( result == IP_TRIE_OK )
+        __atomic_add_fetch( &trie->count, 1, __ATOMIC_RELAXED );
+
+    pthread_mutex_unlock( &trie->lock );
+
+    return result;
+}
+
+// Replace a node that holds no prefix and no longer branches by its child.
+// Readers already on the node still find valid children below it.
+static void prune( ip_trie_node_t **link )
+{
+    ip_trie_node_t *node = *link;
+
+    if( node->value != NULL || ( node->child[ 0 ] != NULL && node->child[ 1 ] != NULL ) )
+        return;
+
+    __atomic_store_n( link, node->child[ 0 ] != NULL ? node->child[ 0 ] : node->child[ 1 ], __ATOMIC_RELEASE );
+    epoch_retire( node, free );
+}
+
+void *ip_trie_remove( ip_trie_t *trie, const ip_prefix_t *prefix )
+{
+    ip_trie_node_t **link = &trie->root;
+    ip_trie_node_t **parent_link = NULL;
+    ip_trie_node_t  *node;
+    void            *value = NULL;
+
+    pthread_mutex_lock( &trie->lock );
+
+    while( ( node = *link ) != NULL && node->prefix.len < prefix->len &&
+           common_bits( node->prefix.addr, prefix->addr, 0, node->prefix.len ) == node->prefix.len )
+    {
+        parent_link = link;
+        link = &node->child[ prefix_bit( prefix->addr, node->prefix.len ) ];
+    }
+
+    if( node != NULL && node->prefix.len == prefix->len && node->value != NULL &&
+        memcmp( node->prefix.addr, prefix->addr, sizeof( prefix->addr ) ) == 0 )
+    {
+        value = node->value;
+        __atomic_store_n( &node->value, NULL, __ATOMIC_RELEASE );
+        __atomic_sub_fetch( &trie->count, 1, __ATOMIC_RELAXED );
+
+        // only the node and its parent can have stopped branching
+        prune( link );
+        if( parent_link != NULL )
+            prune( parent_link );
+    }
+
+    pthread_mutex_unlock( &trie->lock );
+
+    return value;
+}
+
+// Walks down the one path addr can be on, so the cost is bounded by the
+// prefix length whatever the number of entries.
+void *ip_trie_lookup( ip_trie_t *trie, const ip_prefix_t *addr )
+{
+    ip_trie_node_t *node = __atomic_load_n( &trie->root, __ATOMIC_ACQUIRE );
+    void           *best = NULL;
+    void           *value;
+    int             checked = 0;
+
+    while( node != NULL && node->prefix.len <= addr->len &&
+           common_bits( node->prefix.addr, addr->addr, checked, node->prefix.len ) == node->prefix.len )
+    {
+        value = __atomic_load_n( &node->value, __ATOMIC_ACQUIRE );
+        if( value != NULL )
+            best = value;
+
+        if( node->prefix.len == addr->len )
+            break;
+
+        checked = node->prefix.len;
+        node = __atomic_load_n( &node->child[ prefix_bit( addr->addr, checked ) ], __ATOMIC_ACQUIRE );
+    }
+
+    return best;
+}
+
+static void walk_node( ip_trie_node_t *node, void (*visit)( void *value, void *arg ), void *arg )
+{
+    void *value;
+
+    if( node == NULL )
+        return;
+
+    value = __atomic_load_n( &node->value, __ATOMIC_ACQUIRE );
+    if( value != NULL )
+        visit( value, arg );
+
+    walk_node( __atomic_load_n( &node->child[ 0 ], __ATOMIC_ACQUIRE ), visit, arg );
+    walk_node( __atomic_load_n( &node->child[ 1 ], __ATOMIC_ACQUIRE ), visit, arg );
+}
+
+// every value in address order
+void ip_trie_walk( ip_trie_t *trie, void (*visit)( void *value, void *arg ), void *arg )
+{
+    walk_node( __atomic_load_n( &trie->root, __ATOMIC_ACQUIRE ), visit, arg );
+}
+
+size_t ip_trie_count( ip_trie_t *trie )
+{
+    return __atomic_load_n( &trie->count, __ATOMIC_RELAXED );
+}
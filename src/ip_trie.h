@@ -0,0 +1,71 @@
+/*===========================================================================
+ Filename    : ip_trie.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Longest-prefix match over IPv4 and IPv6 addresses and CIDR
+               ranges.  A path-compressed binary radix trie: readers walk it
+               without locks inside epoch_enter()/epoch_exit(), writers are
+               serialized and publish each change with one pointer store.
+===========================================================================*/
+
+#ifndef IP_TRIE_H_
+#define IP_TRIE_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <arpa/inet.h>      /*  inet_pton(), inet_ntop()  */
+#include "epoch.h"          /*  lock-free read sections   */
+
+
+#define IP_TRIE_OK          0
+#define IP_TRIE_NO_MEMORY   ( -1 )
+#define IP_TRIE_INVALID     ( -2 )              /* text is not an address or range */
+
+#define IP_ADDR_BITS        128                 /* IPv4 is kept as ::ffff:a.b.c.d */
+#define IP_V4_MAPPED_BITS   96
+#define IP_PREFIX_TEXT_SIZE ( INET6_ADDRSTRLEN + 4 )    /* address, '/' and bits */
+
+
+// an address (len 128) or a range of addresses sharing the first len bits
+typedef struct ip_prefix_t
+{
+    uint8_t                 addr[ IP_ADDR_BITS / 8 ];   /* bits past len are zero */
+    int                     len;
+} ip_prefix_t;
+
+typedef struct ip_trie_node_t
+{
+    ip_prefix_t             prefix;             /* bits shared by everything below this node */
+    void                   *value;              /* set if the prefix itself is in the trie */
+    struct ip_trie_node_t  *child[ 2 ];         /* by the bit following the prefix */
+} ip_trie_node_t;
+
+typedef struct ip_trie_t
+{
+    ip_trie_node_t         *root;
+    size_t                  count;              /* prefixes with a value */
+    pthread_mutex_t         lock;               /* writers only */
+} ip_trie_t;
+
+
+// prototypes
+int ip_prefix_parse( const char *text, ip_prefix_t *prefix );  /* "a.b.c.d[/bits]" or IPv6[/bits] */
+void ip_prefix_from_in_addr( struct in_addr addr, ip_prefix_t *prefix );
+void ip_prefix_format( const ip_prefix_t *prefix, char *text, size_t size );
+bool ip_prefix_contains( const ip_prefix_t *range, const ip_prefix_t *addr );
+
+int ip_trie_init( ip_trie_t *trie );
+int ip_trie_insert( ip_trie_t *trie, const ip_prefix_t *prefix, void *value, void **old_value );  /* replaces, returns old value */
+void *ip_trie_remove( ip_trie_t *trie, const ip_prefix_t *prefix );     /* value removed, NULL if none */
+void *ip_trie_lookup( ip_trie_t *trie, const ip_prefix_t *addr );       /* longest match, inside epoch_enter() */
+void ip_trie_walk( ip_trie_t *trie, void (*visit)( void *value, void *arg ), void *arg );  /* inside epoch_enter() */
+size_t ip_trie_count( ip_trie_t *trie );
+
+
+#endif /* IP_TRIE_H_ */
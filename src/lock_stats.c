@@ -0,0 +1,247 @@
+/*===========================================================================
+ Filename    : lock_stats.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Lock wait and hold times.  A stat_sem_t is a binary semaphore
+               that, with LOCK_STATS defined, measures how long threads wait
+               for it and hold it, per lock and per class of lock.  Without
+               LOCK_STATS it is a plain sem_t and every call is the sem_*
+               call it wraps.
+===========================================================================*/
+
+#include "lock_stats.h"
+
+#ifdef LOCK_STATS
+
+static lock_instance_t *locks;                  /* every live lock */
+static lock_class_t *classes;                   /* every class a lock was made in */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long reset_generation;          /* resets so far */
+
+
+// Counters are only changed by the lock's holder, the report reads them
+// without taking the lock
+static void count_add( uint64_t *counter, uint64_t n )
+{
+    __atomic_store_n( counter, __atomic_load_n( counter, __ATOMIC_RELAXED ) + n, __ATOMIC_RELAXED );
+}
+
+static void count_max( uint64_t *counter, uint64_t value )
+{
+    if( value > __atomic_load_n( counter, __ATOMIC_RELAXED ) )
+        __atomic_store_n( counter, value, __ATOMIC_RELAXED );
+}
+
+static void counts_read( lock_counts_t *sum, lock_counts_t *counts )
+{
+    sum->acquisitions += __atomic_load_n( &counts->acquisitions, __ATOMIC_RELAXED );
+    sum->contended += __atomic_load_n( &counts->contended, __ATOMIC_RELAXED );
+    sum->wait_ns += __atomic_load_n( &counts->wait_ns, __ATOMIC_RELAXED );
+    sum->hold_ns += __atomic_load_n( &counts->hold_ns, __ATOMIC_RELAXED );
+    count_max( &sum->max_wait_ns, __atomic_load_n( &counts->max_wait_ns, __ATOMIC_RELAXED ) );
+    count_max( &sum->max_hold_ns, __atomic_load_n( &counts->max_hold_ns, __ATOMIC_RELAXED ) );
+}
+
+// Counts of a lock not taken since the last reset are stale and read as zero
+static void instance_read( lock_counts_t *sum, lock_instance_t *stats )
+{
+    if( __atomic_load_n( &stats->generation, __ATOMIC_ACQUIRE ) == __atomic_load_n( &reset_generation, __ATOMIC_RELAXED ) )
+        counts_read( sum, &stats->counts );
+}
+
+static void counts_clear( lock_counts_t *counts )
+{
+    __atomic_store_n( &counts->acquisitions, 0, __ATOMIC_RELAXED );
+    __atomic_store_n( &counts->contended, 0, __ATOMIC_RELAXED );
+    __atomic_store_n( &counts->wait_ns, 0, __ATOMIC_RELAXED );
+    __atomic_store_n( &counts->max_wait_ns, 0, __ATOMIC_RELAXED );
+    __atomic_store_n( &counts->hold_ns, 0, __ATOMIC_RELAXED );
+    __atomic_store_n( &counts->max_hold_ns, 0, __ATOMIC_RELAXED );
+}
+
+void lock_stats_init( stat_sem_t *lock, lock_class_t *lock_class, const char *label, ... )
+{
+    lock_instance_t *stats = &lock->stats;
+    va_list ap;
+
+    sem_init( &lock->sem, 0, 1 );
+
+    stats->lock_class = lock_class;
+    counts_clear( &stats->counts );
+    stats->generation = __atomic_load_n( &reset_generation, __ATOMIC_RELAXED );
+
+    va_start( ap, label );
+    vsnprintf( stats->label, LOCK_LABEL_SIZE, label, ap );
+    va_end( ap );
+
+    pthread_mutex_lock( &registry_mutex );
+
+    if( !lock_class->registered )
+    {
+        lock_class->registered = true;
+        lock_class->next = classes;
+        classes = lock_class;
+    }
+
+    if( !stats->registered )
+    {
+        stats->registered = true;
+        stats->prev = NULL;
+        stats->next = locks;
+        if( locks != NULL )
+            locks->prev = stats;
+        locks = stats;
+    }
+
+    pthread_mutex_unlock( &registry_mutex );
+}
+
+// Try first, so a lock that is free costs no clock read for the wait
+void lock_stats_wait( stat_sem_t *lock )
+{
+    lock_counts_t *counts = &lock->stats.counts;
+    uint64_t start_ns = 0;
+    uint64_t now_ns;
+    unsigned long generation;
+
+    if( sem_trywait( &lock->sem ) != 0 )
+    {
+        start_ns = timestamp_mono_ns();
+        sem_wait( &lock->sem );
+    }
+
+    now_ns = timestamp_mono_ns();
+    lock->stats.acquired_ns = now_ns;
+
+    // a reset only moves the generation on, the holder clears its own counts
+    generation = __atomic_load_n( &reset_generation, __ATOMIC_RELAXED );
+    if( lock->stats.generation != generation )
+    {
+        counts_clear( counts );
+        __atomic_store_n( &lock->stats.generation, generation, __ATOMIC_RELEASE );
+    }
+
+    count_add( &counts->acquisitions, 1 );
+    if( start_ns != 0 )
+    {
+        count_add( &counts->contended, 1 );
+        count_add( &counts->wait_ns, now_ns - start_ns );
+        count_max( &counts->max_wait_ns, now_ns - start_ns );
+    }
+}
+
+void lock_stats_post( stat_sem_t *lock )
+{
+    lock_counts_t *counts = &lock->stats.counts;
+    uint64_t hold_ns = timestamp_mono_ns() - lock->stats.acquired_ns;
+
+    count_add( &counts->hold_ns, hold_ns );
+    count_max( &counts->max_hold_ns, hold_ns );
+
+    sem_post( &lock->sem );
+}
+
+// what the lock counted stays with its class
+void lock_stats_destroy( stat_sem_t *lock )
+{
+    lock_instance_t *stats = &lock->stats;
+
+    pthread_mutex_lock( &registry_mutex );
+
+    instance_read( &stats->lock_class->retired, stats );
+
+    if( stats->registered )
+    {
+        stats->registered = false;
+        if( stats->prev != NULL )
+            stats->prev->next = stats->next;
+        else
+            locks = stats->next;
+        if( stats->next != NULL )
+            stats->next->prev = stats->prev;
+    }
+
+    pthread_mutex_unlock( &registry_mutex );
+
+    sem_destroy( &lock->sem );
+}
+
+int lock_stats_classes( lock_report_t *report, int max )
+{
+    lock_class_t *lock_class;
+    lock_instance_t *stats;
+    int count = 0;
+
+    pthread_mutex_lock( &registry_mutex );
+
+    for( lock_class = classes; lock_class != NULL && count < max; lock_class = lock_class->next, count++ )
+    {
+        snprintf( report[ count ].name, sizeof( report[ count ].name ), "%s", lock_class->name );
+        memset( &report[ count ].counts, 0, sizeof( lock_counts_t ) );
+        counts_read( &report[ count ].counts, &lock_class->retired );
+
+        for( stats = locks; stats != NULL; stats = stats->next )
+            if( stats->lock_class == lock_class )
+                instance_read( &report[ count ].counts, stats );
+    }
+
+    pthread_mutex_unlock( &registry_mutex );
+
+    return count;
+}
+
+// kept sorted by total wait while the registry is scanned
+int lock_stats_top( lock_report_t *report, int max )
+{
+    lock_instance_t *stats;
+    lock_counts_t counts;
+    int count = 0;
+    int i;
+
+    pthread_mutex_lock( &registry_mutex );
+
+    for( stats = locks; stats != NULL; stats = stats->next )
+    {
+        memset( &counts, 0, sizeof( counts ) );
+        instance_read( &counts, stats );
+        if( counts.wait_ns == 0 )
+            continue;
+
+        for( i = count; i > 0 && report[ i - 1 ].counts.wait_ns < counts.wait_ns; i-- )
+            if( i < max )
+                report[ i ] = report[ i - 1 ];
+
+        if( i < max )
+        {
+            snprintf( report[ i ].name, sizeof( report[ i ].name ), "%s %s", stats->lock_class->name, stats->label );
+            report[ i ].counts = counts;
+            if( count < max )
+                count++;
+        }
+    }
+
+    pthread_mutex_unlock( &registry_mutex );
+
+    return count;
+}
+
+// Clearing a live lock's counts here would race with its holder adding to
+// them, so the holder clears them itself when it next takes the lock.
+// Until then the report skips them.
+void lock_stats_reset( void )
+{
+    lock_class_t *lock_class;
+
+    pthread_mutex_lock( &registry_mutex );
+
+    for( lock_class = classes; lock_class != NULL; lock_class = lock_class->next )
+        memset( &lock_class->retired, 0, sizeof( lock_counts_t ) );
+
+    __atomic_add_fetch( &reset_generation, 1, __ATOMIC_RELAXED );
+
+    pthread_mutex_unlock( &registry_mutex );
+}
+
+#endif /* LOCK_STATS */
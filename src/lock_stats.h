@@ -0,0 +1,109 @@
+/*===========================================================================
+ Filename    : lock_stats.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Lock wait and hold times.  A stat_sem_t is a binary semaphore
+               that, with LOCK_STATS defined, measures how long threads wait
+               for it and hold it, per lock and per class of lock.  Without
+               LOCK_STATS it is a plain sem_t and every call is the sem_*
+               call it wraps.
+===========================================================================*/
+
+#ifndef LOCK_STATS_H_
+#define LOCK_STATS_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "timestamp.h"      /*  cached clock reads        */
+
+
+// uncomment (or build with -DLOCK_STATS) to measure the locks, compiled out otherwise
+//#define LOCK_STATS
+
+#define LOCK_LABEL_SIZE     48
+#define LOCK_STATS_TOP      10                  /* most contended locks reported */
+
+
+// what happened to a lock or a class of locks
+typedef struct lock_counts_t
+{
+    uint64_t            acquisitions;
+    uint64_t            contended;              /* acquisitions that had to wait */
+    uint64_t            wait_ns;
+    uint64_t            max_wait_ns;
+    uint64_t            hold_ns;
+    uint64_t            max_hold_ns;
+} lock_counts_t;
+
+// locks guarding the same kind of thing, e.g. every connection's write lock
+typedef struct lock_class_t
+{
+    const char         *name;
+    lock_counts_t       retired;                /* of locks destroyed so far */
+    bool                registered;
+    struct lock_class_t *next;
+} lock_class_t;
+
+typedef struct lock_instance_t
+{
+    lock_class_t       *lock_class;
+    char                label[ LOCK_LABEL_SIZE ];   /* which one of its class */
+    lock_counts_t       counts;                 /* only changed by the holder */
+    unsigned long       generation;             /* reset the counts belong to */
+    uint64_t            acquired_ns;
+    bool                registered;
+    struct lock_instance_t *prev;               /* registry of live locks */
+    struct lock_instance_t *next;
+} lock_instance_t;
+
+typedef struct stat_sem_t
+{
+    sem_t               sem;
+#ifdef LOCK_STATS
+    lock_instance_t     stats;
+#endif
+} stat_sem_t;
+
+// a line of the report, a class or one lock
+typedef struct lock_report_t
+{
+    char                name[ 2 * LOCK_LABEL_SIZE ];
+    lock_counts_t       counts;
+} lock_report_t;
+
+
+#ifdef LOCK_STATS
+#define stat_sem_init( lock, lock_class, ... )  lock_stats_init( ( lock ), ( lock_class ), __VA_ARGS__ )
+#define stat_sem_wait( lock )                   lock_stats_wait( lock )
+#define stat_sem_post( lock )                   lock_stats_post( lock )
+#define stat_sem_destroy( lock )                lock_stats_destroy( lock )
+#else
+#define stat_sem_init( lock, lock_class, ... )  sem_init( &( lock )->sem, 0, 1 )
+#define stat_sem_wait( lock )                   sem_wait( &( lock )->sem )
+#define stat_sem_post( lock )                   sem_post( &( lock )->sem )
+#define stat_sem_destroy( lock )                sem_destroy( &( lock )->sem )
+#endif
+
+
+// prototypes
+#ifdef LOCK_STATS
+void lock_stats_init( stat_sem_t *lock, lock_class_t *lock_class, const char *label, ... ) __attribute__(( format( printf, 3, 4 ) ));
+void lock_stats_wait( stat_sem_t *lock );
+void lock_stats_post( stat_sem_t *lock );
+void lock_stats_destroy( stat_sem_t *lock );
+int lock_stats_classes( lock_report_t *report, int max );      /* totals of each class, returns how many */
+int lock_stats_top( lock_report_t *report, int max );          /* locks waited on longest, most first */
+void lock_stats_reset( void );                 /* each lock starts over the next time it is taken */
+#endif
+
+
+#endif /* LOCK_STATS_H_ */
@@ -0,0 +1,195 @@
+/*===========================================================================
+ Filename    : logger.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Asynchronous server log.  Each thread formats its lines into
+               its own single-producer ring, a background thread drains the
+               rings to stdout, so logging never waits on stdio or the
+               terminal.  A line below the current level costs one load.
+===========================================================================*/
+
+#include "logger.h"
+
+
+int log_level = DFLT_LOG_LEVEL;
+
+static const char *level_names[] = { "error", "warn", "info", "debug" };
+
+static __thread log_ring_t *this_ring;         /* NULL until the thread first logs */
+static log_ring_t *rings;                       /* every ring, newest first */
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t flusher;
+static bool flusher_running;
+
+
+// a thread's first line registers its ring
+static log_ring_t *get_ring( void )
+{
+    log_ring_t *ring = calloc( 1, sizeof( log_ring_t ) );
+
+    if( NULL == ring )
+        return NULL;
+
+    pthread_mutex_lock( &rings_mutex );
+    ring->next = rings;
+    __atomic_store_n( &rings, ring, __ATOMIC_RELEASE );
+    pthread_mutex_unlock( &rings_mutex );
+
+    this_ring = ring;
+    return ring;
+}
+
+// A full ring drops the line rather than make the thread wait for the flusher
+void log_write( int level, const char *format, ... )
+{
+    log_ring_t *ring = this_ring;
+    log_line_t *line;
+    unsigned long head;
+    va_list ap;
+
+    if( NULL == ring && NULL == ( ring = get_ring() ) )
+        return;
+
+    head = ring->head;
+    if( head - __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ) >= LOG_RING_SIZE )
+    {
+        __atomic_add_fetch( &ring->dropped, 1, __ATOMIC_RELAXED );
+        return;
+    }
+
+    line = &ring->lines[ head & ( LOG_RING_SIZE - 1 ) ];
+    line->time_ns = timestamp_mono_ns();
+    line->time = timestamp_now();
+    line->level = level;
+
+    va_start( ap, format );
+    vsnprintf( line->text, LOG_LINE_SIZE, format, ap );
+    va_end( ap );
+
+    // the flusher may read the line once head passes it
+    __atomic_store_n( &ring->head, head + 1, __ATOMIC_RELEASE );
+}
+
+// Write out every line waiting, oldest first across all rings.
+// Returns the number of lines written.
+static int drain( void )
+{
+    log_ring_t *ring;
+    log_ring_t *oldest;
+    log_line_t *line;
+    log_line_t *oldest_line;
+    char timestamp[ TIMESTAMP_SIZE ];
+    unsigned long dropped;
+    int count = 0;
+
+    for( ;; )
+    {
+        // the next line to go out is the earliest of each ring's first waiting line
+        oldest = NULL;
+        oldest_line = NULL;
+        for( ring = __atomic_load_n( &rings, __ATOMIC_ACQUIRE ); ring != NULL; ring = ring->next )
+        {
+            if( ring->tail == __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE ) )
+                continue;
+
+            line = &ring->lines[ ring->tail & ( LOG_RING_SIZE - 1 ) ];
+            if( NULL == oldest_line || line->time_ns < oldest_line->time_ns )
+            {
+                oldest = ring;
+                oldest_line = line;
+            }
+        }
+
+        if( NULL == oldest )
+            break;
+
+        timestamp_format( oldest_line->time, timestamp );
+        printf( "[%s] %-5s %s\n", timestamp, level_names[ oldest_line->level ], oldest_line->text );
+        count++;
+
+        // hand the slot back to its thread
+        __atomic_store_n( &oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE );
+    }
+
+    for( ring = __atomic_load_n( &rings, __ATOMIC_ACQUIRE ); ring != NULL; ring = ring->next )
+    {
+        dropped = __atomic_exchange_n( &ring->dropped, 0, __ATOMIC_RELAXED );
+        if( dropped > 0 )
+            printf( "[log] %lu lines dropped, the log could not keep up \n", dropped );
+    }
+
+    if( count > 0 )
+        fflush( stdout );
+
+    return count;
+}
+
+static void *flush_log( void *arg )
+{
+    struct timespec pause = { 0, LOG_FLUSH_NS };
+
+    while( __atomic_load_n( &flusher_running, __ATOMIC_ACQUIRE ) )
+    {
+        if( 0 == drain() )
+            nanosleep( &pause, NULL );
+    }
+
+    return NULL;
+}
+
+void log_init( int level )
+{
+    pthread_attr_t attr;
+
+    log_set_level( level );
+    atexit( log_shutdown );
+
+    pthread_attr_init( &attr );
+    pthread_attr_setstacksize( &attr, LOG_STACK_SIZE );
+
+    // without a flusher, lines are written out at exit as long as they fit
+    __atomic_store_n( &flusher_running, true, __ATOMIC_RELEASE );
+    if( pthread_create( &flusher, &attr, flush_log, NULL ) != 0 )
+        __atomic_store_n( &flusher_running, false, __ATOMIC_RELEASE );
+
+    pthread_attr_destroy( &attr );
+}
+
+void log_shutdown( void )
+{
+    if( __atomic_exchange_n( &flusher_running, false, __ATOMIC_ACQ_REL ) )
+        pthread_join( flusher, NULL );
+
+    drain();
+}
+
+void log_set_level( int level )
+{
+    __atomic_store_n( &log_level, level, __ATOMIC_RELAXED );
+}
+
+int log_parse_level( const char *text )
+{
+    int level;
+    char *end;
+
+    for( level = LOG_LEVEL_ERROR; level <= LOG_LEVEL_DEBUG; level++ )
+    {
+        if( strcasecmp( text, level_names[ level ] ) == 0 )
+            return level;
+    }
+
+    level = strtol( text, &end, 10 );
+    if( '\0' == *text || '\0' != *end || level < LOG_LEVEL_ERROR || level > LOG_LEVEL_DEBUG )
+        return -1;
+
+    return level;
+}
+
+const char *log_level_name( int level )
+{
+    return level_names[ level ];
+}
@@ -0,0 +1,78 @@
+/*===========================================================================
+ Filename    : logger.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Asynchronous server log.  Each thread formats its lines into
+               its own single-producer ring, a background thread drains the
+               rings to stdout, so logging never waits on stdio or the
+               terminal.  A line below the current level costs one load.
+===========================================================================*/
+
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>        /*  strcasecmp()              */
+#include <pthread.h>
+#include "timestamp.h"      /*  cached clock reads        */
+
+
+#define LOG_LEVEL_ERROR     0
+#define LOG_LEVEL_WARN      1
+#define LOG_LEVEL_INFO      2
+#define LOG_LEVEL_DEBUG     3
+#define DFLT_LOG_LEVEL      LOG_LEVEL_INFO
+
+#define LOG_LINE_SIZE       240                 /* longer lines are cut short */
+#define LOG_RING_SIZE       512                 /* lines a thread can have waiting, power of 2 */
+#define LOG_FLUSH_NS        20000000            /* how long the flusher sleeps once the rings are empty */
+#define LOG_STACK_SIZE      ( 64 * 1024 )       /* the flusher only formats timestamps and calls printf() */
+
+
+typedef struct log_line_t
+{
+    uint64_t            time_ns;                /* monotonic, orders lines from different threads */
+    time_t              time;                   /* calendar second shown in the log */
+    int                 level;
+    char                text[ LOG_LINE_SIZE ];  /* formatted, no trailing newline */
+} log_line_t;
+
+// one per thread that has logged, never freed
+typedef struct log_ring_t
+{
+    unsigned long       head;                   /* next line the thread writes */
+    unsigned long       tail;                   /* next line the flusher reads */
+    unsigned long       dropped;                /* lines lost to a full ring */
+    struct log_ring_t  *next;                   /* registry of all rings */
+    log_line_t          lines[ LOG_RING_SIZE ];
+} log_ring_t;
+
+
+extern int log_level;
+
+// The arguments are only evaluated if the level is enabled
+#define log_msg( level, ... )                                                   \
+    do                                                                          \
+    {                                                                           \
+        if( ( level ) <= __atomic_load_n( &log_level, __ATOMIC_RELAXED ) )     \
+            log_write( ( level ), __VA_ARGS__ );                                \
+    } while( 0 )
+
+
+// prototypes
+void log_init( int level );                     /* start the flusher */
+void log_shutdown( void );                      /* stop the flusher and write out what is left */
+void log_write( int level, const char *format, ... ) __attribute__(( format( printf, 2, 3 ) ));
+void log_set_level( int level );
+int log_parse_level( const char *text );        /* level by name or number, -1 if neither */
+const char *log_level_name( int level );
+
+
+#endif /* LOGGER_H_ */
@@ -0,0 +1,63 @@
+/*===========================================================================
+ Filename    : mailbox.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Multi-producer, single-consumer mailbox for handing work to
+               an event loop thread.  Any thread may post, the owning loop
+               is woken through an eventfd and takes everything at once.
+===========================================================================*/
+
+#include "mailbox.h"
+
+
+int init_mailbox( mailbox_t *mailbox )
+{
+    mailbox->head = NULL;
+    mailbox->event_fd = eventfd( 0, EFD_NONBLOCK );
+
+    return mailbox->event_fd < 0 ? -1 : 0;
+}
+
+// Push onto the list.  Only the post that finds the mailbox empty wakes the
+// owner, the owner takes the whole list so later posts ride along.
+void mailbox_post( mailbox_t *mailbox, mail_t *mail )
+{
+    uint64_t one = 1;
+    mail_t *head = __atomic_load_n( &mailbox->head, __ATOMIC_RELAXED );
+
+    // once pushed the mail belongs to the owner, only our copy of head is ours
+    do
+        mail->next = head;
+    while( !__atomic_compare_exchange_n( &mailbox->head, &head, mail, true,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED ) );
+
+    if( head == NULL )
+        write( mailbox->event_fd, &one, sizeof( one ) );
+}
+
+// The wakeup is consumed before the list is taken, so a post that lands after
+// the take leaves the eventfd readable and is not missed.
+mail_t *mailbox_take( mailbox_t *mailbox )
+{
+    uint64_t count;
+    mail_t *mail;
+    mail_t *next;
+    mail_t *oldest = NULL;
+
+    read( mailbox->event_fd, &count, sizeof( count ) );
+
+    mail = __atomic_exchange_n( &mailbox->head, NULL, __ATOMIC_ACQUIRE );
+
+    // the list is newest first, turn it around
+    while( mail != NULL )
+    {
+        next = mail->next;
+        mail->next = oldest;
+        oldest = mail;
+        mail = next;
+    }
+
+    return oldest;
+}
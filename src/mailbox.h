@@ -0,0 +1,49 @@
+/*===========================================================================
+ Filename    : mailbox.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Multi-producer, single-consumer mailbox for handing work to
+               an event loop thread.  Any thread may post, the owning loop
+               is woken through an eventfd and takes everything at once.
+===========================================================================*/
+
+#ifndef MAILBOX_H_
+#define MAILBOX_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "msg_buf.h"        /*  shared message buffers    */
+
+
+typedef struct mail_t
+{
+    struct mail_t      *next;
+    int                 type;                   /* what the owner should do, defined by the user of the mailbox */
+    void               *target;
+    unsigned int        generation;             /* of target when posted, lets the owner spot a re-used target */
+    int                 from_id;                /* type specific, e.g. who the work is on behalf of */
+    unsigned int        from_generation;        /* type specific, e.g. of the connection that asked */
+    int                 arg;                    /* type specific */
+    msg_buf_t          *buf;                    /* reference held by the mail, may be NULL */
+    bool                forwarded;              /* passed on by a former owner of target */
+} mail_t;
+
+typedef struct mailbox_t
+{
+    mail_t             *head;                   /* newest first */
+    int                 event_fd;               /* readable while mail is waiting */
+} mailbox_t;
+
+
+// prototypes
+int init_mailbox( mailbox_t *mailbox );         /* -1 if the eventfd can't be created */
+void mailbox_post( mailbox_t *mailbox, mail_t *mail );
+mail_t *mailbox_take( mailbox_t *mailbox );     /* everything posted so far, oldest first */
+
+
+#endif /* MAILBOX_H_ */
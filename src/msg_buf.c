@@ -0,0 +1,51 @@
+/*===========================================================================
+ Filename    : msg_buf.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Reference counted message buffer.  A message is serialized
+               once and the same bytes are queued for every recipient.
+===========================================================================*/
+
+#include "msg_buf.h"
+
+
+msg_buf_t *msg_buf_new( size_t len )
+{
+    msg_buf_t *buf;
+
+    buf = malloc( sizeof( msg_buf_t ) + len );
+    if( buf == NULL )
+        return NULL;
+
+    buf->refs = 1;
+    buf->trace_id = 0;
+    buf->len  = len;
+
+    return buf;
+}
+
+msg_buf_t *msg_buf_copy( const char *data, size_t len )
+{
+    msg_buf_t *buf;
+
+    buf = msg_buf_new( len );
+    if( buf != NULL )
+        memcpy( buf->data, data, len );
+
+    return buf;
+}
+
+msg_buf_t *msg_buf_ref( msg_buf_t *buf )
+{
+    __atomic_add_fetch( &buf->refs, 1, __ATOMIC_RELAXED );
+    return buf;
+}
+
+// drop a reference, the last owner frees the buffer
+void msg_buf_unref( msg_buf_t *buf )
+{
+    if( __atomic_sub_fetch( &buf->refs, 1, __ATOMIC_ACQ_REL ) == 0 )
+        free( buf );
+}
@@ -0,0 +1,36 @@
+/*===========================================================================
+ Filename    : msg_buf.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Reference counted message buffer.  A message is serialized
+               once and the same bytes are queued for every recipient.
+===========================================================================*/
+
+#ifndef MSG_BUF_H_
+#define MSG_BUF_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+
+typedef struct msg_buf_t
+{
+    int         refs;                           /* owners: creator plus each queue holding it */
+    unsigned int trace_id;                      /* sampled chat line the bytes carry, 0 if not traced */
+    size_t      len;
+    char        data[ ];
+} msg_buf_t;
+
+
+// prototypes
+msg_buf_t *msg_buf_new( size_t len );           /* uninitialized data, one reference */
+msg_buf_t *msg_buf_copy( const char *data, size_t len );
+msg_buf_t *msg_buf_ref( msg_buf_t *buf );
+void msg_buf_unref( msg_buf_t *buf );
+
+
+#endif /* MSG_BUF_H_ */
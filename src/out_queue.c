@@ -0,0 +1,120 @@
+/*===========================================================================
+ Filename    : out_queue.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Per-connection outbound byte queue, flushed to a non-blocking
+               socket with writev() so a slow client never blocks a sender.
+===========================================================================*/
+
+#include "out_queue.h"
+
+
+void init_out_queue( out_queue_t *queue )
+{
+    queue->head  = NULL;
+    queue->tail  = NULL;
+    queue->bytes = 0;
+}
+
+// add a message to the end of the queue, the bytes themselves are shared
+int out_queue_push( out_queue_t *queue, msg_buf_t *buf )
+{
+    out_segment_t *segment;
+
+    segment = malloc( sizeof( out_segment_t ) );
+    if( segment == NULL )
+        return -1;
+
+    segment->next   = NULL;
+    segment->buf    = msg_buf_ref( buf );
+    segment->offset = 0;
+
+    if( queue->tail != NULL )
+        queue->tail->next = segment;
+    else
+        queue->head = segment;
+    queue->tail = segment;
+
+    queue->bytes += buf->len;
+
+    stats_add( messages_out, 1 );
+    stats_add( queued_bytes, buf->len );
+    stats_max( queue_high_water, queue->bytes );
+
+    return 0;
+}
+
+// write as much of the queue as the socket accepts without blocking
+ssize_t out_queue_flush( out_queue_t *queue, int sock_fd )
+{
+    int             i;
+    ssize_t         nwritten;
+    struct iovec    iov[ OUT_QUEUE_IOV ];
+    out_segment_t  *segment;
+
+    while( queue->head != NULL )
+    {
+        // gather the unsent part of the first OUT_QUEUE_IOV segments
+        for( i = 0, segment = queue->head; i < OUT_QUEUE_IOV && segment != NULL; i++, segment = segment->next )
+        {
+            iov[ i ].iov_base = segment->buf->data + segment->offset;
+            iov[ i ].iov_len  = segment->buf->len - segment->offset;
+        }
+
+        nwritten = writev( sock_fd, iov, i );
+
+        if( nwritten < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                break;
+            return OUT_QUEUE_ERR;
+        }
+
+        queue->bytes -= nwritten;
+        stats_add( bytes_out, nwritten );
+        stats_add( queued_bytes, -nwritten );
+
+        // release every segment that was sent completely
+        while( nwritten > 0 )
+        {
+            segment = queue->head;
+
+            if( nwritten < segment->buf->len - segment->offset )
+            {
+                segment->offset += nwritten;
+                break;
+            }
+
+            nwritten -= segment->buf->len - segment->offset;
+            queue->head = segment->next;
+            if( queue->head == NULL )
+                queue->tail = NULL;
+            msg_buf_unref( segment->buf );
+            free( segment );
+        }
+    }
+
+    return queue->bytes;
+}
+
+// discard everything still queued
+void out_queue_clear( out_queue_t *queue )
+{
+    out_segment_t *segment;
+
+    stats_add( queued_bytes, -(int64_t)queue->bytes );
+
+    while( queue->head != NULL )
+    {
+        segment = queue->head;
+        queue->head = segment->next;
+        msg_buf_unref( segment->buf );
+        free( segment );
+    }
+
+    init_out_queue( queue );
+}
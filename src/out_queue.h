@@ -0,0 +1,51 @@
+/*===========================================================================
+ Filename    : out_queue.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Per-connection outbound byte queue, flushed to a non-blocking
+               socket with writev() so a slow client never blocks a sender.
+===========================================================================*/
+
+#ifndef OUT_QUEUE_H_
+#define OUT_QUEUE_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>        /*  writev()                  */
+#include "msg_buf.h"        /*  shared message buffers    */
+#include "stats.h"          /*  live server counters      */
+
+
+#define OUT_QUEUE_IOV       64                  /* segments handed to a single writev() */
+#define OUT_QUEUE_ERR       ( -1 )              /* connection error while flushing */
+
+
+// one queued message, buf->data[ offset .. buf->len - 1 ] is still to be sent
+typedef struct out_segment_t
+{
+    struct out_segment_t   *next;
+    msg_buf_t              *buf;                /* shared with every other queue holding this message */
+    size_t                  offset;
+} out_segment_t;
+
+typedef struct out_queue_t
+{
+    out_segment_t  *head;
+    out_segment_t  *tail;
+    size_t          bytes;                      /* unsent bytes in the queue */
+} out_queue_t;
+
+
+// prototypes
+void init_out_queue( out_queue_t *queue );
+int out_queue_push( out_queue_t *queue, msg_buf_t *buf );       /* takes its own reference to buf */
+ssize_t out_queue_flush( out_queue_t *queue, int sock_fd );     /* returns bytes still queued or OUT_QUEUE_ERR */
+void out_queue_clear( out_queue_t *queue );
+
+
+#endif /* OUT_QUEUE_H_ */
@@ -0,0 +1,153 @@
+/*===========================================================================
+ Filename    : stats.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Live server counters and latency histograms.  Each reactor
+               owns one slot and is its only writer, so an update is a plain
+               load and store with no lock and no shared cache line.  The
+               slots live in a POSIX shared memory segment a scraper maps
+               read-only and sums without calling into the server.
+===========================================================================*/
+
+#include "stats.h"
+
+
+stats_segment_t *stats_segment;
+__thread stats_slot_t *this_stats;
+
+static char stats_shm_name[ STATS_NAME_SIZE ];     /* empty if the segment is private */
+static size_t stats_size;
+
+
+// The segment is recreated on every start, a scraper that still has the one
+// of an earlier run mapped sees a different pid.
+int stats_init( const char *shm_name, int num_slots )
+{
+    int fd;
+    void *mem = MAP_FAILED;
+
+    stats_size = sizeof( stats_segment_t ) + num_slots * sizeof( stats_slot_t );
+
+    if( strlen( shm_name ) < sizeof( stats_shm_name ) )
+    {
+        shm_unlink( shm_name );
+        fd = shm_open( shm_name, O_CREAT | O_EXCL | O_RDWR, 0644 );
+        if( fd >= 0 )
+        {
+            if( ftruncate( fd, stats_size ) == 0 )
+                mem = mmap( NULL, stats_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+            close( fd );
+
+            if( mem != MAP_FAILED )
+                strcpy( stats_shm_name, shm_name );
+            else
+                shm_unlink( shm_name );
+        }
+    }
+
+    // without shared memory the counters still back /stats
+    if( mem == MAP_FAILED )
+    {
+        mem = mmap( NULL, stats_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( mem == MAP_FAILED )
+            return -1;
+    }
+
+    stats_segment = mem;
+    stats_segment->version = STATS_VERSION;
+    stats_segment->slot_size = sizeof( stats_slot_t );
+    stats_segment->num_slots = num_slots;
+    stats_segment->pid = getpid();
+    stats_segment->start_time = timestamp_now();
+    __atomic_store_n( &stats_segment->magic, STATS_MAGIC, __ATOMIC_RELEASE );
+
+    return stats_shm_name[ 0 ] != '\0' ? 0 : -1;
+}
+
+void stats_shutdown( void )
+{
+    if( stats_shm_name[ 0 ] != '\0' )
+        shm_unlink( stats_shm_name );
+}
+
+void stats_attach( int slot )
+{
+    if( stats_segment != NULL && slot >= 0 && slot < (int)stats_segment->num_slots )
+        this_stats = &stats_segment->slots[ slot ];
+}
+
+// names go in before the reactors start, num_commands is published last
+void stats_name_command( int index, const char *name )
+{
+    if( stats_segment == NULL || index < 0 || index >= STATS_MAX_COMMANDS )
+        return;
+
+    snprintf( stats_segment->command_names[ index ], STATS_NAME_SIZE, "%s", name );
+    if( index >= (int)stats_segment->num_commands )
+        __atomic_store_n( &stats_segment->num_commands, index + 1, __ATOMIC_RELEASE );
+}
+
+void stats_record( stats_hist_t *hist, uint64_t ns )
+{
+    int bucket = ( ns == 0 ) ? 0 : 64 - __builtin_clzll( ns );
+
+    if( bucket >= STATS_HIST_BUCKETS )
+        bucket = STATS_HIST_BUCKETS - 1;
+
+    __atomic_store_n( &hist->buckets[ bucket ], hist->buckets[ bucket ] + 1, __ATOMIC_RELAXED );
+    __atomic_store_n( &hist->sum_ns, hist->sum_ns + ns, __ATOMIC_RELAXED );
+    __atomic_store_n( &hist->count, hist->count + 1, __ATOMIC_RELAXED );
+}
+
+// Every field of a slot is a 64 bit counter, so the slots are added up word
+// by word.  The high-water mark is the one field that is not a sum.
+void stats_sum( const stats_segment_t *segment, stats_slot_t *total )
+{
+    uint32_t        i;
+    size_t          word;
+    uint64_t        high_water;
+    uint64_t       *sum = (uint64_t *)total;
+    const uint64_t *slot;
+
+    memset( total, 0, sizeof( stats_slot_t ) );
+
+    for( i = 0; i < segment->num_slots; i++ )
+    {
+        slot = (const uint64_t *)&segment->slots[ i ];
+        for( word = 0; word < sizeof( stats_slot_t ) / sizeof( uint64_t ); word++ )
+            sum[ word ] += __atomic_load_n( &slot[ word ], __ATOMIC_RELAXED );
+    }
+
+    total->queue_high_water = 0;
+    for( i = 0; i < segment->num_slots; i++ )
+    {
+        high_water = __atomic_load_n( &segment->slots[ i ].queue_high_water, __ATOMIC_RELAXED );
+        if( high_water > total->queue_high_water )
+            total->queue_high_water = high_water;
+    }
+}
+
+// The answer is the top of the bucket the percentile (in tenths of a percent)
+// falls in, so it is within a factor of two
+uint64_t stats_percentile( const stats_hist_t *hist, int permille )
+{
+    int         i;
+    uint64_t    seen = 0;
+    uint64_t    rank;
+
+    if( hist->count == 0 )
+        return 0;
+
+    rank = ( hist->count * permille + 999 ) / 1000;
+
+    for( i = 0; i < STATS_HIST_BUCKETS - 1; i++ )
+    {
+        seen += hist->buckets[ i ];
+        if( seen >= rank )
+            return 1ULL << i;
+    }
+
+    return 1ULL << ( STATS_HIST_BUCKETS - 1 );
+}
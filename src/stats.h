@@ -0,0 +1,125 @@
+/*===========================================================================
+ Filename    : stats.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Live server counters and latency histograms.  Each reactor
+               owns one slot and is its only writer, so an update is a plain
+               load and store with no lock and no shared cache line.  The
+               slots live in a POSIX shared memory segment a scraper maps
+               read-only and sums without calling into the server.
+===========================================================================*/
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>          /*  O_* constants             */
+#include <unistd.h>         /*  ftruncate(), getpid()     */
+#include <sys/mman.h>       /*  shm_open(), mmap()        */
+#include <sys/stat.h>       /*  mode constants            */
+#include "timestamp.h"      /*  cached clock reads        */
+
+
+#define STATS_MAGIC         0x43535453          /* "STSC", stored last once the segment is filled in */
+#define STATS_VERSION       1                   /* bumped whenever the layout below changes */
+#define STATS_SHM_FORMAT    "/CST340-chat.%d"   /* segment name unless given with -s, %d is the port */
+#define STATS_NAME_SIZE     64
+#define STATS_MAX_COMMANDS  32                  /* command table entries that get their own counter */
+#define STATS_HIST_BUCKETS  32                  /* bucket i counts latencies below 2^i ns, the last takes the rest */
+#define STATS_SLOT_ALIGN    64                  /* slots never share a cache line */
+
+
+// log2 latency histogram
+typedef struct stats_hist_t
+{
+    uint64_t            count;
+    uint64_t            sum_ns;
+    uint64_t            buckets[ STATS_HIST_BUCKETS ];
+} stats_hist_t;
+
+// the counters of one reactor, written by that reactor only
+typedef struct stats_slot_t
+{
+    uint64_t            connections;            /* accepted and attached */
+    uint64_t            disconnections;
+    uint64_t            refused;                /* blocked or no free slot */
+    uint64_t            logins;
+    uint64_t            messages_in;            /* lines read from clients */
+    uint64_t            bytes_in;
+    uint64_t            messages_out;           /* messages queued to clients */
+    uint64_t            bytes_out;              /* bytes the sockets accepted */
+    uint64_t            dropped;                /* messages past out_queue_limit */
+    uint64_t            fanouts;                /* chat lines delivered to a room */
+    uint64_t            fanout_recipients;
+    uint64_t            invalid_commands;
+    uint64_t            commands[ STATS_MAX_COMMANDS ];     /* by command table position */
+    int64_t             queued_bytes;           /* unsent bytes on this reactor's connections */
+    uint64_t            queue_high_water;       /* most bytes one connection had waiting */
+    stats_hist_t        fanout_ns;
+    stats_hist_t        command_ns;
+} __attribute__(( aligned( STATS_SLOT_ALIGN ) )) stats_slot_t;
+
+// the shared memory segment
+typedef struct stats_segment_t
+{
+    uint32_t            magic;                  /* 0 until the header is valid */
+    uint32_t            version;
+    uint32_t            slot_size;              /* sizeof( stats_slot_t ) */
+    uint32_t            num_slots;
+    uint32_t            num_commands;
+    int32_t             pid;
+    int64_t             start_time;             /* calendar second the server started */
+    char                command_names[ STATS_MAX_COMMANDS ][ STATS_NAME_SIZE ];
+    stats_slot_t        slots[ ];
+} stats_segment_t;
+
+
+extern stats_segment_t *stats_segment;
+extern __thread stats_slot_t *this_stats;      /* NULL on threads that are not counted */
+
+// Only the owning thread writes a slot, the store just has to be atomic for
+// the readers.  A thread without a slot counts nothing.
+#define stats_add( field, n )                                                   \
+    do                                                                          \
+    {                                                                           \
+        stats_slot_t *slot_ = this_stats;                                      \
+        if( slot_ != NULL )                                                     \
+            __atomic_store_n( &slot_->field, slot_->field + ( n ), __ATOMIC_RELAXED );  \
+    } while( 0 )
+
+#define stats_max( field, value )                                               \
+    do                                                                          \
+    {                                                                           \
+        stats_slot_t *slot_ = this_stats;                                      \
+        if( slot_ != NULL && ( value ) > slot_->field )                         \
+            __atomic_store_n( &slot_->field, ( value ), __ATOMIC_RELAXED );    \
+    } while( 0 )
+
+// time since start_ns into one of this thread's histograms
+#define stats_latency( field, start_ns )                                        \
+    do                                                                          \
+    {                                                                           \
+        stats_slot_t *slot_ = this_stats;                                      \
+        if( slot_ != NULL )                                                     \
+            stats_record( &slot_->field, timestamp_mono_ns() - ( start_ns ) ); \
+    } while( 0 )
+
+
+// prototypes
+int stats_init( const char *shm_name, int num_slots );     /* 0 if shared, -1 if the counters are private to the process */
+void stats_shutdown( void );                    /* remove the segment */
+void stats_attach( int slot );                  /* count this thread's work in the given slot */
+void stats_name_command( int index, const char *name );
+void stats_record( stats_hist_t *hist, uint64_t ns );      /* on this thread's own slot */
+void stats_sum( const stats_segment_t *segment, stats_slot_t *total );     /* all slots added up */
+uint64_t stats_percentile( const stats_hist_t *hist, int permille );       /* upper bound in ns, 0 if empty */
+
+
+#endif /* STATS_H_ */
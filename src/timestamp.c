@@ -0,0 +1,65 @@
+/*===========================================================================
+ Filename    : timestamp.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Clock reads for hot paths.  The calendar second comes from the
+               coarse clock and its formatted text is cached per thread, so
+               localtime_r() and strftime() run at most once a second on each
+               thread; a monotonic nanosecond clock is there for timing.
+===========================================================================*/
+
+#include "timestamp.h"
+
+
+// Per thread, so reading it needs no lock and refreshing it no coordination
+static __thread timestamp_cache_t cache = { -1, "" };
+
+
+// The coarse clocks are read from the vDSO page without entering the kernel.
+// They trail the precise clock by at most a scheduler tick, which is plenty
+// for a timestamp shown to the second.
+time_t timestamp_now( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_REALTIME_COARSE, &now );
+
+    return now.tv_sec;
+}
+
+const char *timestamp_text( void )
+{
+    time_t now = timestamp_now();
+
+    if( now != cache.second )
+    {
+        timestamp_format( now, cache.text );
+        cache.second = now;
+    }
+
+    return cache.text;
+}
+
+void timestamp_format( time_t time, char *text )
+{
+    struct tm local;
+
+    if( time == cache.second )
+    {
+        memcpy( text, cache.text, TIMESTAMP_SIZE );
+        return;
+    }
+
+    strftime( text, TIMESTAMP_SIZE, TIMESTAMP_FORMAT, localtime_r( &time, &local ) );
+}
+
+uint64_t timestamp_mono_ns( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
@@ -0,0 +1,41 @@
+/*===========================================================================
+ Filename    : timestamp.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Clock reads for hot paths.  The calendar second comes from the
+               coarse clock and its formatted text is cached per thread, so
+               localtime_r() and strftime() run at most once a second on each
+               thread; a monotonic nanosecond clock is there for timing.
+===========================================================================*/
+
+#ifndef TIMESTAMP_H_
+#define TIMESTAMP_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+
+#define TIMESTAMP_SIZE      20                  /* length of timestamp ddd HH:MM:SS PM */
+#define TIMESTAMP_FORMAT    "%a %I:%M:%S %p"
+#define NSEC_PER_SEC        1000000000ULL
+
+
+// the last second formatted on a thread
+typedef struct timestamp_cache_t
+{
+    time_t              second;                 /* -1 until the first use */
+    char                text[ TIMESTAMP_SIZE ];
+} timestamp_cache_t;
+
+
+// prototypes
+time_t timestamp_now( void );                   /* calendar second, no system call */
+const char *timestamp_text( void );             /* the current second formatted, good until this thread's next call */
+void timestamp_format( time_t time, char *text );   /* any second into TIMESTAMP_SIZE bytes */
+uint64_t timestamp_mono_ns( void );             /* monotonic nanoseconds, for measuring intervals */
+
+
+#endif /* TIMESTAMP_H_ */
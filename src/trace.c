@@ -0,0 +1,169 @@
+/*===========================================================================
+ Filename    : trace.c
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Sampled per-message tracing.  One chat line in trace_every is
+               given an id that follows it from the read to the last
+               delivery, and each step it passes records a span into its
+               thread's ring.  The rings are written out as Chrome trace
+               JSON on demand.  An untraced message costs one branch per step.
+===========================================================================*/
+
+#include "trace.h"
+
+
+unsigned int trace_every;
+__thread unsigned int trace_current;
+
+static __thread trace_ring_t *this_ring;       /* NULL until the thread first traces */
+static __thread unsigned int sample_count;     /* messages seen since the last sampled one */
+static trace_ring_t *rings;                     /* every ring, newest first */
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int last_id;
+
+
+void trace_set_every( unsigned int every )
+{
+    __atomic_store_n( &trace_every, every, __ATOMIC_RELAXED );
+}
+
+// Sampling is counted per thread, so picking a message touches nothing shared
+unsigned int trace_next_id( void )
+{
+    unsigned int every = __atomic_load_n( &trace_every, __ATOMIC_RELAXED );
+    unsigned int id;
+
+    if( every == 0 || ++sample_count < every )
+        return 0;
+
+    sample_count = 0;
+
+    // 0 means untraced, skip it when the ids wrap
+    do
+        id = __atomic_add_fetch( &last_id, 1, __ATOMIC_RELAXED );
+    while( id == 0 );
+
+    return id;
+}
+
+// a thread's first event registers its ring
+static trace_ring_t *get_ring( void )
+{
+    trace_ring_t *ring = calloc( 1, sizeof( trace_ring_t ) );
+
+    if( NULL == ring )
+        return NULL;
+
+    ring->tid = syscall( SYS_gettid );
+
+    pthread_mutex_lock( &rings_mutex );
+    ring->next = rings;
+    __atomic_store_n( &rings, ring, __ATOMIC_RELEASE );
+    pthread_mutex_unlock( &rings_mutex );
+
+    this_ring = ring;
+    return ring;
+}
+
+// The ring never waits for a reader, a dump running at the same time skips
+// whatever may have been overwritten while it copied
+void trace_record( unsigned int id, const char *name, uint64_t start_ns, uint64_t end_ns, int arg )
+{
+    trace_ring_t *ring = this_ring;
+    trace_event_t *event;
+
+    if( NULL == ring && NULL == ( ring = get_ring() ) )
+        return;
+
+    event = &ring->events[ ring->head & ( TRACE_RING_SIZE - 1 ) ];
+    __atomic_store_n( &event->start_ns, start_ns, __ATOMIC_RELAXED );
+    __atomic_store_n( &event->end_ns, end_ns, __ATOMIC_RELAXED );
+    __atomic_store_n( &event->name, name, __ATOMIC_RELAXED );
+    __atomic_store_n( &event->id, id, __ATOMIC_RELAXED );
+    __atomic_store_n( &event->arg, arg, __ATOMIC_RELAXED );
+
+    __atomic_store_n( &ring->head, ring->head + 1, __ATOMIC_RELEASE );
+}
+
+// copy of a ring's events, oldest first, that were not being overwritten
+static unsigned long copy_ring( trace_ring_t *ring, trace_event_t *copy )
+{
+    unsigned long   head = __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE );
+    unsigned long   first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    unsigned long   i;
+    trace_event_t  *event;
+
+    for( i = first; i < head; i++ )
+    {
+        event = &ring->events[ i & ( TRACE_RING_SIZE - 1 ) ];
+        copy[ i - first ].start_ns = __atomic_load_n( &event->start_ns, __ATOMIC_RELAXED );
+        copy[ i - first ].end_ns = __atomic_load_n( &event->end_ns, __ATOMIC_RELAXED );
+        copy[ i - first ].name = __atomic_load_n( &event->name, __ATOMIC_RELAXED );
+        copy[ i - first ].id = __atomic_load_n( &event->id, __ATOMIC_RELAXED );
+        copy[ i - first ].arg = __atomic_load_n( &event->arg, __ATOMIC_RELAXED );
+    }
+
+    // the thread may have moved on to event head meanwhile, its slot and
+    // those of the events it recorded since can't be trusted
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    i = __atomic_load_n( &ring->head, __ATOMIC_RELAXED ) + 1;
+    if( i > first + TRACE_RING_SIZE )
+    {
+        i -= TRACE_RING_SIZE;
+        if( i >= head )
+            return 0;
+        memmove( copy, copy + ( i - first ), ( head - i ) * sizeof( trace_event_t ) );
+        first = i;
+    }
+
+    return head - first;
+}
+
+// Complete ("X") events in microseconds, one track per thread and the
+// message id in the arguments
+int trace_dump( const char *path )
+{
+    FILE           *file;
+    trace_ring_t   *ring;
+    trace_event_t  *copy;
+    unsigned long   count;
+    unsigned long   i;
+    int             written = 0;
+    int             pid = getpid();
+
+    copy = malloc( TRACE_RING_SIZE * sizeof( trace_event_t ) );
+    if( NULL == copy )
+        return -1;
+
+    file = fopen( path, "w" );
+    if( NULL == file )
+    {
+        free( copy );
+        return -1;
+    }
+
+    fprintf( file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" );
+
+    for( ring = __atomic_load_n( &rings, __ATOMIC_ACQUIRE ); ring != NULL; ring = ring->next )
+    {
+        count = copy_ring( ring, copy );
+        for( i = 0; i < count; i++ )
+        {
+            fprintf( file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"msg\":%u,\"arg\":%d}}",
+                     written > 0 ? "," : "", copy[ i ].name, pid, ring->tid,
+                     copy[ i ].start_ns / 1000.0, ( copy[ i ].end_ns - copy[ i ].start_ns ) / 1000.0,
+                     copy[ i ].id, copy[ i ].arg );
+            written++;
+        }
+    }
+
+    fprintf( file, "\n]}\n" );
+    free( copy );
+
+    if( fclose( file ) != 0 )
+        return -1;
+
+    return written;
+}
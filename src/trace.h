@@ -0,0 +1,90 @@
+/*===========================================================================
+ Filename    : trace.h
+ Authors     : Jeremy Greenwood <jeremy.greenwood@oit.edu>,
+             : Joshua Durkee    <joshua.durkee@oit.edu>
+ Course      : CST 340
+ Assignment  : 6
+ Description : Sampled per-message tracing.  One chat line in trace_every is
+               given an id that follows it from the read to the last
+               delivery, and each step it passes records a span into its
+               thread's ring.  The rings are written out as Chrome trace
+               JSON on demand.  An untraced message costs one branch per step.
+===========================================================================*/
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>         /*  getpid(), syscall()       */
+#include <sys/syscall.h>    /*  SYS_gettid                */
+#include <pthread.h>
+#include "timestamp.h"      /*  cached clock reads        */
+
+
+#define TRACE_RING_SIZE     8192                /* most recent events kept per thread, power of 2 */
+#define TRACE_FILE_FORMAT   "trace-%d-%d.json"  /* dump file, pid and dump number */
+#define TRACE_FILE_SIZE     64
+
+
+// a step of a traced message, end_ns == start_ns for an instant
+typedef struct trace_event_t
+{
+    uint64_t            start_ns;               /* monotonic */
+    uint64_t            end_ns;
+    const char         *name;                   /* static string */
+    unsigned int        id;                     /* message the event belongs to */
+    int                 arg;                    /* step specific, e.g. bytes or recipients */
+} trace_event_t;
+
+// one per thread that has traced, never freed; older events are overwritten
+typedef struct trace_ring_t
+{
+    unsigned long       head;                   /* events recorded so far */
+    int                 tid;
+    struct trace_ring_t *next;                  /* registry of all rings */
+    trace_event_t       events[ TRACE_RING_SIZE ];
+} trace_ring_t;
+
+
+extern unsigned int trace_every;                /* 0 when tracing is off */
+extern __thread unsigned int trace_current;    /* message being handled on this thread, 0 if untraced */
+
+#define trace_on( id )      __builtin_expect( ( id ) != 0, 0 )
+
+// id for a new message, 0 unless tracing is on and this one is sampled
+#define trace_sample()                                                          \
+    ( trace_on( __atomic_load_n( &trace_every, __ATOMIC_RELAXED ) ) ? trace_next_id() : 0 )
+
+// start time of a step, only read when the message is traced
+#define trace_start( id )   ( trace_on( id ) ? timestamp_mono_ns() : 0 )
+
+#define trace_span( id, name, start_ns, arg )                                   \
+    do                                                                          \
+    {                                                                           \
+        if( trace_on( id ) )                                                    \
+            trace_record( ( id ), ( name ), ( start_ns ), timestamp_mono_ns(), ( arg ) );  \
+    } while( 0 )
+
+#define trace_instant( id, name, arg )                                          \
+    do                                                                          \
+    {                                                                           \
+        if( trace_on( id ) )                                                    \
+        {                                                                       \
+            uint64_t now_ = timestamp_mono_ns();                                \
+            trace_record( ( id ), ( name ), now_, now_, ( arg ) );              \
+        }                                                                       \
+    } while( 0 )
+
+
+// prototypes
+void trace_set_every( unsigned int every );    /* trace one message in every, 0 stops tracing */
+unsigned int trace_next_id( void );             /* 0 if this message is not sampled */
+void trace_record( unsigned int id, const char *name, uint64_t start_ns, uint64_t end_ns, int arg );
+int trace_dump( const char *path );             /* events written, -1 if the file can't be written */
+
+
+#endif /* TRACE_H_ */